@@ -37,8 +37,1136 @@
 
 #include "GPIO.h"
 #include "sbpd.h"
+#include "stats.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
 
 #include <wiringPi.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <linux/gpio.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+//
+// Prototypes
+//
+void updateButtons(uint64_t levels, uint64_t edge_us);
+void updateEncoders(uint64_t levels, uint64_t edge_us);
+
+//
+//  Input level snapshot
+//  On BCM283x/2711 SoCs /dev/gpiomem maps the GPIO register block.
+//  GPLEV0/GPLEV1 hold the levels of all pins, so a single register read
+//  samples every input at the same instant.
+//  Without the mapping we fall back to digitalRead() per configured pin.
+//
+#define GPIO_BLOCK_SIZE 4096
+#define GPLEV0 (0x34 / 4)
+#define GPLEV1 (0x38 / 4)
+static volatile uint32_t * gpio_map = NULL;
+//
+//  All pins used as inputs by buttons and encoders
+//
+static uint64_t input_mask = 0;
+//
+//  Levels of the virtual pins, set by the button matrix scanner
+//  and the I/O expander
+//
+static volatile uint64_t virtual_levels = VIRTUAL_PIN_MASK;
+
+//
+//  Set the virtual pins in mask to levels
+//  Each source owns its pins, the main thread may set up or release one
+//  while the edge service updates another.
+//
+static void set_virtual_levels(uint64_t mask, uint64_t levels) {
+    __atomic_fetch_or(&virtual_levels, levels & mask, __ATOMIC_RELAXED);
+    __atomic_fetch_and(&virtual_levels, levels | ~mask, __ATOMIC_RELAXED);
+}
+
+static void update_input_mask();
+
+//
+//  Button matrix
+//  Idle, all rows are driven low and a key press pulls its column low,
+//  which wakes the edge service. Then the matrix is scanned on a timer,
+//  one row driven low at a time with the others floating, until all keys
+//  are released. Keys are debounced one by one and fed to updateButtons
+//  as virtual pins, so they are classified like any other button.
+//
+#define MATRIX_SCAN_US          2000    // scan period while keys are down
+#define MATRIX_SETTLE_US        5       // column settle time after driving a row
+#define MATRIX_DEBOUNCE_SCANS   3       // scans a key must be stable to change
+
+struct matrix {
+    volatile bool active;
+    int rows[max_matrix_rows];
+    int numberofrows;
+    int columns[max_matrix_columns];
+    int numberofcolumns;
+    uint64_t column_mask;
+    uint64_t key_mask;                  // virtual pins of the keys
+    uint32_t keys;                      // debounced, bit row * columns + column set: down
+    uint32_t bouncing;                  // keys whose raw state differs
+    uint8_t bounce[max_virtual_pins];   // scans the raw state differed
+    bool polling;                       // a column has no edge events, scan all the time
+    bool scanning;
+    int timer;                          // timerfd, -1 if none
+    // statistics
+    uint64_t scans;
+    uint64_t scan_ns;                   // time spent in scans
+    uint64_t scanning_us;               // time the scan timer ran
+    uint64_t scanning_since;
+};
+static struct matrix matrix = { .timer = -1 };
+static struct histogram matrix_scan_hist = { .name = "Button matrix scan" };
+
+//
+//  Simulated GPIO
+//  Levels of the input pins, rows driven low and matrix keys down
+//
+static bool simulated = false;
+static int sim_fd = -1;
+static uint64_t sim_levels = ~VIRTUAL_PIN_MASK;    // pull-ups
+static uint64_t sim_driven = 0;
+static uint32_t sim_keys = 0;
+
+//
+//  Columns of the simulated matrix
+//  Rows driven low pull the columns of their keys down, and through these
+//  the rows and columns of further keys. That's how ghost keys appear on
+//  a matrix without diodes.
+//
+static uint64_t sim_matrix_columns(uint64_t levels) {
+    if (!matrix.active)
+        return levels;
+    int columns = matrix.numberofcolumns;
+    uint32_t column_bits = (1u << columns) - 1;
+    uint32_t rows = 0;
+    for (int r = 0; r < matrix.numberofrows; r++)
+        if (sim_driven & PIN_MASK(matrix.rows[r]))
+            rows |= 1u << r;
+    uint32_t low = 0;
+    uint32_t reached;
+    do {
+        reached = rows;
+        for (int r = 0; r < matrix.numberofrows; r++)
+            if (rows & (1u << r))
+                low |= (sim_keys >> (r * columns)) & column_bits;
+        for (int r = 0; r < matrix.numberofrows; r++)
+            if ((sim_keys >> (r * columns)) & low)
+                rows |= 1u << r;
+    } while (rows != reached);
+    for (int c = 0; c < columns; c++)
+        if (low & (1u << c))
+            levels &= ~PIN_MASK(matrix.columns[c]);
+    return levels;
+}
+
+//
+//  I/O expander
+//  MCP23017 class expander on /dev/i2c-N. All 16 pins are inputs with
+//  pull-ups, a change pulls the shared open drain interrupt output low.
+//  Its falling edge makes the edge service read both ports in one I2C
+//  transfer, which also clears the interrupt, and the changes are fed to
+//  the decoders as virtual pins.
+//  Register addresses for IOCON.BANK = 0, port A and B registers are pairs.
+//
+#define MCP_IODIRA          0x00
+#define MCP_IPOLA           0x02
+#define MCP_GPINTENA        0x04
+#define MCP_DEFVALA         0x06
+#define MCP_INTCONA         0x08
+#define MCP_IOCON           0x0a    // also at 0x0b
+#define MCP_GPPUA           0x0c
+#define MCP_INTFA           0x0e
+#define MCP_INTCAPA         0x10
+#define MCP_GPIOA           0x12
+#define MCP_OLATA           0x14
+#define MCP_REGISTERS       0x16
+
+#define MCP_IOCON_MIRROR    0x40    // INTA and INTB signal both ports
+#define MCP_IOCON_SEQOP     0x20    // set: address pointer stays on the pair
+#define MCP_IOCON_ODR       0x04    // open drain interrupt output
+#define MCP_IOCON_INTPOL    0x02    // active high interrupt output, without ODR
+
+#define EXPANDER_MAX_READS  8       // reads per interrupt while the output stays low
+
+struct expander {
+    volatile bool active;
+    int interrupt;                  // GPIO pin of the interrupt output
+    int address;
+    int bus;
+    int fd;                         // I2C device, -1 if none or simulated
+    uint16_t inputs;                // last read, bit set: high
+    // statistics
+    uint64_t reads;
+    uint64_t failures;
+    uint64_t read_ns;
+};
+static struct expander expander = { .fd = -1 };
+static struct histogram expander_read_hist = { .name = "I/O expander read" };
+
+//
+//  Simulated expander
+//  Registers, pin levels and ports with an interrupt not yet cleared.
+//  Reads and writes go through the address pointer like on the I2C bus,
+//  so the driver code runs unchanged.
+//
+static struct {
+    uint8_t regs[MCP_REGISTERS];
+    uint16_t pins;                  // external levels, bit set: high
+    uint8_t pending;                // bit 0: port A, bit 1: port B
+} sim_mcp = { .regs = { [MCP_IODIRA] = 0xff, [MCP_IODIRA + 1] = 0xff }, .pins = 0xffff };
+
+//
+//  Port value as read from GPIOA/B
+//
+static uint8_t sim_mcp_port(int port) {
+    uint8_t inputs = sim_mcp.regs[MCP_IODIRA + port];
+    uint8_t levels = (sim_mcp.pins >> (8 * port)) ^ sim_mcp.regs[MCP_IPOLA + port];
+    return (levels & inputs) | (sim_mcp.regs[MCP_OLATA + port] & ~inputs);
+}
+
+//
+//  Raise the interrupt of a port for the pins in trigger
+//  The first trigger captures the port, later ones wait for the clear
+//
+static void sim_mcp_trigger(int port, uint8_t trigger) {
+    if (!trigger || (sim_mcp.pending & (1 << port)))
+        return;
+    sim_mcp.regs[MCP_INTFA + port] = trigger;
+    sim_mcp.regs[MCP_INTCAPA + port] = sim_mcp_port(port);
+    sim_mcp.pending |= 1 << port;
+}
+
+//
+//  Pins that differ from DEFVAL keep interrupting while INTCON compares them
+//
+static uint8_t sim_mcp_mismatch(int port) {
+    uint8_t enabled = sim_mcp.regs[MCP_GPINTENA + port] & sim_mcp.regs[MCP_IODIRA + port];
+    return enabled & sim_mcp.regs[MCP_INTCONA + port] &
+           (sim_mcp_port(port) ^ sim_mcp.regs[MCP_DEFVALA + port]);
+}
+
+//
+//  Drive the simulated interrupt output
+//  INTA is the one wired, it signals port B too when mirrored
+//
+static void sim_mcp_output() {
+    if (!expander.interrupt)
+        return;
+    uint8_t iocon = sim_mcp.regs[MCP_IOCON];
+    bool active = (iocon & MCP_IOCON_MIRROR) ? (sim_mcp.pending != 0) : (sim_mcp.pending & 1);
+    bool high = ((iocon & MCP_IOCON_ODR) || !(iocon & MCP_IOCON_INTPOL)) ? !active : active;
+    uint64_t mask = PIN_MASK(expander.interrupt);
+    sim_levels = high ? (sim_levels | mask) : (sim_levels & ~mask);
+}
+
+//
+//  External level change of an expander pin
+//
+static void sim_mcp_input(int pin, bool level) {
+    uint8_t before[2] = { sim_mcp_port(0), sim_mcp_port(1) };
+    sim_mcp.pins = level ? (sim_mcp.pins | (1 << pin)) : (sim_mcp.pins & ~(1 << pin));
+    for (int port = 0; port < 2; port++) {
+        uint8_t enabled = sim_mcp.regs[MCP_GPINTENA + port] & sim_mcp.regs[MCP_IODIRA + port];
+        uint8_t changed = (before[port] ^ sim_mcp_port(port)) & ~sim_mcp.regs[MCP_INTCONA + port];
+        sim_mcp_trigger(port, (enabled & changed) | sim_mcp_mismatch(port));
+    }
+    sim_mcp_output();
+}
+
+//
+//  I2C transfer: write the address pointer, then read or write registers
+//  Reading GPIO or INTCAP of a port clears its interrupt.
+//
+static void sim_mcp_transfer(uint8_t reg, uint8_t * data, int length, bool read) {
+    for (int i = 0; i < length; i++) {
+        if (reg >= MCP_REGISTERS)
+            reg = 0;
+        int port = reg & 1;
+        if (read) {
+            data[i] = ((reg & ~1) == MCP_GPIOA) ? sim_mcp_port(port) : sim_mcp.regs[reg];
+            if (((reg & ~1) == MCP_GPIOA) || ((reg & ~1) == MCP_INTCAPA)) {
+                sim_mcp.pending &= ~(1 << port);
+                sim_mcp.regs[MCP_INTFA + port] = 0;
+                sim_mcp_trigger(port, sim_mcp_mismatch(port));
+            }
+        } else if ((reg & ~1) == MCP_IOCON) {
+            sim_mcp.regs[MCP_IOCON] = sim_mcp.regs[MCP_IOCON + 1] = data[i];
+        } else if ((reg & ~1) == MCP_GPIOA) {
+            sim_mcp.regs[MCP_OLATA + port] = data[i];
+        } else if (((reg & ~1) != MCP_INTFA) && ((reg & ~1) != MCP_INTCAPA)) {
+            sim_mcp.regs[reg] = data[i];
+        }
+        reg = (sim_mcp.regs[MCP_IOCON] & MCP_IOCON_SEQOP) ? (reg ^ 1) : (reg + 1);
+    }
+    sim_mcp_output();
+}
+
+//
+//  Read levels of all inputs
+//  Returns: bitmask, bit n set if BCM pin n reads high
+//
+static uint64_t read_levels() {
+    uint64_t levels = 0;
+    if (simulated) {
+        levels = sim_matrix_columns(sim_levels);
+    } else if (gpio_map) {
+        levels = gpio_map[GPLEV0];
+    } else {
+        uint64_t mask = input_mask & ~VIRTUAL_PIN_MASK;
+        while (mask) {
+            int pin = __builtin_ctzll(mask);
+            if (digitalRead(pin))
+                levels |= PIN_MASK(pin);
+            mask &= mask - 1;
+        }
+    }
+    return (levels & ~VIRTUAL_PIN_MASK) | virtual_levels;
+}
+
+//
+//  Pin setup, skipped for simulated GPIO
+//
+static void input_pin(int pin, int resist) {
+    if (simulated)
+        return;
+    pinMode(pin, INPUT);
+    pullUpDnControl(pin, resist);
+}
+
+//
+//  Drive a matrix row low or let it float
+//
+static void drive_row(int pin, bool drive) {
+    if (simulated) {
+        sim_driven = drive ? (sim_driven | PIN_MASK(pin)) : (sim_driven & ~PIN_MASK(pin));
+        return;
+    }
+    if (drive) {
+        digitalWrite(pin, LOW);
+        pinMode(pin, OUTPUT);
+    } else {
+        pinMode(pin, INPUT);
+    }
+}
+
+//
+//  Map the GPIO level registers
+//  Only done on SoCs with the known BCM register layout
+//
+static void map_levels() {
+    char compatible[256];
+    memset(compatible, 0, sizeof(compatible));
+    int fd = open("/proc/device-tree/compatible", O_RDONLY);
+    if (fd < 0)
+        return;
+    ssize_t len = read(fd, compatible, sizeof(compatible) - 1);
+    close(fd);
+    // compatible is a list of zero terminated strings
+    for (ssize_t i = 0; i < len; i++)
+        if (!compatible[i])
+            compatible[i] = ' ';
+    if (!strstr(compatible, "bcm2835") && !strstr(compatible, "bcm2836") &&
+        !strstr(compatible, "bcm2837") && !strstr(compatible, "bcm2711")) {
+        loginfo("Unknown SoC, reading GPIO levels per pin");
+        return;
+    }
+    fd = open("/dev/gpiomem", O_RDONLY | O_SYNC | O_CLOEXEC);
+    if (fd < 0) {
+        loginfo("/dev/gpiomem not available, reading GPIO levels per pin");
+        return;
+    }
+    void * map = mmap(NULL, GPIO_BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        loginfo("Could not map GPIO registers, reading GPIO levels per pin");
+        return;
+    }
+    gpio_map = (volatile uint32_t *)map;
+    loginfo("GPIO level registers mapped");
+}
+
+//
+//  Edge service
+//  Every configured pin is requested as a line event handle from the GPIO
+//  character device. One thread multiplexes all of them with epoll and
+//  runs the button and encoder decoders, instead of one wiringPi ISR
+//  thread per pin.
+//  Pins that can't be requested this way fall back to wiringPiISR().
+//
+#define max_lines (max_gpio_buttons + 2 * max_encoders)
+#define EVENT_BATCH 16
+
+#define LINE_BUTTON     0x1
+#define LINE_ENCODER    0x2
+#define LINE_MATRIX     0x4
+#define LINE_EXPANDER   0x8
+
+//
+//  Other descriptors of the edge service, epoll data beyond the lines
+//
+#define EPOLL_MATRIX_TIMER  max_lines
+#define EPOLL_SIM_INPUT     (max_lines + 1)
+#define EPOLL_RELEASE       (max_lines + 2)
+#define max_epoll           (max_lines + 3)
+
+struct gpio_line {
+    int pin;    // -1: slot unused
+    int fd;     // -1 for simulated GPIO, slot unused once pin and fd are -1
+    int kind;
+    int edge;   // decoders only run on these edges
+    volatile bool released; // fd is closed by the edge service
+};
+static struct gpio_line lines[max_lines];
+static int numberoflines = 0;
+static int gpiochip = -1;
+static int edge_epoll = -1;
+static pthread_t edge_thread;
+//
+//  Lines released while the edge service runs are closed by the edge
+//  service: it may still read a line returned by epoll_wait() before the
+//  release. The main thread waits for the acknowledge, the GPIO line is
+//  free again afterwards.
+//
+static int release_event = -1;
+static int release_ack = -1;
+#define RELEASE_TIMEOUT_MS 1000
+//
+//  Pins with a wiringPi interrupt, these can't be released
+//
+static uint64_t isr_mask = 0;
+
+//
+//  Edge service thread stack. Small since it gets locked in realtime mode
+//
+#define EDGE_STACK_SIZE (256 * 1024)
+#define EDGE_STACK_PREFAULT (64 * 1024)
+
+//
+//  Latency from kernel edge timestamp to decoder dispatch
+//
+static struct histogram edge_latency = { .name = "GPIO edge to dispatch" };
+static clockid_t edge_clock = -1;
+
+//
+//  An edge read from one of the lines
+//  Line data is copied, a reload may release the line meanwhile
+//
+struct edge {
+    uint64_t timestamp;
+    int pin;
+    int kind;
+    int edge;
+    bool rising;
+};
+
+//
+//  Find the GPIO chip driving the SoC pins
+//  BCM pin numbers are the line offsets on that chip
+//
+static int open_gpiochip() {
+    char path[32];
+    for (int chip = 0; chip < 8; chip++) {
+        snprintf(path, sizeof(path), "/dev/gpiochip%d", chip);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        struct gpiochip_info info;
+        if ((ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) == 0) &&
+            (strncmp(info.label, "pinctrl-", 8) == 0)) {
+            loginfo("Using GPIO chip %s (%s)", info.name, info.label);
+            return fd;
+        }
+        close(fd);
+    }
+    loginfo("No GPIO character device found, using wiringPi interrupts");
+    return -1;
+}
+
+//
+//  Register a pin with the edge service
+//  Lines can be added while the edge service runs
+//  Parameters:
+//      pin: GPIO-Pin used in BCM numbering scheme
+//      kind: LINE_BUTTON, LINE_ENCODER, LINE_MATRIX or LINE_EXPANDER
+//      edge: wiringPi edge the decoders should run on
+//      isr: wiringPi interrupt handler used if the line can't be requested,
+//           NULL for none
+//  Returns: false if the pin got no line
+//
+static bool request_line(int pin, int kind, int edge, void (*isr)(void)) {
+    int index = 0;
+    while ((index < numberoflines) && ((lines[index].pin >= 0) || (lines[index].fd >= 0)))
+        index++;
+    if (simulated && (index < max_lines)) {
+        lines[index].pin = pin;
+        lines[index].kind = kind;
+        lines[index].edge = edge;
+        lines[index].fd = -1;
+        if (index == numberoflines)
+            numberoflines++;
+        return true;
+    }
+    if ((gpiochip >= 0) && (index < max_lines)) {
+        struct gpioevent_request request;
+        memset(&request, 0, sizeof(request));
+        request.lineoffset = pin;
+        request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+        // always watch both edges to keep track of the pin level
+        request.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+        strncpy(request.consumer_label, USER_AGENT, sizeof(request.consumer_label) - 1);
+        if (ioctl(gpiochip, GPIO_GET_LINEEVENT_IOCTL, &request) == 0) {
+            struct gpio_line * line = lines + index;
+            line->pin = pin;
+            line->kind = kind;
+            line->edge = edge;
+            line->fd = request.fd;
+            if (index == numberoflines)
+                numberoflines++;
+            if (edge_epoll >= 0) {
+                struct epoll_event event;
+                memset(&event, 0, sizeof(event));
+                event.events = EPOLLIN;
+                event.data.u32 = index;
+                epoll_ctl(edge_epoll, EPOLL_CTL_ADD, line->fd, &event);
+            }
+            return true;
+        }
+        logwarn("Could not request GPIO line %d: %s", pin, strerror(errno));
+    }
+    if (!isr)
+        return false;
+    //
+    //  wiringPi keeps the interrupt of a released pin,
+    //  the decoders ignore pins no longer in use
+    //
+    if (isr_mask & PIN_MASK(pin))
+        return true;
+    isr_mask |= PIN_MASK(pin);
+    wiringPiISR(pin, edge, isr);
+    return true;
+}
+
+//
+//  Wait until the edge service closed the released lines
+//  It acknowledges after the edges it already collected are replayed
+//
+static void wait_released() {
+    uint64_t count = 1;
+    if (write(release_event, &count, sizeof(count)) != sizeof(count)) {
+        logerr("Could not hand GPIO lines to the edge service: %s", strerror(errno));
+        return;
+    }
+    struct pollfd ack = { .fd = release_ack, .events = POLLIN };
+    int result;
+    do {
+        result = poll(&ack, 1, RELEASE_TIMEOUT_MS);
+    } while ((result < 0) && (errno == EINTR));
+    if ((result <= 0) || (read(release_ack, &count, sizeof(count)) != sizeof(count)))
+        logerr("GPIO edge service did not release the lines");
+}
+
+//
+//  Release the line of a pin
+//  While the edge service runs the line leaves epoll here and is closed
+//  by the edge service
+//
+static void release_line(int pin) {
+    bool handed_over = false;
+    for (struct gpio_line * line = lines; line < lines + numberoflines; line++) {
+        if (line->pin != pin)
+            continue;
+        __atomic_store_n(&line->pin, -1, __ATOMIC_RELAXED);
+        if (line->fd < 0)
+            continue;
+        if (edge_epoll >= 0) {
+            epoll_ctl(edge_epoll, EPOLL_CTL_DEL, line->fd, NULL);
+            __atomic_store_n(&line->released, true, __ATOMIC_RELEASE);
+            handed_over = true;
+        } else {
+            close(line->fd);
+            line->fd = -1;
+        }
+    }
+    if (handed_over)
+        wait_released();
+}
+
+//
+//  Close the released lines, called by the edge service between batches
+//
+static void close_released() {
+    uint64_t count;
+    if (read(release_event, &count, sizeof(count)) != sizeof(count))
+        return;
+    for (struct gpio_line * line = lines; line < lines + numberoflines; line++) {
+        if (!__atomic_load_n(&line->released, __ATOMIC_ACQUIRE))
+            continue;
+        close(line->fd);
+        line->released = false;
+        __atomic_store_n(&line->fd, -1, __ATOMIC_RELEASE);
+    }
+    count = 1;
+    if (write(release_ack, &count, sizeof(count)) != sizeof(count))
+        logerr("Could not acknowledge released GPIO lines: %s", strerror(errno));
+}
+
+//
+//  Age of an edge in µs
+//  Kernels before 5.7 stamp edges with CLOCK_REALTIME, later ones with
+//  CLOCK_MONOTONIC. Pick the clock on the first edge.
+//
+static uint64_t edge_age_us(uint64_t timestamp) {
+    struct timespec ts;
+    if (edge_clock == -1) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t mono = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        edge_clock = ((timestamp <= mono) && (mono - timestamp < 10000000000ULL)) ?
+                     CLOCK_MONOTONIC : CLOCK_REALTIME;
+    }
+    clock_gettime(edge_clock, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return (now > timestamp) ? (now - timestamp) / 1000 : 0;
+}
+
+static bool edge_triggers(int edge, bool rising) {
+    if (edge == INT_EDGE_FALLING)
+        return !rising;
+    if (edge == INT_EDGE_RISING)
+        return rising;
+    return true;
+}
+
+//
+//  Start or stop the matrix scan timer
+//
+static void set_matrix_timer(bool scan) {
+    if (scan == matrix.scanning)
+        return;
+    struct itimerspec period;
+    memset(&period, 0, sizeof(period));
+    if (scan) {
+        period.it_interval.tv_nsec = MATRIX_SCAN_US * 1000;
+        period.it_value.tv_nsec = MATRIX_SCAN_US * 1000;
+        matrix.scanning_since = us_timer();
+    } else {
+        matrix.scanning_us += us_timer() - matrix.scanning_since;
+    }
+    timerfd_settime(matrix.timer, 0, &period, NULL);
+    matrix.scanning = scan;
+}
+
+//
+//  Scan the button matrix once
+//  Runs on the edge service. Ghost keys are suppressed: if two rows share
+//  two or more active columns the four keys of that rectangle can't be told
+//  apart from a ghost, they keep their state until the rectangle clears.
+//
+static void scan_matrix() {
+    if (!__atomic_load_n(&matrix.active, __ATOMIC_ACQUIRE))
+        return;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t start_us = us_timer();
+    int columns = matrix.numberofcolumns;
+
+    uint32_t active[max_matrix_rows];
+    for (int r = 0; r < matrix.numberofrows; r++)
+        drive_row(matrix.rows[r], false);
+    for (int r = 0; r < matrix.numberofrows; r++) {
+        drive_row(matrix.rows[r], true);
+        if (!simulated) {
+            while (us_timer() - start_us < (uint64_t)(r + 1) * MATRIX_SETTLE_US)
+                ;
+        }
+        uint64_t levels = read_levels();
+        active[r] = 0;
+        for (int c = 0; c < columns; c++)
+            if (!(levels & PIN_MASK(matrix.columns[c])))
+                active[r] |= 1u << c;
+        drive_row(matrix.rows[r], false);
+    }
+    // back to idle: all rows low, a key press pulls its column down
+    for (int r = 0; r < matrix.numberofrows; r++)
+        drive_row(matrix.rows[r], true);
+
+    uint32_t raw = 0;
+    uint32_t frozen = 0;
+    for (int r = 0; r < matrix.numberofrows; r++) {
+        raw |= active[r] << (r * columns);
+        for (int o = r + 1; o < matrix.numberofrows; o++) {
+            uint32_t common = active[r] & active[o];
+            if (common & (common - 1))
+                frozen |= (common << (r * columns)) | (common << (o * columns));
+        }
+    }
+    raw = (raw & ~frozen) | (matrix.keys & frozen);
+
+    //
+    //  Debounce: a key changes after it read the same for MATRIX_DEBOUNCE_SCANS
+    //
+    uint32_t differ = raw ^ matrix.keys;
+    uint32_t changed = 0;
+    uint32_t settled = matrix.bouncing & ~differ;
+    while (settled) {
+        matrix.bounce[__builtin_ctz(settled)] = 0;
+        settled &= settled - 1;
+    }
+    matrix.bouncing = differ;
+    while (differ) {
+        int key = __builtin_ctz(differ);
+        if (++matrix.bounce[key] >= MATRIX_DEBOUNCE_SCANS) {
+            matrix.bounce[key] = 0;
+            changed |= 1u << key;
+        }
+        differ &= differ - 1;
+    }
+    matrix.bouncing &= ~changed;
+    matrix.keys ^= changed;
+
+    if (changed) {
+        set_virtual_levels(matrix.key_mask, ~((uint64_t)matrix.keys << VIRTUAL_PIN_BASE));
+        for (uint32_t keys = changed; keys; keys &= keys - 1) {
+            int pin = VIRTUAL_PIN_BASE + __builtin_ctz(keys);
+            metric_edge(pin);
+            trace(TRACE_EDGE, pin, !(matrix.keys & (keys & -keys)));
+        }
+        updateButtons(read_levels(), start_us);
+    }
+    // keep scanning while keys are down or bouncing
+    set_matrix_timer(matrix.polling || raw || matrix.keys);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    matrix.scans++;
+    matrix.scan_ns += ns;
+    metric_inc(M_MATRIX_SCANS);
+    hist_record(&matrix_scan_hist, ns / 1000);
+}
+
+//
+//  Expander register access
+//  The register address and the data go in one combined transfer
+//  Returns: false on failure, errno set
+//
+static bool expander_transfer(uint8_t reg, uint8_t * data, int length, bool read) {
+    if (simulated) {
+        sim_mcp_transfer(reg, data, length, read);
+        return true;
+    }
+    uint8_t buffer[1 + 2];
+    struct i2c_msg messages[2];
+    struct i2c_rdwr_ioctl_data transfer = { messages, 1 };
+    messages[0].addr = expander.address;
+    messages[0].flags = 0;
+    messages[0].buf = buffer;
+    buffer[0] = reg;
+    if (read) {
+        messages[0].len = 1;
+        messages[1].addr = expander.address;
+        messages[1].flags = I2C_M_RD;
+        messages[1].len = length;
+        messages[1].buf = data;
+        transfer.nmsgs = 2;
+    } else {
+        memcpy(buffer + 1, data, length);
+        messages[0].len = 1 + length;
+    }
+    return ioctl(expander.fd, I2C_RDWR, &transfer) == (int)transfer.nmsgs;
+}
+
+//
+//  Write or read a port A/B register pair, port A in the low byte
+//
+static bool expander_write(uint8_t reg, uint16_t value) {
+    uint8_t data[2] = { value & 0xff, value >> 8 };
+    return expander_transfer(reg, data, 2, false);
+}
+
+static bool expander_read(uint8_t reg, uint16_t * value) {
+    uint8_t data[2];
+    if (!expander_transfer(reg, data, 2, true))
+        return false;
+    *value = data[0] | (data[1] << 8);
+    return true;
+}
+
+//
+//  Read the expander inputs after an interrupt
+//  Runs on the edge service. The read clears the interrupt, if the output
+//  is still low inputs changed meanwhile and are read again.
+//
+static void read_expander() {
+    if (!__atomic_load_n(&expander.active, __ATOMIC_ACQUIRE))
+        return;
+    for (int i = 0; i < EXPANDER_MAX_READS; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t start_us = us_timer();
+        uint16_t inputs;
+        bool read = expander_read(MCP_GPIOA, &inputs);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!read) {
+            if (!expander.failures++)
+                logwarn("I/O expander read failed: %s", strerror(errno));
+            return;
+        }
+        uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+        expander.reads++;
+        expander.read_ns += ns;
+        metric_inc(M_EXPANDER_READS);
+        hist_record(&expander_read_hist, ns / 1000);
+
+        uint16_t changed = inputs ^ expander.inputs;
+        expander.inputs = inputs;
+        if (changed) {
+            set_virtual_levels(EXPANDER_PIN_MASK, (uint64_t)inputs << EXPANDER_PIN_BASE);
+            for (; changed; changed &= changed - 1) {
+                int pin = EXPANDER_PIN_BASE + __builtin_ctz(changed);
+                metric_edge(pin);
+                trace(TRACE_EDGE, pin, (inputs & changed & -changed) != 0);
+            }
+            uint64_t levels = read_levels();
+            updateButtons(levels, start_us);
+            updateEncoders(levels, start_us);
+        }
+        if (read_levels() & PIN_MASK(expander.interrupt))
+            return;
+    }
+    logwarn("I/O expander interrupt stays low after %d reads", EXPANDER_MAX_READS);
+}
+
+//
+//  Read level changes from the simulation FIFO
+//  Lines may arrive in pieces, the rest is kept for the next read
+//  Returns: number of edges added
+//
+static int read_sim_edges(struct edge * edges, int room) {
+    static char buffer[256];
+    static size_t filled = 0;
+    ssize_t size = read(sim_fd, buffer + filled, sizeof(buffer) - 1 - filled);
+    if (size <= 0)
+        return 0;
+    filled += size;
+    buffer[filled] = 0;
+
+    int count = 0;
+    char * line = buffer;
+    char * end;
+    while ((end = strchr(line, '\n'))) {
+        *end = 0;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        uint64_t before = sim_matrix_columns(sim_levels);
+        int pin, row, column, level;
+        if (sscanf(line, "k %d %d %d", &row, &column, &level) == 3) {
+            int key = row * matrix.numberofcolumns + column;
+            if ((row >= 0) && (row < matrix.numberofrows) &&
+                (column >= 0) && (column < matrix.numberofcolumns))
+                sim_keys = level ? (sim_keys | (1u << key)) : (sim_keys & ~(1u << key));
+        } else if ((sscanf(line, "%d %d", &pin, &level) == 2) &&
+                   (pin >= 0) && (pin < VIRTUAL_PIN_BASE)) {
+            sim_levels = level ? (sim_levels | PIN_MASK(pin)) : (sim_levels & ~PIN_MASK(pin));
+        } else if ((sscanf(line, "x %d %d", &pin, &level) == 2) &&
+                   (pin >= 0) && (pin < max_expander_pins)) {
+            sim_mcp_input(pin, level);
+        }
+        //
+        //  An edge for every line whose level changed
+        //
+        uint64_t changed = before ^ sim_matrix_columns(sim_levels);
+        for (struct gpio_line * gpio_line = lines; gpio_line < lines + numberoflines; gpio_line++) {
+            if ((gpio_line->pin < 0) || !(changed & PIN_MASK(gpio_line->pin)) || (count == room))
+                continue;
+            edges[count].timestamp = timestamp;
+            edges[count].pin = gpio_line->pin;
+            edges[count].kind = gpio_line->kind;
+            edges[count].edge = gpio_line->edge;
+            edges[count].rising = (sim_matrix_columns(sim_levels) & PIN_MASK(gpio_line->pin)) != 0;
+            count++;
+        }
+        line = end + 1;
+    }
+    filled -= line - buffer;
+    memmove(buffer, line, filled);
+    if (filled == sizeof(buffer) - 1)
+        filled = 0;  // no newline in a full buffer, drop it
+    return count;
+}
+
+//
+//  Edge service thread
+//  Drains all ready lines in batches, orders the edges by kernel timestamp
+//  and replays them one by one so encoders see every transition.
+//  Also runs the button matrix scanner, reads the I/O expander and
+//  simulated GPIO input, and closes released lines once the batch is done.
+//
+static void * edge_service(void * arg) {
+    int epfd = (int)(intptr_t)arg;
+    struct epoll_event ready[max_epoll];
+    struct gpioevent_data batch[EVENT_BATCH];
+    static struct edge edges[max_lines * EVENT_BATCH];
+    uint64_t levels = read_levels();
+
+    // touch the stack now so servicing edges never page faults
+    volatile char prefault[EDGE_STACK_PREFAULT];
+    memset((char *)prefault, 0, sizeof(prefault));
+
+    while (true) {
+        int count = epoll_wait(epfd, ready, max_epoll, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            logerr("GPIO edge service failed: %s", strerror(errno));
+            break;
+        }
+        //
+        //  Collect edges, insertion sort by timestamp
+        //  Edges of one line are already in order so this stays cheap
+        //
+        int numberofedges = 0;
+        bool scan = false;
+        bool expand = false;
+        bool release = false;
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.u32 == EPOLL_MATRIX_TIMER) {
+                uint64_t expirations;
+                if (read(matrix.timer, &expirations, sizeof(expirations)) > 0)
+                    scan = true;
+                continue;
+            }
+            if (ready[i].data.u32 == EPOLL_RELEASE) {
+                release = true;
+                continue;
+            }
+            if (ready[i].data.u32 == EPOLL_SIM_INPUT) {
+                numberofedges += read_sim_edges(edges + numberofedges,
+                                                max_lines * EVENT_BATCH - numberofedges);
+                continue;
+            }
+            struct gpio_line * line = lines + ready[i].data.u32;
+            int pin = __atomic_load_n(&line->pin, __ATOMIC_RELAXED);
+            ssize_t size = read(line->fd, batch, sizeof(batch));
+            if ((size <= 0) || (pin < 0))
+                continue;
+            for (int e = 0; e < size / sizeof(*batch); e++) {
+                int pos = numberofedges++;
+                while ((pos > 0) && (edges[pos - 1].timestamp > batch[e].timestamp)) {
+                    edges[pos] = edges[pos - 1];
+                    pos--;
+                }
+                edges[pos].timestamp = batch[e].timestamp;
+                edges[pos].pin = pin;
+                edges[pos].kind = line->kind;
+                edges[pos].edge = line->edge;
+                edges[pos].rising = (batch[e].id == GPIOEVENT_EVENT_RISING_EDGE);
+            }
+        }
+        //
+        //  Replay
+        //
+        for (struct edge * edge = edges; edge < edges + numberofedges; edge++) {
+            uint64_t mask = PIN_MASK(edge->pin);
+            levels = edge->rising ? (levels | mask) : (levels & ~mask);
+            metric_edge(edge->pin);
+            trace(TRACE_EDGE, edge->pin, edge->rising);
+            PROBE3(edge, edge->pin, edge->rising, edge->timestamp);
+            if (!edge_triggers(edge->edge, edge->rising))
+                continue;
+            uint64_t age = edge_age_us(edge->timestamp);
+            uint64_t edge_us = us_timer() - age;
+            if (edge->kind & LINE_BUTTON)
+                updateButtons(levels, edge_us);
+            if (edge->kind & LINE_ENCODER)
+                updateEncoders(levels, edge_us);
+            // while scanning the timer drives, edges are from driving the rows
+            if ((edge->kind & LINE_MATRIX) && !matrix.scanning)
+                scan = true;
+            if (edge->kind & LINE_EXPANDER)
+                expand = true;
+            hist_record(&edge_latency, us_timer() - edge_us);
+        }
+        if (scan)
+            scan_matrix();
+        if (expand)
+            read_expander();
+        // lines of this batch are not read anymore
+        if (release)
+            close_released();
+        // resync in case the kernel dropped edges
+        levels = read_levels();
+    }
+    return NULL;
+}
+
+//
+//  Close the release events if the edge service could not start
+//
+static void stop_release_events() {
+    if (release_event >= 0)
+        close(release_event);
+    if (release_ack >= 0)
+        close(release_ack);
+    release_event = -1;
+    release_ack = -1;
+}
+
+//
+//
+//  Start the GPIO edge service thread
+//  Call after the buttons and encoders of the start configuration are set up
+//
+//  Parameters:
+//      priority: SCHED_FIFO priority for the thread, 0 for normal scheduling
+//      cpu: CPU core to pin the thread to, -1 for no affinity
+//  Returns: 0 on success
+//
+//
+int start_GPIO(int priority, int cpu) {
+    if ((gpiochip < 0) && !simulated)
+        return 0;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        logerr("Could not create GPIO epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    release_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    release_ack = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((release_event < 0) || (release_ack < 0)) {
+        logerr("Could not create GPIO release events: %s", strerror(errno));
+        stop_release_events();
+        close(epfd);
+        return -1;
+    }
+    for (int i = 0; i < numberoflines; i++) {
+        if (lines[i].fd < 0)
+            continue;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, lines[i].fd, &event);
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if (matrix.timer >= 0) {
+        event.data.u32 = EPOLL_MATRIX_TIMER;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, matrix.timer, &event);
+    }
+    if (sim_fd >= 0) {
+        event.data.u32 = EPOLL_SIM_INPUT;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sim_fd, &event);
+    }
+    event.data.u32 = EPOLL_RELEASE;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, release_event, &event);
+    edge_epoll = epfd;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, EDGE_STACK_SIZE);
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    if (priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    int err = pthread_create(&edge_thread, &attr, edge_service, (void *)(intptr_t)epfd);
+    if ((err == EPERM) && (priority > 0)) {
+        logwarn("No permission for realtime priority, using normal scheduling");
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        err = pthread_create(&edge_thread, &attr, edge_service, (void *)(intptr_t)epfd);
+    }
+    pthread_attr_destroy(&attr);
+    if (err) {
+        logerr("Could not start GPIO edge service: %s", strerror(err));
+        edge_epoll = -1;
+        stop_release_events();
+        close(epfd);
+        return -1;
+    }
+    loginfo("GPIO edge service started: %d lines, priority %d, cpu %d",
+            numberoflines, priority, cpu);
+    return 0;
+}
+
+//
+//
+//  Log edge to dispatch latency statistics
+//
+//
+void log_GPIO_latency() {
+    hist_log(&edge_latency);
+    if (expander.reads || expander.failures) {
+        loginfo("I/O expander: %llu reads, %llu failed, %.2f µs per read",
+                (unsigned long long)expander.reads, (unsigned long long)expander.failures,
+                expander.reads ? expander.read_ns / 1e3 / expander.reads : 0.0);
+        hist_log(&expander_read_hist);
+    }
+    if (!matrix.scans)
+        return;
+    uint64_t scanning_us = matrix.scanning_us;
+    if (matrix.scanning)
+        scanning_us += us_timer() - matrix.scanning_since;
+    loginfo("Button matrix: %llu scans, %.0f scans/s while keys are down, %.2f µs per scan, %.2f%% CPU while scanning",
+            (unsigned long long)matrix.scans,
+            scanning_us ? matrix.scans * 1e6 / scanning_us : 0.0,
+            matrix.scan_ns / 1e3 / matrix.scans,
+            scanning_us ? matrix.scan_ns / 10.0 / scanning_us : 0.0);
+    hist_log(&matrix_scan_hist);
+}
+
+//
+//
+//  Edge to dispatch latency histogram
+//
+//
+const struct histogram * GPIO_latency() {
+    return &edge_latency;
+}
+
+//
+//
+//  Button matrix scan time histogram
+//
+//
+const struct histogram * matrix_scan_time() {
+    return &matrix_scan_hist;
+}
+
+//
+//
+//  I/O expander read time histogram
+//
+//
+const struct histogram * expander_read_time() {
+    return &expander_read_hist;
+}
 
 //
 //  Configured buttons
@@ -73,23 +1201,33 @@ uint32_t gettime_ms(void) {
 //  Checks all configred buttons for status changes and
 //  calls callback if state change detected.
 //
+//  Parameters:
+//      levels: input level snapshot as returned by read_levels()
+//      edge_us: time of the edge, us_timer() time base
+//
 //
-void updateButtons()
+void updateButtons(uint64_t levels, uint64_t edge_us)
 {
 	uint32_t now;
 	now = gettime_ms();
 	struct button *button = buttons;
 	for (; button < buttons + numberofbuttons; button++)
 	{
-		bool bit = digitalRead(button->pin);
-		bool presstype;
+		if (!__atomic_load_n(&button->active, __ATOMIC_ACQUIRE))
+			continue;
+		bool bit = (levels & button->mask) != 0;
+		bool presstype = SHORTPRESS;
 		logdebug("%lu - %lu= %i  Pin Value=%i   Stored Value=%i", (unsigned long)now, (unsigned long)button->timepressed, (signed int)(now - button->timepressed), bit, button->value);
 
 		int increment = 0;
+		int duration = 0;
 		if ( (bit == button->pressed) && (button->timepressed == 0) ){	
 			button->timepressed = now;
 			increment = 0;
-		} else if (button->timepressed != 0){	
+			if (button->hold)
+				button->hold(button, true);
+		} else if ( (bit != button->pressed) && (button->timepressed != 0) ){	
+			duration = (signed int)(now - button->timepressed);
 			if ((signed int)(now - button->timepressed) < (signed int)NOPRESSTIME ) {
 				logdebug("No PRESS: %i", (signed int)(now - button->timepressed));
 				increment = 0;
@@ -105,12 +1243,26 @@ void updateButtons()
 				increment = 1;
 			}
 			button->timepressed = 0;
+			if (button->hold)
+				button->hold(button, false);
 		}
-		if (button->callback && increment)
+		if (button->callback && increment) {
+			button->edge_us = edge_us;
+			button->decided_us = us_timer();
+			trace(TRACE_PRESS, button->pin, presstype);
+			PROBE3(press, button->pin, presstype, duration);
 			button->callback(button, increment, presstype);
+		}
     }
 }
 
+//
+//  Button interrupt: sample all inputs once, then update buttons
+//
+static void buttonISR() {
+    updateButtons(read_levels(), us_timer());
+}
+
 //
 //
 //  Configuration function to define a button
@@ -128,7 +1280,10 @@ void updateButtons()
 //
 struct button *setupbutton(int pin, button_callback_t callback, int resist, bool pressed, int long_press_time)
 {
-    if (numberofbuttons > max_buttons)
+    struct button *newbutton = buttons;
+    while ((newbutton < buttons + numberofbuttons) && newbutton->active)
+        newbutton++;
+    if (newbutton == buttons + max_buttons)
     {
         logerr("Maximum number of buttons exceded: %i", max_buttons);
         return NULL;
@@ -136,20 +1291,42 @@ struct button *setupbutton(int pin, button_callback_t callback, int resist, bool
     
     int edge = INT_EDGE_BOTH;  //Need to see both directions for button depressed time.
     
-    struct button *newbutton = buttons + numberofbuttons++;
     newbutton->pin = pin;
+    newbutton->mask = PIN_MASK(pin);
     newbutton->value = 0;
     newbutton->callback = callback;
+    newbutton->hold = NULL;
     newbutton->timepressed = 0;
     newbutton->pressed = pressed;
     newbutton->long_press_time = long_press_time;
-    pinMode(pin, INPUT);
-    pullUpDnControl(pin, resist);
-    wiringPiISR(pin,edge, updateButtons);
+    newbutton->edge_us = 0;
+    newbutton->decided_us = 0;
+    if (pin < VIRTUAL_PIN_BASE)
+        input_pin(pin, resist);
+    __atomic_store_n(&newbutton->active, true, __ATOMIC_RELEASE);
+    if (newbutton == buttons + numberofbuttons)
+        numberofbuttons++;
+    input_mask |= newbutton->mask;
+    // virtual pins are updated by their source
+    if (pin < VIRTUAL_PIN_BASE)
+        request_line(pin, LINE_BUTTON, edge, buttonISR);
     
     return newbutton;
 }
 
+//
+//
+//  Release a button
+//  Its pin is released and the slot can be used by a new button
+//
+//
+void release_button(struct button * button) {
+    __atomic_store_n(&button->active, false, __ATOMIC_RELEASE);
+    if (button->pin < VIRTUAL_PIN_BASE)
+        release_line(button->pin);
+    update_input_mask();
+}
+
 //
 //
 // Encoders
@@ -166,29 +1343,49 @@ static int numberofencoders = 0;
 //
 static struct encoder encoders[max_encoders];
 
+//
+//  Quadrature transitions: index is (last state << 2) | new state
+//  +1 for clockwise, -1 for counter clockwise, 0 for no or invalid change
+//
+static const int8_t encoder_steps[16] = {
+     0, -1,  1,  0,
+     1,  0,  0, -1,
+    -1,  0,  0,  1,
+     0,  1, -1,  0
+};
+
 //
 //
 //  Encoder handler function
 //  Called by the GPIO interrupt when encoder is rotated
 //  Depends on edge configuration
 //
+//  Parameters:
+//      levels: input level snapshot as returned by read_levels()
+//      edge_us: time of the edge, us_timer() time base
+//
 //
-void updateEncoders()
+void updateEncoders(uint64_t levels, uint64_t edge_us)
 {
     struct encoder *encoder = encoders;
     for (; encoder < encoders + numberofencoders; encoder++)
     {
-        int MSB = digitalRead(encoder->pin_a);
-        int LSB = digitalRead(encoder->pin_b);
-        
-        int encoded = (MSB << 1) | LSB;
+        if (!__atomic_load_n(&encoder->active, __ATOMIC_ACQUIRE))
+            continue;
+        int encoded = ((levels & encoder->mask_a) ? 0b10 : 0) |
+                      ((levels & encoder->mask_b) ? 0b01 : 0);
         int sum = (encoder->lastEncoded << 2) | encoded;
         
-        int increment = 0;
-        
-        if(sum == 0b1101 || sum == 0b0100 || sum == 0b0010 || sum == 0b1011) increment = 1;
-        if(sum == 0b1110 || sum == 0b0111 || sum == 0b0001 || sum == 0b1000) increment = -1;
+        int increment = encoder_steps[sum];
         
+        if (increment) {
+            metric_inc(M_ENCODER_STEPS);
+            trace(TRACE_STEP, encoder->pin_a, (uint32_t)(encoder->value + increment));
+        }
+        if (increment && !encoder->first_edge_us) {
+            encoder->first_edge_us = edge_us;
+            encoder->decided_us = us_timer();
+        }
         encoder->value += increment;
         
         encoder->lastEncoded = encoded;
@@ -197,6 +1394,13 @@ void updateEncoders()
     }
 }
 
+//
+//  Encoder interrupt: sample all inputs once, then update encoders
+//
+static void encoderISR() {
+    updateEncoders(read_levels(), us_timer());
+}
+
 //
 //
 //  Configuration function to define a rotary encoder
@@ -217,7 +1421,10 @@ struct encoder *setupencoder(int pin_a,
                              rotaryencoder_callback_t callback,
                              int edge)
 {
-    if (numberofencoders > max_encoders)
+    struct encoder *newencoder = encoders;
+    while ((newencoder < encoders + numberofencoders) && newencoder->active)
+        newencoder++;
+    if (newencoder == encoders + max_encoders)
     {
         logerr("Maximum number of encodered exceded: %i", max_encoders);
         return NULL;
@@ -226,23 +1433,232 @@ struct encoder *setupencoder(int pin_a,
     if (edge != INT_EDGE_FALLING && edge != INT_EDGE_RISING)
         edge = INT_EDGE_BOTH;
     
-    struct encoder *newencoder = encoders + numberofencoders++;
     newencoder->pin_a = pin_a;
     newencoder->pin_b = pin_b;
+    newencoder->mask_a = PIN_MASK(pin_a);
+    newencoder->mask_b = PIN_MASK(pin_b);
     newencoder->value = 0;
     newencoder->lastEncoded = 0;
+    newencoder->first_edge_us = 0;
+    newencoder->decided_us = 0;
     newencoder->callback = callback;
     
-    pinMode(pin_a, INPUT);
-    pinMode(pin_b, INPUT);
-    pullUpDnControl(pin_a, PUD_UP);
-    pullUpDnControl(pin_b, PUD_UP);
-    wiringPiISR(pin_a,edge, updateEncoders);
-    wiringPiISR(pin_b,edge, updateEncoders);
+    if (pin_a < VIRTUAL_PIN_BASE)
+        input_pin(pin_a, PUD_UP);
+    if (pin_b < VIRTUAL_PIN_BASE)
+        input_pin(pin_b, PUD_UP);
+    __atomic_store_n(&newencoder->active, true, __ATOMIC_RELEASE);
+    if (newencoder == encoders + numberofencoders)
+        numberofencoders++;
+    input_mask |= newencoder->mask_a | newencoder->mask_b;
+    // virtual pins are updated by their source
+    if (pin_a < VIRTUAL_PIN_BASE)
+        request_line(pin_a, LINE_ENCODER, edge, encoderISR);
+    if (pin_b < VIRTUAL_PIN_BASE)
+        request_line(pin_b, LINE_ENCODER, edge, encoderISR);
     
     return newencoder;
 }
 
+//
+//
+//  Release a rotary encoder
+//  Its pins are released and the slot can be used by a new encoder
+//
+//
+void release_encoder(struct encoder * encoder) {
+    __atomic_store_n(&encoder->active, false, __ATOMIC_RELEASE);
+    if (encoder->pin_a < VIRTUAL_PIN_BASE)
+        release_line(encoder->pin_a);
+    if (encoder->pin_b < VIRTUAL_PIN_BASE)
+        release_line(encoder->pin_b);
+    update_input_mask();
+}
+
+//
+//
+//  Configuration function to define the button matrix
+//  The scanner runs on the edge service, columns that can't be requested
+//  as lines are polled by scanning all the time.
+//
+//
+int setup_matrix(const int * rows, int numberofrows, const int * columns, int numberofcolumns) {
+    if (matrix.active) {
+        logerr("Only one button matrix supported");
+        return -1;
+    }
+    if ((numberofrows < 1) || (numberofrows > max_matrix_rows) ||
+        (numberofcolumns < 1) || (numberofcolumns > max_matrix_columns) ||
+        (numberofrows * numberofcolumns > max_virtual_pins)) {
+        logerr("Button matrix of %d x %d keys not supported", numberofrows, numberofcolumns);
+        return -1;
+    }
+    if ((gpiochip < 0) && !simulated) {
+        logerr("Button matrix needs the GPIO character device");
+        return -1;
+    }
+    if (matrix.timer < 0) {
+        matrix.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (matrix.timer < 0) {
+            logerr("Could not create button matrix timer: %s", strerror(errno));
+            return -1;
+        }
+        if (edge_epoll >= 0) {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.u32 = EPOLL_MATRIX_TIMER;
+            epoll_ctl(edge_epoll, EPOLL_CTL_ADD, matrix.timer, &event);
+        }
+    }
+
+    memcpy(matrix.rows, rows, numberofrows * sizeof(int));
+    matrix.numberofrows = numberofrows;
+    memcpy(matrix.columns, columns, numberofcolumns * sizeof(int));
+    matrix.numberofcolumns = numberofcolumns;
+    matrix.column_mask = 0;
+    matrix.key_mask = ((PIN_MASK(numberofrows * numberofcolumns) - 1) << VIRTUAL_PIN_BASE);
+    matrix.keys = 0;
+    matrix.bouncing = 0;
+    matrix.polling = false;
+    set_virtual_levels(matrix.key_mask, ~0ULL);
+    for (int c = 0; c < numberofcolumns; c++) {
+        input_pin(columns[c], PUD_UP);
+        matrix.column_mask |= PIN_MASK(columns[c]);
+    }
+    for (int r = 0; r < numberofrows; r++) {
+        if (!simulated)
+            pullUpDnControl(rows[r], PUD_UP);
+        drive_row(rows[r], true);
+    }
+    input_mask |= matrix.column_mask;
+    __atomic_store_n(&matrix.active, true, __ATOMIC_RELEASE);
+    for (int c = 0; c < numberofcolumns; c++) {
+        if (!request_line(columns[c], LINE_MATRIX, INT_EDGE_FALLING, NULL))
+            matrix.polling = true;
+    }
+    if (matrix.polling) {
+        logwarn("Button matrix: no edge events for all columns, scanning all the time");
+        set_matrix_timer(true);
+    }
+    loginfo("Button matrix: %d rows, %d columns, keys on virtual pins %d..%d",
+            numberofrows, numberofcolumns, VIRTUAL_PIN_BASE,
+            VIRTUAL_PIN_BASE + numberofrows * numberofcolumns - 1);
+    return 0;
+}
+
+//
+//
+//  Release the button matrix
+//  The rows float again, the timer is kept for the next matrix
+//
+//
+void release_matrix() {
+    if (!matrix.active)
+        return;
+    __atomic_store_n(&matrix.active, false, __ATOMIC_RELEASE);
+    set_matrix_timer(false);
+    for (int c = 0; c < matrix.numberofcolumns; c++)
+        release_line(matrix.columns[c]);
+    for (int r = 0; r < matrix.numberofrows; r++)
+        drive_row(matrix.rows[r], false);
+    set_virtual_levels(matrix.key_mask, ~0ULL);
+    update_input_mask();
+}
+
+//
+//
+//  Configuration function to define the I/O expander
+//  All pins become inputs with pull-ups and interrupt on change, the
+//  interrupt outputs are mirrored and open drain so one pin serves both
+//  ports. The inputs are read once now, which clears a pending interrupt.
+//
+//
+int setup_expander(int interrupt, int address, int bus) {
+    if (expander.active) {
+        logerr("Only one I/O expander supported");
+        return -1;
+    }
+    if ((gpiochip < 0) && !simulated) {
+        logerr("I/O expander needs the GPIO character device");
+        return -1;
+    }
+    expander.fd = -1;
+    if (!simulated) {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/i2c-%d", bus);
+        expander.fd = open(path, O_RDWR | O_CLOEXEC);
+        if (expander.fd < 0) {
+            logerr("Could not open I2C bus %s: %s", path, strerror(errno));
+            return -1;
+        }
+    }
+    expander.interrupt = interrupt;
+    expander.address = address;
+    expander.bus = bus;
+    uint8_t iocon = MCP_IOCON_MIRROR | MCP_IOCON_ODR;
+    if (!expander_write(MCP_IOCON, iocon | (iocon << 8)) ||
+        !expander_write(MCP_IODIRA, 0xffff) ||
+        !expander_write(MCP_IPOLA, 0) ||
+        !expander_write(MCP_GPPUA, 0xffff) ||
+        !expander_write(MCP_INTCONA, 0) ||
+        !expander_write(MCP_GPINTENA, 0xffff) ||
+        !expander_read(MCP_GPIOA, &expander.inputs)) {
+        logerr("No I/O expander at address 0x%02x on I2C bus %d: %s", address, bus, strerror(errno));
+        release_expander();
+        return -1;
+    }
+    set_virtual_levels(EXPANDER_PIN_MASK, (uint64_t)expander.inputs << EXPANDER_PIN_BASE);
+    input_pin(interrupt, PUD_UP);
+    input_mask |= PIN_MASK(interrupt);
+    __atomic_store_n(&expander.active, true, __ATOMIC_RELEASE);
+    if (!request_line(interrupt, LINE_EXPANDER, INT_EDGE_FALLING, NULL)) {
+        logerr("I/O expander: no edge events for interrupt pin %d", interrupt);
+        release_expander();
+        return -1;
+    }
+    loginfo("I/O expander at address 0x%02x on I2C bus %d, interrupt pin %d, inputs on virtual pins %d..%d",
+            address, bus, interrupt, EXPANDER_PIN_BASE, EXPANDER_PIN_BASE + max_expander_pins - 1);
+    return 0;
+}
+
+//
+//
+//  Release the I/O expander
+//  Its inputs keep interrupting until the next setup, the line is gone
+//
+//
+void release_expander() {
+    if (expander.active) {
+        __atomic_store_n(&expander.active, false, __ATOMIC_RELEASE);
+        release_line(expander.interrupt);
+    }
+    if (expander.fd >= 0)
+        close(expander.fd);
+    expander.fd = -1;
+    expander.interrupt = 0;
+    set_virtual_levels(EXPANDER_PIN_MASK, ~0ULL);
+    update_input_mask();
+}
+
+//
+//  Collect the pins of all buttons and encoders in use
+//
+static void update_input_mask() {
+    uint64_t mask = 0;
+    for (struct button * button = buttons; button < buttons + numberofbuttons; button++)
+        if (button->active)
+            mask |= button->mask;
+    for (struct encoder * encoder = encoders; encoder < encoders + numberofencoders; encoder++)
+        if (encoder->active)
+            mask |= encoder->mask_a | encoder->mask_b;
+    if (matrix.active)
+        mask |= matrix.column_mask;
+    if (expander.active)
+        mask |= PIN_MASK(expander.interrupt);
+    input_mask = mask;
+}
+
 //
 //
 //  Init GPIO functionality
@@ -250,8 +1666,35 @@ struct encoder *setupencoder(int pin_a,
 //
 //
 void init_GPIO() {
+    if (simulated) {
+        loginfo("Simulating GPIO");
+        return;
+    }
     loginfo("Initializing GPIO");
     wiringPiSetupGpio() ;
+    map_levels();
+    gpiochip = open_gpiochip();
+}
+
+//
+//
+//  Simulated GPIO
+//  The FIFO is opened for reading and writing so it never sees end of
+//  file when a writer closes it
+//
+//
+int simulate_GPIO(const char * fifo) {
+    if ((mkfifo(fifo, 0600) != 0) && (errno != EEXIST)) {
+        logerr("Could not create GPIO simulation FIFO %s: %s", fifo, strerror(errno));
+        return -1;
+    }
+    sim_fd = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (sim_fd < 0) {
+        logerr("Could not open GPIO simulation FIFO %s: %s", fifo, strerror(errno));
+        return -1;
+    }
+    simulated = true;
+    return 0;
 }
 
 
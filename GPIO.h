@@ -47,6 +47,57 @@
 //
 void init_GPIO();
 
+//
+//
+//  Simulated GPIO
+//  Pins are modelled in memory instead of using the hardware, e.g. to test
+//  a configuration or benchmark the button matrix scanner. Input levels
+//  are changed by writing lines to a FIFO, created if needed:
+//      <pin> <0|1>             set the level of an input pin
+//      k <row> <column> <0|1>  release or press a button matrix key
+//      x <input> <0|1>         set the level of I/O expander input 0..15,
+//                              the expander is modelled at register level
+//  Call before init_GPIO()
+//
+//  Parameters:
+//      fifo: path of the FIFO
+//  Returns: 0 on success
+//
+//
+int simulate_GPIO(const char * fifo);
+
+//
+//
+//  Start the GPIO edge service thread
+//  One thread services the edges of all configured pins.
+//  Call after the buttons and encoders of the start configuration are set up,
+//  buttons and encoders can be added and released while it runs
+//
+//  Parameters:
+//      priority: SCHED_FIFO priority for the thread, 0 for normal scheduling
+//      cpu: CPU core to pin the thread to, -1 for no affinity
+//  Returns: 0 on success
+//
+//
+int start_GPIO(int priority, int cpu);
+
+//
+//
+//  Log edge to dispatch latency statistics
+//  and the button matrix scan statistics: scans, scan rate, time per scan
+//  and the I/O expander read statistics
+//
+//
+void log_GPIO_latency();
+
+//
+//
+//  Edge to dispatch latency histogram
+//
+//
+struct histogram;
+const struct histogram * GPIO_latency();
+
 //
 // Buttons and Rotary Encoders
 // Rotary Encoder taken from https://github.com/astine/rotaryencoder
@@ -55,8 +106,26 @@ void init_GPIO();
 
 //17 pins / 2 pins per encoder = 8 maximum encoders
 #define max_encoders 8
-//17 pins / 1 pins per button = 17 maximum buttons
-#define max_buttons 17
+//17 pins / 1 pins per button = 17 maximum buttons on GPIO pins
+#define max_gpio_buttons 17
+
+//
+//  Input levels are handled as a bitmask with one bit per BCM pin
+//  Bits 32 and up are virtual pins, e.g. the keys of a button matrix or
+//  the inputs of an I/O expander.
+//  They read high while released, like a button with a pull-up.
+//
+#define PIN_MASK(pin) (1ULL << (pin))
+#define VIRTUAL_PIN_BASE 32
+#define max_virtual_pins 32
+#define VIRTUAL_PIN_MASK (~0ULL << VIRTUAL_PIN_BASE)
+// the I/O expander inputs are the upper 16 virtual pins
+#define EXPANDER_PIN_BASE 48
+#define max_expander_pins 16
+#define EXPANDER_PIN_MASK (~0ULL << EXPANDER_PIN_BASE)
+
+// every virtual pin can be a button as well
+#define max_buttons (max_gpio_buttons + max_virtual_pins)
 
 struct button;
 
@@ -70,13 +139,25 @@ struct button;
 //
 typedef void (*button_callback_t)(const struct button * button, int change, bool presstype);
 
+//
+//  Optional callback executed when a button goes down and when it comes up again,
+//  before any press is decided.
+//
+typedef void (*button_hold_t)(const struct button * button, bool held);
+
 struct button {
+    volatile bool active;   // false: slot unused
     int pin;
+    uint64_t mask;
     volatile bool value;
     button_callback_t callback;
+    volatile button_hold_t hold;    // NULL if not used
     uint32_t timepressed;
     bool pressed;
     int long_press_time;
+    // latency stamps of the last press: edge and press decision
+    uint64_t edge_us;
+    uint64_t decided_us;
 };
 
 //
@@ -100,6 +181,14 @@ struct button *setupbutton(int pin,
                            bool pressed,
                            int long_press_time);
 
+//
+//
+//  Release a button, e.g. when a reload removed it
+//  Its GPIO line is released, the button must not be used anymore
+//
+//
+void release_button(struct button * button);
+
 
 struct encoder;
 
@@ -112,10 +201,16 @@ typedef void (*rotaryencoder_callback_t)(const struct encoder * encoder, long ch
 
 struct encoder
 {
+    volatile bool active;   // false: slot unused
     int pin_a;
     int pin_b;
+    uint64_t mask_a;
+    uint64_t mask_b;
     volatile long value;
     volatile int lastEncoded;
+    // latency stamps of the first step not yet consumed, reset by the consumer
+    volatile uint64_t first_edge_us;
+    volatile uint64_t decided_us;
     rotaryencoder_callback_t callback;
 };
 
@@ -139,6 +234,93 @@ struct encoder *setupencoder(int pin_a,
                              rotaryencoder_callback_t callback,
                              int edge);
 
+//
+//
+//  Release a rotary encoder, e.g. when a reload removed it
+//  Its GPIO lines are released, the encoder must not be used anymore
+//
+//
+void release_encoder(struct encoder * encoder);
+
+//
+//  Button matrix
+//  Rows are outputs, columns inputs with pull-up, keys need no diodes.
+//  Key (row, column) is virtual pin
+//      VIRTUAL_PIN_BASE + row * numberofcolumns + column
+//  and is set up with setupbutton() like a button on a GPIO pin.
+//  Needs the GPIO character device or simulated GPIO.
+//
+#define max_matrix_rows 8
+#define max_matrix_columns 8
+
+//
+//
+//  Configuration function to define the button matrix
+//  There is one matrix at most, rows * columns must not exceed max_virtual_pins
+//
+//  Parameters:
+//      rows, numberofrows: GPIO-Pins driving the rows in BCM numbering scheme
+//      columns, numberofcolumns: GPIO-Pins reading the columns
+//  Returns: 0 on success
+//
+//
+int setup_matrix(const int * rows, int numberofrows, const int * columns, int numberofcolumns);
+
+//
+//
+//  Release the button matrix, e.g. when a reload removed it
+//  Buttons on its keys read released from now on
+//
+//
+void release_matrix();
+
+//
+//
+//  Button matrix scan time histogram
+//
+//
+const struct histogram * matrix_scan_time();
+
+//
+//  I/O expander
+//  MCP23017 class expander with 16 inputs on an I2C bus. Its interrupt
+//  output is wired to a GPIO pin with a pull-up. Input n is virtual pin
+//      EXPANDER_PIN_BASE + n
+//  (GPA0..7 are 0..7, GPB0..7 are 8..15) and is set up with setupbutton()
+//  or setupencoder() like a GPIO pin.
+//  Needs the GPIO character device or simulated GPIO.
+//
+
+//
+//
+//  Configuration function to define the I/O expander
+//  There is one expander at most. A button matrix may use the virtual pins
+//  below EXPANDER_PIN_BASE only.
+//
+//  Parameters:
+//      interrupt: GPIO-Pin the interrupt output is wired to, BCM numbering scheme
+//      address: I2C address, 0x20 .. 0x27
+//      bus: I2C bus, /dev/i2c-<bus>
+//  Returns: 0 on success
+//
+//
+int setup_expander(int interrupt, int address, int bus);
+
+//
+//
+//  Release the I/O expander, e.g. when a reload removed it
+//  Buttons on its inputs read released from now on
+//
+//
+void release_expander();
+
+//
+//
+//  I/O expander read time histogram
+//
+//
+const struct histogram * expander_read_time();
+
 
 
 
@@ -39,19 +39,76 @@
 #include "sbpd.h"
 #include "control.h"
 #include "servercomm.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
 #include <wiringPi.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
 
 //
-//  Pre-allocate encoder and button objects on the stack so we don't have to
-//  worry about freeing them
+//  Control table
+//  Commands and the buttons and encoders bound to them. The active table
+//  is only read by the main loop and never changed, a reload builds a new
+//  table and swaps it in.
+//  Every layer has a complete set of bindings, index i of a layer belongs
+//  to buttons[i] or encoders[i]. Bindings a layer doesn't define are
+//  copied from the base layer when the table is activated, so switching
+//  layers just selects another set.
 //
-static struct button_ctrl button_ctrls[max_buttons];
-static struct encoder_ctrl encoder_ctrls[max_encoders];
-static int numberofbuttons = 0;
-static int numberofencoders = 0;
+struct control_layer {
+    struct button_binding buttons[max_buttons];
+    struct encoder_binding encoders[max_encoders];
+    struct button_binding keys[max_keys];
+};
+
+struct control_table {
+    struct lms_command * commands;  // hash table, open addressing
+    size_t commandslots;            // power of two
+    size_t numberofcommands;
+    struct button_ctrl buttons[max_buttons];
+    int numberofbuttons;
+    struct encoder_ctrl encoders[max_encoders];
+    int numberofencoders;
+    struct control_layer layers[max_layers];
+    struct matrix_ctrl matrix;
+    struct expander_ctrl expander;
+    struct key_ctrl keys[max_keys];
+    int numberofkeys;
+    struct input_ctrl inputs[max_input_devices];
+    int numberofinputs;
+};
+static struct control_table * active_table = NULL;
+static struct control_table * build_table = NULL;
+
+//
+//  Layer selected by the layer button held last, set by the edge service
+//
+static volatile uint8_t active_layer = 0;
+
+//
+//  Pin state
+//  Pending button presses and consumed encoder steps by pin, pin a for
+//  encoders. Set by the GPIO edge service and the main loop, a reload
+//  keeps the state of unchanged pins.
+//
+struct pin_state {
+    volatile bool waiting;
+    bool presstype;
+    struct latency_stamps stamps;
+    uint8_t layer;          // layer of the pending press
+    uint8_t select_layer;   // layer button: layer selected while held
+    long last_value;        // encoder steps consumed
+    long long bucket_time;  // encoder rate limit, see handle_encoders
+};
+static struct pin_state pin_states[max_pins];
+
+//
+//  Key state
+//  Time a key of the active table went down, 0 if up. Main loop only.
+//
+static uint64_t key_down_us[max_keys];
 
 //
 //  Command fragments
@@ -67,72 +124,330 @@ static int numberofencoders = 0;
 */
 //
 //  Encoder
+//  Used when the command configuration doesn't define these
 //
-#define FRAGMENT_VOLUME         "[\"mixer\",\"volume\",\"%s%d\"]"
-#define FRAGMENT_TRACK          "[\"playlist\",\"jump\",\"%s%d\"]"
+#define ACTION_VOLUME           "ENCODER:100,0,+,[\"mixer\",\"volume\",\"%d\"]"
+#define ACTION_TRACK            "ENCODER:1,500,+,[\"playlist\",\"jump\",\"%d\"]"
+
+//
+//  Encoder commands that may be sent back to back after a pause
+//
+#define ENCODER_BURST           2
 
 //
 //  LMS Command structure
+//  Commands are added to the hash table of the table being built.
+//  Linear probing, the table doubles at 3/4 load.
 //
-static struct lms_command lms_commands[MAX_COMMANDS];
-static int numberofcommands = 0;
+#define COMMAND_SLOTS_MIN 16
+
+static size_t hash_name(const char * name) {
+    // FNV-1a
+    size_t hash = (size_t)2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+static struct lms_command * find_command_slot(struct lms_command * commands, size_t slots,
+                                              const char * name) {
+    size_t index = hash_name(name) & (slots - 1);
+    while (commands[index].name && strcmp(commands[index].name, name))
+        index = (index + 1) & (slots - 1);
+    return commands + index;
+}
+
+static bool grow_commands(struct control_table * table) {
+    size_t slots = table->commandslots ? 2 * table->commandslots : COMMAND_SLOTS_MIN;
+    struct lms_command * commands = calloc(slots, sizeof(struct lms_command));
+    if (!commands)
+        return false;
+    for (size_t i = 0; i < table->commandslots; i++) {
+        if (table->commands[i].name)
+            *find_command_slot(commands, slots, table->commands[i].name) = table->commands[i];
+    }
+    free(table->commands);
+    table->commands = commands;
+    table->commandslots = slots;
+    return true;
+}
 
-int add_lms_command_frament ( char * name, char * value ) {
+static void free_encoder_action(struct encoder_action * action) {
+    if (!action)
+        return;
+    free(action->prefix);
+    free(action->buffer);
+    free(action);
+}
+
+//
+//  Parse an encoder action: <limit>,<interval>,<sign>,<template>
+//  The template needs exactly one %d, a literal % is written as %%.
+//
+static struct encoder_action * parse_encoder_action(const char * value) {
+    char * end;
+    long limit = strtol(value, &end, 10);
+    if ((*end != ',') || (limit < 1) || (limit > 100)) {
+        logerr("Encoder action: limit must be 1..100 in %s", value);
+        return NULL;
+    }
+    long min_time = strtol(end + 1, &end, 10);
+    if ((*end != ',') || (min_time < 0)) {
+        logerr("Encoder action: invalid interval in %s", value);
+        return NULL;
+    }
+    int sign;
+    if (strncmp(end, ",+,", 3) == 0)
+        sign = SIGN_EXPLICIT;
+    else if (strncmp(end, ",-,", 3) == 0)
+        sign = SIGN_NEGATIVE;
+    else {
+        logerr("Encoder action: sign must be + or - in %s", value);
+        return NULL;
+    }
+    const char * template = end + 3;
+
+    struct encoder_action * action = calloc(1, sizeof(struct encoder_action));
+    if (!action)
+        return NULL;
+    action->limit = (int)limit;
+    action->min_time = (int)min_time;
+    action->sign = sign;
+    // prefix and suffix share one allocation, %% collapses so it's never longer
+    action->prefix = malloc(strlen(template) + 1);
+    if (!action->prefix) {
+        free(action);
+        return NULL;
+    }
+    char * out = action->prefix;
+    int slots = 0;
+    for (const char * in = template; *in; in++) {
+        if ((in[0] == '%') && (in[1] == '%')) {
+            *out++ = '%';
+            in++;
+        } else if ((in[0] == '%') && (in[1] == 'd')) {
+            action->prefix_len = out - action->prefix;
+            *out++ = '\0';
+            action->suffix = out;
+            slots++;
+            in++;
+        } else if (in[0] == '%') {
+            slots = -1;
+            break;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    if (slots != 1) {
+        logerr("Encoder action: template needs exactly one %%d, %s", template);
+        free_encoder_action(action);
+        return NULL;
+    }
+    action->suffix_len = out - action->suffix;
+    // sign and up to three digits of the limited delta
+    action->buffer = malloc(action->prefix_len + 4 + action->suffix_len + 1);
+    if (!action->buffer) {
+        free_encoder_action(action);
+        return NULL;
+    }
+    return action;
+}
+
+int add_lms_command_frament ( const char * name, const char * value ) {
     loginfo("Adding Command %s: Fragment %s", name, value);
-    lms_commands[numberofcommands].code = STRTOU32(name);
-    strncpy (lms_commands[numberofcommands].fragment, value, MAXLEN);
-    numberofcommands ++;
-    if (numberofcommands > MAX_COMMANDS )
+    if (!build_table || !*name)
+        return 1;
+    if (((build_table->numberofcommands + 1) * 4 > build_table->commandslots * 3) &&
+        !grow_commands(build_table))
+        return 1;
+    struct lms_command * command = find_command_slot(build_table->commands,
+                                                     build_table->commandslots, name);
+    if (command->name) {
+        logwarn("Command %s defined twice, using the first definition", name);
+        return 0;
+    }
+    if (strncmp("ENCODER:", value, 8) == 0) {
+        command->action = parse_encoder_action(value + 8);
+        if (!command->action)
+            return 1;
+    } else {
+        command->fragment = strdup(value);
+        if (!command->fragment)
+            return 1;
+    }
+    command->name = strdup(name);
+    if (!command->name) {
+        free(command->fragment);
+        free_encoder_action(command->action);
+        command->fragment = NULL;
+        command->action = NULL;
         return 1;
+    }
+    build_table->numberofcommands++;
     return 0;
 }
 
-char * get_lms_command_fragment ( int code ) {
-    for (int i = 0; i < numberofcommands; i++) {
-        if ( code == lms_commands[i].code )
-            return lms_commands[i].fragment;
+static struct lms_command * get_lms_command ( const char * name ) {
+    static struct lms_command none;
+    if (!build_table->commandslots)
+        return &none;
+    return find_command_slot(build_table->commands, build_table->commandslots, name);
+}
+
+char * get_lms_command_fragment ( const char * name ) {
+    return get_lms_command(name)->fragment;
+}
+
+static struct encoder_action * get_encoder_action ( const char * name ) {
+    if (!name || !name[0])
+        return NULL;
+    struct encoder_action * action = get_lms_command(name)->action;
+    if (action)
+        return action;
+    if (get_lms_command(name)->fragment)
+        return NULL;
+    //
+    //  Builtin actions, added to the table on first use
+    //
+    if (strcmp(name, "VOLU") == 0)
+        add_lms_command_frament(name, ACTION_VOLUME);
+    else if (strcmp(name, "TRAC") == 0)
+        add_lms_command_frament(name, ACTION_TRACK);
+    return get_lms_command(name)->action;
+}
+
+//
+//  Put the command for an encoder delta together
+//  delta is limited to +-limit
+//
+static char * format_encoder_action(struct encoder_action * action, int delta) {
+    char * out = action->buffer;
+    memcpy(out, action->prefix, action->prefix_len);
+    out += action->prefix_len;
+    if (delta < 0) {
+        *out++ = '-';
+        delta = -delta;
+    } else if (action->sign == SIGN_EXPLICIT) {
+        *out++ = '+';
     }
-    return NULL;
+    if (delta >= 100)
+        *out++ = '0' + delta / 100;
+    if (delta >= 10)
+        *out++ = '0' + (delta / 10) % 10;
+    *out++ = '0' + delta % 10;
+    memcpy(out, action->suffix, action->suffix_len + 1);
+    return action->buffer;
 }
 
 //
 //  Button press callback
 //  Sets the flag for "button pressed"
+//  Runs on the GPIO edge service, only touches the pin state
 //
 void button_press_cb(const struct button * button, int change, bool presstype) {
-    for (int cnt = 0; cnt < numberofbuttons; cnt++) {
-        if (button == button_ctrls[cnt].gpio_button) {
-            button_ctrls[cnt].presstype = presstype;
-            button_ctrls[cnt].waiting = true;
-            loginfo("Button CB set for button #:%d, gpio pin %d", cnt, button_ctrls[cnt].gpio_button->pin);
-            return;
+    struct pin_state * state = pin_states + button->pin;
+    if (state->select_layer)
+        return;  // layer buttons only act while held
+    metric_inc((presstype == LONGPRESS) ? M_BUTTON_LONG : M_BUTTON_SHORT);
+    if (!state->waiting)
+        metric_inc(M_QUEUE_IN);
+    PROBE2(enqueue, button->pin, presstype);
+    state->presstype = presstype;
+    state->layer = active_layer;
+    memset(&state->stamps, 0, sizeof(state->stamps));
+    state->stamps.edge = button->edge_us;
+    state->stamps.decided = button->decided_us;
+    state->waiting = true;
+    loginfo("Button CB set for gpio pin %d", button->pin);
+}
+
+//
+//  Layer button callback
+//  Runs on the GPIO edge service. The layer held last wins, releasing it
+//  goes back to the base layer.
+//
+static void layer_hold_cb(const struct button * button, bool held) {
+    uint8_t layer = pin_states[button->pin].select_layer;
+    if (held)
+        active_layer = layer;
+    else if (active_layer == layer)
+        active_layer = 0;
+    loginfo("Layer %d %s", layer, held ? "selected" : "released");
+}
+
+//
+//  Check a pin for the table being built
+//
+static bool pin_available(int pin) {
+    struct matrix_ctrl * matrix = &build_table->matrix;
+    if ((pin <= 0) || (pin >= max_pins)) {
+        logerr("Invalid GPIO pin %d", pin);
+        return false;
+    }
+    if ((pin >= VIRTUAL_PIN_BASE) &&
+        (pin >= VIRTUAL_PIN_BASE + matrix->numberofrows * matrix->numberofcolumns) &&
+        ((pin < EXPANDER_PIN_BASE) || !build_table->expander.interrupt)) {
+        logerr("No button matrix key or I/O expander input on virtual pin %d", pin);
+        return false;
+    }
+    if (build_table->expander.interrupt == pin) {
+        logerr("GPIO pin %d used twice", pin);
+        return false;
+    }
+    for (int i = 0; i < matrix->numberofrows; i++) {
+        if (matrix->rows[i] == pin) {
+            logerr("GPIO pin %d used twice", pin);
+            return false;
+        }
+    }
+    for (int i = 0; i < matrix->numberofcolumns; i++) {
+        if (matrix->columns[i] == pin) {
+            logerr("GPIO pin %d used twice", pin);
+            return false;
+        }
+    }
+    for (int i = 0; i < build_table->numberofbuttons; i++) {
+        if (build_table->buttons[i].pin == pin) {
+            logerr("GPIO pin %d used twice", pin);
+            return false;
+        }
+    }
+    for (int i = 0; i < build_table->numberofencoders; i++) {
+        if ((build_table->encoders[i].pin1 == pin) || (build_table->encoders[i].pin2 == pin)) {
+            logerr("GPIO pin %d used twice", pin);
+            return false;
         }
     }
+    return true;
 }
 
 //
-//  Setup button control
-//  Parameters:
-//      pin: the GPIO-Pin-Number
-//      cmd: Command. One of
-//                  PLAY    - play/pause
-//                  VOL+    - increment volume
-//                  VOL-    - decrement volume
-//                  PREV    - previous track
-//                  NEXT    - next track
-//          Command type SCRIPT.
-//                  SCRIPT:/path/to/shell/script.sh
-//      resist: Optional. one of
-//          0 - Internal resistor off
-//          1 - pull down         - input puts 3v on GPIO pin
-//          2 - pull up (default) - input pulls GPIO pin to ground
-//      pressed: Optional GPIO pinstate for button to read pressed
-//          0 - state is 0 (default)
-//          1 - state is 1
-//      cmd_long Command to be used for a long button push, see above command list
-//      long_time: Number of milliseconds to define a long press
+//  Find the element on a pin in the table being built, NULL if there is none
+//
+static struct button_ctrl * find_button(int pin) {
+    for (int i = 0; i < build_table->numberofbuttons; i++) {
+        if (build_table->buttons[i].pin == pin)
+            return build_table->buttons + i;
+    }
+    return NULL;
+}
+
+static struct encoder_ctrl * find_encoder(int pin1, int pin2) {
+    for (int i = 0; i < build_table->numberofencoders; i++) {
+        if ((build_table->encoders[i].pin1 == pin1) && (build_table->encoders[i].pin2 == pin2))
+            return build_table->encoders + i;
+    }
+    return NULL;
+}
 
-int setup_button_ctrl(char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time) {
+//
+//  Fill in the commands of a button or key binding
+//  Script command lines are copied, the table owns them.
+//  Returns: 0 on success, -1 if the short press command is not defined
+//
+static int bind_commands(struct button_binding * binding, struct sbpd_player * player,
+                         char * cmd, char * cmd_long) {
     char * fragment = NULL;
     char * fragment_long = NULL;
     char * script;
@@ -144,17 +459,17 @@ int setup_button_ctrl(char * cmd, int pin, int resist, int pressed, char * cmd_l
     //
     //  Select fragment for short press parameter
     //
-    if (strlen(cmd) == 4) {
-        fragment = get_lms_command_fragment(STRTOU32(cmd));
-        cmdtype = LMS;
-    } else if (strncmp("SCRIPT:", cmd, 7) == 0) {
+    if (strncmp("SCRIPT:", cmd, 7) == 0) {
         cmdtype = SCRIPT;
         strtok( cmd, separator );
         script = strtok( NULL, "" );
-        fragment = script;
+        fragment = script ? strdup(script) : NULL;
+    } else {
+        fragment = get_lms_command_fragment(cmd);
+        cmdtype = LMS;
     }
     if (!fragment){
-        loginfo("Command %s, not found in defined commands", cmd);
+        logerr("Command %s, not found in defined commands", cmd);
         return -1;
     }
     
@@ -163,72 +478,372 @@ int setup_button_ctrl(char * cmd, int pin, int resist, int pressed, char * cmd_l
     //
     if ( cmd_long == NULL ) {
         cmd_longtype = NOTUSED;
-    } else if ( strlen(cmd_long) == 4 ) {
-        fragment_long = get_lms_command_fragment(STRTOU32(cmd_long));
-        cmd_longtype = LMS;
     } else if (strncmp("SCRIPT:", cmd_long, 7) == 0) {
         cmd_longtype = SCRIPT;
         strtok( cmd_long, separator );
         script_long = strtok( NULL, "" );
-        fragment_long = script_long;
+        fragment_long = script_long ? strdup(script_long) : NULL;
+    } else {
+        fragment_long = get_lms_command_fragment(cmd_long);
+        cmd_longtype = LMS;
     }
     if ( (cmd_long != NULL) & (!fragment_long) ){
         loginfo("Command %s, not found in defined commands", cmd_long);
         cmd_longtype = NOTUSED;
     }
+
+    binding->player = player;
+    binding->cmdtype = cmdtype;
+    binding->shortfragment = fragment;
+    binding->cmd_longtype = cmd_longtype;
+    binding->longfragment = fragment_long;
+    binding->shortstats = get_action_stats((cmdtype == SCRIPT) ? "SCRIPT" : cmd);
+    binding->longstats = (cmd_longtype == NOTUSED) ? NULL :
+        get_action_stats((cmd_longtype == SCRIPT) ? "SCRIPT" : cmd_long);
+    binding->inherited = false;
+    return 0;
+}
+
+//
+//  Setup button control
+//  Parameters:
+//      player: the player to control
+//      pin: the GPIO-Pin-Number
+//      cmd: Command. One of
+//                  PLAY    - play/pause
+//                  VOL+    - increment volume
+//                  VOL-    - decrement volume
+//                  PREV    - previous track
+//                  NEXT    - next track
+//          Command type SCRIPT.
+//                  SCRIPT:/path/to/shell/script.sh
+//      resist: Optional. one of
+//          0 - Internal resistor off
+//          1 - pull down         - input puts 3v on GPIO pin
+//          2 - pull up (default) - input pulls GPIO pin to ground
+//      pressed: Optional GPIO pinstate for button to read pressed
+//          0 - state is 0 (default)
+//          1 - state is 1
+//      cmd_long Command to be used for a long button push, see above command list
+//      long_time: Number of milliseconds to define a long press
+//
+//  The button is set up on the GPIO when the table gets activated.
+//  Script command lines are copied, the table owns them.
+
+int setup_button_ctrl(struct sbpd_player * player, int layer, char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time) {
+    struct button_binding binding;
+
+    if (!build_table)
+        return -1;
+    struct button_ctrl * ctrl = find_button(pin);
+    if (ctrl && ctrl->layer) {
+        logerr("GPIO pin %d is a layer button", pin);
+        return -1;
+    }
+    if (ctrl && build_table->layers[layer].buttons[ctrl - build_table->buttons].player) {
+        logerr("Button on pin %d defined twice for layer %d", pin, layer);
+        return -1;
+    }
+    if (!ctrl && (build_table->numberofbuttons == max_buttons)) {
+        logerr("Maximum number of buttons exceded: %i", max_buttons);
+        return -1;
+    }
+    if (!ctrl && !pin_available(pin))
+        return -1;
+    if (bind_commands(&binding, player, cmd, cmd_long) != 0)
+        return -1;
    
     // Make sure resistor setting makes sense, or reset to default
     if ( (resist != PUD_OFF) && (resist != PUD_DOWN) && (resist == PUD_UP) )
         resist = PUD_UP;
 
-    struct button * gpio_b = setupbutton(pin, button_press_cb, resist, (bool)(pressed == 0) ? 0 : 1, long_time);
+    //
+    //  The first element on a pin sets up its GPIO parameters
+    //
+    if (!ctrl) {
+        ctrl = build_table->buttons + build_table->numberofbuttons++;
+        ctrl->gpio_button = NULL;
+        ctrl->pin = pin;
+        ctrl->resist = resist;
+        ctrl->pressed = (pressed == 0) ? 0 : 1;
+        ctrl->long_time = long_time;
+        ctrl->layer = 0;
+    }
+    build_table->layers[layer].buttons[ctrl - build_table->buttons] = binding;
+    loginfo("Button defined: Player %s, Layer %d, Pin %d, BCM Resistor: %s, Short Type: %s, Short Fragment: %s , Long Type: %s, Long Fragment: %s, Long Press Time: %i",
+            player->name ? player->name : "default",
+            layer,
+            pin,
+            (ctrl->resist == PUD_OFF) ? "both" :
+            (ctrl->resist == PUD_DOWN) ? "down" : "up",
+            (binding.cmdtype == LMS) ? "LMS" :
+            (binding.cmdtype == SCRIPT) ? "Script" : "unused",
+            binding.shortfragment,
+            (binding.cmd_longtype == LMS) ? "LMS" :
+            (binding.cmd_longtype == SCRIPT) ? "Script" : "unused",
+            binding.longfragment,
+            ctrl->long_time);
+    return 0;
+}
+
+//
+//  Setup layer button
+//  The layer is selected from the edge service, see layer_hold_cb
+//
+int setup_layer_ctrl(int pin, int layer, int resist, int pressed) {
+    if (!build_table || (build_table->numberofbuttons == max_buttons)) {
+        logerr("Maximum number of buttons exceded: %i", max_buttons);
+        return -1;
+    }
+    if ((layer < 1) || (layer >= max_layers)) {
+        logerr("Invalid layer %d", layer);
+        return -1;
+    }
+    if (!pin_available(pin))
+        return -1;
+    if ( (resist != PUD_OFF) && (resist != PUD_DOWN) )
+        resist = PUD_UP;
+    struct button_ctrl * ctrl = build_table->buttons + build_table->numberofbuttons++;
+    ctrl->gpio_button = NULL;
+    ctrl->pin = pin;
+    ctrl->resist = resist;
+    ctrl->pressed = (pressed == 0) ? 0 : 1;
+    ctrl->long_time = 0;
+    ctrl->layer = layer;
+    loginfo("Layer button defined: Pin %d, Layer %d", pin, layer);
+    return 0;
+}
+
+//
+//  Setup button matrix
+//  Rows and columns are checked like any other pins
+//
+int setup_matrix_ctrl(const int * rows, int numberofrows, const int * columns, int numberofcolumns) {
+    if (!build_table)
+        return -1;
+    struct matrix_ctrl * matrix = &build_table->matrix;
+    if (matrix->numberofrows) {
+        logerr("Only one button matrix supported");
+        return -1;
+    }
+    if ((numberofrows < 1) || (numberofrows > max_matrix_rows) ||
+        (numberofcolumns < 1) || (numberofcolumns > max_matrix_columns) ||
+        (numberofrows * numberofcolumns > max_virtual_pins)) {
+        logerr("Button matrix of %d x %d keys not supported", numberofrows, numberofcolumns);
+        return -1;
+    }
+    if (build_table->expander.interrupt &&
+        (numberofrows * numberofcolumns > EXPANDER_PIN_BASE - VIRTUAL_PIN_BASE)) {
+        logerr("Button matrix keys overlap the I/O expander inputs");
+        return -1;
+    }
+    for (int i = 0; i < numberofrows + numberofcolumns; i++) {
+        int pin = (i < numberofrows) ? rows[i] : columns[i - numberofrows];
+        if ((pin >= VIRTUAL_PIN_BASE) || !pin_available(pin))
+            return -1;
+        for (int j = 0; j < i; j++) {
+            if (pin == ((j < numberofrows) ? rows[j] : columns[j - numberofrows])) {
+                logerr("GPIO pin %d used twice", pin);
+                return -1;
+            }
+        }
+    }
+    memcpy(matrix->rows, rows, numberofrows * sizeof(int));
+    memcpy(matrix->columns, columns, numberofcolumns * sizeof(int));
+    matrix->numberofcolumns = numberofcolumns;
+    matrix->numberofrows = numberofrows;
+    loginfo("Button matrix defined: %d rows, %d columns, keys on pins %d..%d",
+            numberofrows, numberofcolumns, VIRTUAL_PIN_BASE,
+            VIRTUAL_PIN_BASE + numberofrows * numberofcolumns - 1);
+    return 0;
+}
 
-    button_ctrls[numberofbuttons].cmdtype = cmdtype;
-    button_ctrls[numberofbuttons].shortfragment = fragment;
-    button_ctrls[numberofbuttons].cmd_longtype = cmd_longtype;
-    button_ctrls[numberofbuttons].longfragment = fragment_long;
-    button_ctrls[numberofbuttons].waiting = false;
-    button_ctrls[numberofbuttons].gpio_button = gpio_b;
-    numberofbuttons++;
-    loginfo("Button defined: Pin %d, BCM Resistor: %s, Short Type: %s, Short Fragment: %s , Long Type: %s, Long Fragment: %s, Long Press Time: %i",
+//
+//  Setup I/O expander
+//  The interrupt pin is checked like any other pin
+//
+int setup_expander_ctrl(int interrupt, int address, int bus) {
+    if (!build_table)
+        return -1;
+    struct expander_ctrl * expander = &build_table->expander;
+    struct matrix_ctrl * matrix = &build_table->matrix;
+    if (expander->interrupt) {
+        logerr("Only one I/O expander supported");
+        return -1;
+    }
+    if ((address < 0x20) || (address > 0x27) || (bus < 0)) {
+        logerr("No I/O expander address 0x%02x on I2C bus %d", address, bus);
+        return -1;
+    }
+    if (matrix->numberofrows * matrix->numberofcolumns > EXPANDER_PIN_BASE - VIRTUAL_PIN_BASE) {
+        logerr("Button matrix keys overlap the I/O expander inputs");
+        return -1;
+    }
+    if ((interrupt >= VIRTUAL_PIN_BASE) || !pin_available(interrupt))
+        return -1;
+    expander->interrupt = interrupt;
+    expander->address = address;
+    expander->bus = bus;
+    loginfo("I/O expander defined: Address 0x%02x, I2C bus %d, Interrupt pin %d, inputs on pins %d..%d",
+            address, bus, interrupt, EXPANDER_PIN_BASE, EXPANDER_PIN_BASE + max_expander_pins - 1);
+    return 0;
+}
 
-            pin,
-            (resist == PUD_OFF) ? "both" :
-            (resist == PUD_DOWN) ? "down" : "up",
-            (cmdtype == LMS) ? "LMS" :
-            (cmdtype == SCRIPT) ? "Script" : "unused",
-            fragment,
-            (cmd_longtype == LMS) ? "LMS" :
-            (cmd_longtype == SCRIPT) ? "Script" : "unused",
-            fragment_long,
-            long_time);
+//
+//  Setup input device
+//  Its keys are bound with setup_key_ctrl
+//
+int setup_input_ctrl(const char * path, bool grab) {
+    if (!build_table)
+        return -1;
+    if (build_table->numberofinputs == max_input_devices) {
+        logerr("Maximum number of input devices exceded: %i", max_input_devices);
+        return -1;
+    }
+    for (int i = 0; i < build_table->numberofinputs; i++) {
+        if (!strcmp(build_table->inputs[i].path, path)) {
+            logerr("Input device %s defined twice", path);
+            return -1;
+        }
+    }
+    struct input_ctrl * ctrl = build_table->inputs + build_table->numberofinputs;
+    ctrl->path = strdup(path);
+    if (!ctrl->path)
+        return -1;
+    ctrl->device = NULL;
+    ctrl->grab = grab;
+    build_table->numberofinputs++;
+    loginfo("Input device defined: %s%s", path, grab ? ", grabbed" : "");
     return 0;
 }
 
+//
+//  Setup key control
+//  Keys are bound like buttons, they act on all input devices.
+//  Script command lines are copied, the table owns them.
+//
+int setup_key_ctrl(struct sbpd_player * player, int layer, char * cmd, int code, char * cmd_long, int long_time) {
+    struct button_binding binding;
+
+    if (!build_table)
+        return -1;
+    struct key_ctrl * ctrl = NULL;
+    for (int i = 0; i < build_table->numberofkeys; i++) {
+        if (build_table->keys[i].code == code)
+            ctrl = build_table->keys + i;
+    }
+    if (ctrl && build_table->layers[layer].keys[ctrl - build_table->keys].player) {
+        logerr("Key %d defined twice for layer %d", code, layer);
+        return -1;
+    }
+    if (!ctrl && (build_table->numberofkeys == max_keys)) {
+        logerr("Maximum number of keys exceded: %i", max_keys);
+        return -1;
+    }
+    if (bind_commands(&binding, player, cmd, cmd_long) != 0)
+        return -1;
+
+    //
+    //  The first element on a key sets its long press time
+    //
+    if (!ctrl) {
+        ctrl = build_table->keys + build_table->numberofkeys++;
+        ctrl->code = code;
+        ctrl->long_time = long_time;
+    }
+    build_table->layers[layer].keys[ctrl - build_table->keys] = binding;
+    loginfo("Key defined: Player %s, Layer %d, Code %d, Short Fragment: %s, Long Fragment: %s, Long Press Time: %i",
+            player->name ? player->name : "default",
+            layer,
+            code,
+            binding.shortfragment,
+            binding.longfragment,
+            ctrl->long_time);
+    return 0;
+}
+
+//
+//  Send the command of a binding for a press
+//
+static void send_binding(struct button_binding * binding, bool presstype,
+                         struct latency_stamps * stamps) {
+    if ( !binding->player ) {
+        loginfo("Button not used in this layer");
+    } else if ( presstype == SHORTPRESS ) {
+        if ( binding->shortfragment != NULL ) {
+            send_command(binding->player, binding->cmdtype, binding->shortfragment, stamps);
+            record_action(binding->shortstats, stamps);
+        } 
+    } else if ( presstype == LONGPRESS ) {
+        if ( binding->longfragment != NULL ) {
+            send_command(binding->player, binding->cmd_longtype, binding->longfragment, stamps);
+            record_action(binding->longstats, stamps);
+        } else {
+            loginfo("No Long Press command configured");
+        }
+    }
+}
+
+//
+//  Input device key callback
+//  Runs on the main loop, so a press is sent as soon as the key comes up.
+//  It uses the layer selected at that time, like a button.
+//
+static void key_event_cb(const struct input_device * device, int code, bool down, uint64_t time_us) {
+    struct control_table * table = active_table;
+    int index = 0;
+    while (table && (index < table->numberofkeys) && (table->keys[index].code != code))
+        index++;
+    if (!table || (index == table->numberofkeys)) {
+        logdebug("Key %d not bound", code);
+        return;
+    }
+    if (down) {
+        key_down_us[index] = time_us;
+        return;
+    }
+    if (!key_down_us[index])
+        return;
+    uint64_t duration = (time_us > key_down_us[index]) ? (time_us - key_down_us[index]) / 1000 : 0;
+    key_down_us[index] = 0;
+    bool presstype = (duration > (uint64_t)table->keys[index].long_time) ? LONGPRESS : SHORTPRESS;
+    metric_inc((presstype == LONGPRESS) ? M_BUTTON_LONG : M_BUTTON_SHORT);
+
+    struct latency_stamps stamps;
+    memset(&stamps, 0, sizeof(stamps));
+    stamps.edge = time_us;
+    stamps.decided = us_timer();
+    stamps.dispatched = stamps.decided;
+    uint8_t layer = active_layer;
+    trace(TRACE_KEY, code, presstype);
+    loginfo("Key pressed: Code: %d, Layer: %d, Press Type:%s", code, layer,
+            (presstype == LONGPRESS) ? "Long" : "Short");
+    send_binding(table->layers[layer].keys + index, presstype, &stamps);
+}
+
 //
 //  Polling function: handle button commands
-//  Parameters:
-//      server: the server to send commands to
+//  Commands go to the server of each button's player
 //
-void handle_buttons(struct sbpd_server * server) {
+void handle_buttons() {
     //logdebug("Polling buttons");
-    for (int cnt = 0; cnt < numberofbuttons; cnt++) {
-        if (button_ctrls[cnt].waiting) {
-            loginfo("Button pressed: Pin: %d, Press Type:%s", button_ctrls[cnt].gpio_button->pin,
-                   (button_ctrls[cnt].presstype == LONGPRESS) ? "Long" : "Short" );
-            if ( button_ctrls[cnt].presstype == SHORTPRESS ) {
-                if ( button_ctrls[cnt].shortfragment != NULL ) {
-                    send_command(server, button_ctrls[cnt].cmdtype, button_ctrls[cnt].shortfragment);
-                } 
-            }
-            if ( button_ctrls[cnt].presstype == LONGPRESS ) {
-                if ( button_ctrls[cnt].longfragment != NULL ) {
-                    send_command(server, button_ctrls[cnt].cmd_longtype, button_ctrls[cnt].longfragment);
-                } else {
-                    loginfo("No Long Press command configured");
-                }
-            }
-            button_ctrls[cnt].waiting = false;  // clear waiting
+    struct control_table * table = __atomic_load_n(&active_table, __ATOMIC_ACQUIRE);
+    if (!table)
+        return;
+    for (int cnt = 0; cnt < table->numberofbuttons; cnt++) {
+        struct button_ctrl * ctrl = table->buttons + cnt;
+        struct pin_state * state = pin_states + ctrl->pin;
+        if (ctrl->gpio_button && state->waiting) {
+            // layer at the time of the press
+            struct button_binding * binding = table->layers[state->layer].buttons + cnt;
+            struct latency_stamps * stamps = &state->stamps;
+            stamps->dispatched = us_timer();
+            trace(TRACE_DISPATCH, ctrl->pin, state->presstype);
+            loginfo("Button pressed: Pin: %d, Layer: %d, Press Type:%s", ctrl->pin, state->layer,
+                   (state->presstype == LONGPRESS) ? "Long" : "Short" );
+            send_binding(binding, state->presstype, stamps);
+            state->waiting = false;  // clear waiting
+            metric_inc(M_QUEUE_OUT);
         }
     }
 }
@@ -239,16 +854,15 @@ void handle_buttons(struct sbpd_server * server) {
 //  Currently does nothing since we poll for volume changes
 //
 void encoder_rotate_cb(const struct encoder * encoder, long change) {
-    logdebug("Interrupt: encoder value: %d change: %d", encoder->value, change);
+    logdebug("Interrupt: encoder value: %ld change: %ld", encoder->value, change);
 }
 
 //
 //  Setup encoder control
 //  Parameters:
-//      cmd: Command. Currently only
-//                  VOLU    - volume
-//                  TRAC    - previous or next track
-//          Can be NULL for volume
+//      player: the player to control
+//      cmd: Name of an encoder action from the command configuration,
+//           VOLU and TRAC are builtin. Required, there is no default
 //      pin1: the GPIO-Pin-Number for the first pin used
 //      pin2: the GPIO-Pin-Number for the second pin used
 //      edge: one of
@@ -256,53 +870,75 @@ void encoder_rotate_cb(const struct encoder * encoder, long change) {
 //                  2 - rising edge
 //                  0, 3 - both
 //
+//  The encoder is set up on the GPIO when the table gets activated.
 //
-int setup_encoder_ctrl(char * cmd, int pin1, int pin2, int edge) {
-    char * fragment = NULL;
-    if (strlen(cmd) > 4)
+int setup_encoder_ctrl(struct sbpd_player * player, int layer, char * cmd, int pin1, int pin2, int edge) {
+    if (!build_table)
         return -1;
+    struct encoder_ctrl * ctrl = find_encoder(pin1, pin2);
+    if (ctrl && build_table->layers[layer].encoders[ctrl - build_table->encoders].player) {
+        logerr("Encoder on pins %d, %d defined twice for layer %d", pin1, pin2, layer);
+        return -1;
+    }
+    if (!ctrl && (build_table->numberofencoders == max_encoders)) {
+        logerr("Maximum number of encodered exceded: %i", max_encoders);
+        return -1;
+    }
+    if (!ctrl && (((pin1 >= VIRTUAL_PIN_BASE) && (pin1 < EXPANDER_PIN_BASE)) ||
+                  ((pin2 >= VIRTUAL_PIN_BASE) && (pin2 < EXPANDER_PIN_BASE)))) {
+        logerr("Encoders need GPIO pins or I/O expander inputs");
+        return -1;
+    }
+    if (!ctrl && (!pin_available(pin1) || !pin_available(pin2) || (pin1 == pin2)))
+        return -1;
+    if (!cmd || !cmd[0]) {
+        logerr("Encoder on pins %d, %d: no action", pin1, pin2);
+        return -1;
+    }
+    struct encoder_action * action = get_encoder_action(cmd);
+    if ( action == NULL ) {
+        logerr("No encoder action %s", cmd);
+        return -1;
+    }
+
     //
-    //  Select fragment for parameter
-    //  Would love to "switch" here but that's not portable...
+    //  The first element on the pins sets up their GPIO parameters
     //
-    uint32_t code = STRTOU32(cmd);
-    if (code == STRTOU32("VOLU")) {
-        fragment = FRAGMENT_VOLUME;
-        encoder_ctrls[numberofencoders].limit = 100;
-        encoder_ctrls[numberofencoders].min_time = 0;
-    } else if (code == STRTOU32("TRAC")) {
-        fragment = FRAGMENT_TRACK;
-        encoder_ctrls[numberofencoders].limit = 1;
-        encoder_ctrls[numberofencoders].min_time = 500;
-    } 
-    if ( fragment == NULL ) {
-        return -1;
-    }
-
-    struct encoder * gpio_e = setupencoder(pin1, pin2, encoder_rotate_cb, edge);
-    encoder_ctrls[numberofencoders].fragment = fragment;
-    encoder_ctrls[numberofencoders].gpio_encoder = gpio_e;
-    encoder_ctrls[numberofencoders].last_value = 0;
-    encoder_ctrls[numberofencoders].last_time = 0;
-    numberofencoders++;
-    loginfo("Rotary encoder defined: Pin %d, %d, Edge: %s, Fragment: \n%s",
+    if (!ctrl) {
+        if ((edge != INT_EDGE_FALLING) && (edge != INT_EDGE_RISING))
+            edge = INT_EDGE_BOTH;
+        ctrl = build_table->encoders + build_table->numberofencoders++;
+        ctrl->gpio_encoder = NULL;
+        ctrl->pin1 = pin1;
+        ctrl->pin2 = pin2;
+        ctrl->edge = edge;
+    }
+    struct encoder_binding * binding = build_table->layers[layer].encoders + (ctrl - build_table->encoders);
+    binding->player = player;
+    binding->action = action;
+    binding->stats = get_action_stats(cmd);
+    loginfo("Rotary encoder defined: Player %s, Layer %d, Pin %d, %d, Edge: %s, Fragment: \n%s%%d%s",
+            player->name ? player->name : "default",
+            layer,
             pin1, pin2,
-            ((edge != INT_EDGE_FALLING) && (edge != INT_EDGE_RISING)) ? "both" :
-            (edge == INT_EDGE_FALLING) ? "falling" : "rising",
-            fragment);
+            ((ctrl->edge != INT_EDGE_FALLING) && (ctrl->edge != INT_EDGE_RISING)) ? "both" :
+            (ctrl->edge == INT_EDGE_FALLING) ? "falling" : "rising",
+            action->prefix, action->suffix);
     return 0;
 }
 
 //
 //  Polling function: handle encoder commands
-//  Parameters:
-//      server: the server to send commands to
+//  Commands go to the server of each encoder's player
 //
-void handle_encoders(struct sbpd_server * server) {
+void handle_encoders() {
     //
-    //  chatter filter set duration in encoder setup.
+    //  Rate limit per encoder, a token bucket refilled every min_time
     //      - volume set to 0...
     //      - track change set to 500ms
+    //  Steps that can't be sent yet stay in the accumulator (value not yet
+    //  consumed) and go out with the next command. Steps of a failed command
+    //  stay too, but at most the action's limit of them is carried on.
     //  We poll every 100ms anyway plus wait for network action to complete
     //
     long long time = ms_timer();
@@ -310,49 +946,294 @@ void handle_encoders(struct sbpd_server * server) {
     //logdebug("Polling encoders");
 
     int command = LMS;
+    struct control_table * table = __atomic_load_n(&active_table, __ATOMIC_ACQUIRE);
+    if (!table)
+        return;
+    struct control_layer * layer = table->layers + active_layer;
 
-    for (int cnt = 0; cnt < numberofencoders; cnt++) {
+    for (int cnt = 0; cnt < table->numberofencoders; cnt++) {
+        struct encoder_ctrl * ctrl = table->encoders + cnt;
+        struct encoder_binding * binding = layer->encoders + cnt;
+        struct encoder * gpio_encoder = ctrl->gpio_encoder;
+        struct pin_state * state = pin_states + ctrl->pin1;
+        if (!gpio_encoder)
+            continue;
         //
-        //  build volume delta
-        //  ignore if > 100: overflow
+        //  Steps not sent yet
         //
-        int delta = (int)(encoder_ctrls[cnt].gpio_encoder->value - encoder_ctrls[cnt].last_value);
-        if (delta > 100)
-            delta = 0;
-        if (delta != 0) {
-            //Check if change happened before minimum delay, clear out data.
-            if ( encoder_ctrls[cnt].last_time + encoder_ctrls[cnt].min_time > time ) {
-                loginfo("Encoder on GPIO %d, %d value change: %d, before %d ms ellapsed not sending lms command.",
-                    encoder_ctrls[cnt].gpio_encoder->pin_a,
-                    encoder_ctrls[cnt].gpio_encoder->pin_b,
-                    delta,
-                    (encoder_ctrls[cnt].min_time) );
-                encoder_ctrls[cnt].last_value = encoder_ctrls[cnt].gpio_encoder->value;
-                return;
-            }
+        int delta = (int)(gpio_encoder->value - state->last_value);
+        if (delta == 0)
+            continue;
+        if (!binding->action) {
+            // not used in this layer
+            state->last_value = gpio_encoder->value;
+            gpio_encoder->first_edge_us = 0;
+            continue;
+        }
+        //
+        //  Token bucket, kept as the time the bucket was last empty:
+        //  full after ENCODER_BURST intervals without a command
+        //
+        long long interval = binding->action->min_time;
+        if (state->bucket_time < time - ENCODER_BURST * interval)
+            state->bucket_time = time - ENCODER_BURST * interval;
+        if (state->bucket_time + interval > time) {
+            logdebug("Encoder on GPIO %d, %d: %d steps waiting for the next %lld ms interval",
+                     gpio_encoder->pin_a, gpio_encoder->pin_b, delta, interval);
+            continue;
+        }
+        state->bucket_time += interval;
 
-            loginfo("Encoder on GPIO %d, %d value change: %d",
-                    encoder_ctrls[cnt].gpio_encoder->pin_a,
-                    encoder_ctrls[cnt].gpio_encoder->pin_b,
-                    delta);
+        loginfo("Encoder on GPIO %d, %d value change: %d",
+                gpio_encoder->pin_a,
+                gpio_encoder->pin_b,
+                delta);
 
-            char fragment[50];
-            char * prefix = (delta > 0) ? "+" : "-";
-            if ( abs(delta) > encoder_ctrls[cnt].limit ) {
-                     delta = encoder_ctrls[cnt].limit;
-            }
-            snprintf(fragment, sizeof(fragment),
-                     encoder_ctrls[cnt].fragment, prefix, abs(delta));
+        //
+        //  More than limit steps: the rest is sent with the next command
+        //
+        if ( delta > binding->action->limit )
+            delta = binding->action->limit;
+        else if ( delta < -binding->action->limit )
+            delta = -binding->action->limit;
+        PROBE2(encoder_delta, gpio_encoder->pin_a, delta);
+        char * fragment = format_encoder_action(binding->action, delta);
 
-            if (send_command(server, command, fragment)) {
-                encoder_ctrls[cnt].last_value = encoder_ctrls[cnt].gpio_encoder->value;
-                encoder_ctrls[cnt].last_time = time; // chatter filter
-            }
+        struct latency_stamps stamps;
+        memset(&stamps, 0, sizeof(stamps));
+        stamps.edge = gpio_encoder->first_edge_us;
+        stamps.decided = gpio_encoder->decided_us;
+        stamps.dispatched = us_timer();
+        trace(TRACE_DISPATCH, gpio_encoder->pin_a, (uint32_t)delta);
+        if (abs(delta) > 1)
+            metric_add(M_COMMANDS_COALESCED, abs(delta) - 1);
+        //
+        //  Steps are consumed only when sent. After a failure they are
+        //  retried with the next interval, but no more than one command's
+        //  worth: a long outage doesn't replay a pile of stale steps.
+        //
+        if (send_command(binding->player, command, fragment, &stamps)) {
+            record_action(binding->stats, &stamps);
+            state->last_value += delta;
+            gpio_encoder->first_edge_us = 0;
+        } else {
+            long pending = gpio_encoder->value - state->last_value;
+            long limit = binding->action->limit;
+            if (pending > limit)
+                state->last_value = gpio_encoder->value - limit;
+            else if (pending < -limit)
+                state->last_value = gpio_encoder->value + limit;
         }
     }
 }
 
+//
+//  Start a new control table
+//
+int begin_controls() {
+    abort_controls();
+    build_table = calloc(1, sizeof(struct control_table));
+    if (!build_table) {
+        logerr("No memory for control table");
+        return -1;
+    }
+    return 0;
+}
+
+static void free_table(struct control_table * table) {
+    if (!table)
+        return;
+    for (int l = 0; l < max_layers; l++) {
+        for (int i = 0; i < table->numberofbuttons + table->numberofkeys; i++) {
+            struct button_binding * binding = (i < table->numberofbuttons) ?
+                table->layers[l].buttons + i : table->layers[l].keys + i - table->numberofbuttons;
+            if (!binding->player || binding->inherited)
+                continue;
+            if (binding->cmdtype == SCRIPT)
+                free(binding->shortfragment);
+            if (binding->cmd_longtype == SCRIPT)
+                free(binding->longfragment);
+        }
+    }
+    for (int i = 0; i < table->numberofinputs; i++)
+        free(table->inputs[i].path);
+    for (size_t i = 0; i < table->commandslots; i++) {
+        free(table->commands[i].name);
+        free(table->commands[i].fragment);
+        free_encoder_action(table->commands[i].action);
+    }
+    free(table->commands);
+    free(table);
+}
+
+void abort_controls() {
+    free_table(build_table);
+    build_table = NULL;
+}
+
+//
+//  Find an element with the same pins and pin settings
+//
+static struct button_ctrl * same_button(struct control_table * table,
+                                        const struct button_ctrl * ctrl) {
+    for (int i = 0; table && (i < table->numberofbuttons); i++) {
+        struct button_ctrl * other = table->buttons + i;
+        if ((other->pin == ctrl->pin) && (other->resist == ctrl->resist) &&
+            (other->pressed == ctrl->pressed) && (other->long_time == ctrl->long_time))
+            return other;
+    }
+    return NULL;
+}
+
+static struct encoder_ctrl * same_encoder(struct control_table * table,
+                                          const struct encoder_ctrl * ctrl) {
+    for (int i = 0; table && (i < table->numberofencoders); i++) {
+        struct encoder_ctrl * other = table->encoders + i;
+        if ((other->pin1 == ctrl->pin1) && (other->pin2 == ctrl->pin2) &&
+            (other->edge == ctrl->edge))
+            return other;
+    }
+    return NULL;
+}
+
+//
+//  Activate the new control table
+//  First the GPIO elements that changed or are gone are released, then
+//  the new ones are set up. Unchanged elements keep their GPIO element
+//  and pin state.
+//
+void commit_controls() {
+    struct control_table * table = build_table;
+    struct control_table * old = active_table;
+    if (!table)
+        return;
+    build_table = NULL;
 
+    //
+    //  Complete the layers with the base bindings
+    //
+    for (int l = 1; l < max_layers; l++) {
+        for (int i = 0; i < table->numberofbuttons; i++) {
+            struct button_binding * binding = table->layers[l].buttons + i;
+            if (!binding->player) {
+                *binding = table->layers[0].buttons[i];
+                binding->inherited = true;
+            }
+        }
+        for (int i = 0; i < table->numberofencoders; i++) {
+            if (!table->layers[l].encoders[i].player)
+                table->layers[l].encoders[i] = table->layers[0].encoders[i];
+        }
+        for (int i = 0; i < table->numberofkeys; i++) {
+            struct button_binding * binding = table->layers[l].keys + i;
+            if (!binding->player) {
+                *binding = table->layers[0].keys[i];
+                binding->inherited = true;
+            }
+        }
+    }
+
+    for (int i = 0; old && (i < old->numberofbuttons); i++) {
+        struct button_ctrl * ctrl = old->buttons + i;
+        if (ctrl->gpio_button && !same_button(table, ctrl)) {
+            loginfo("Releasing button on pin %d", ctrl->pin);
+            release_button(ctrl->gpio_button);
+        }
+    }
+    for (int i = 0; old && (i < old->numberofencoders); i++) {
+        struct encoder_ctrl * ctrl = old->encoders + i;
+        if (ctrl->gpio_encoder && !same_encoder(table, ctrl)) {
+            loginfo("Releasing encoder on pins %d, %d", ctrl->pin1, ctrl->pin2);
+            release_encoder(ctrl->gpio_encoder);
+        }
+    }
+    struct matrix_ctrl none = { .numberofrows = 0 };
+    struct matrix_ctrl * old_matrix = old ? &old->matrix : &none;
+    bool same_matrix = (old_matrix->numberofrows == table->matrix.numberofrows) &&
+        (old_matrix->numberofcolumns == table->matrix.numberofcolumns) &&
+        !memcmp(old_matrix->rows, table->matrix.rows, table->matrix.numberofrows * sizeof(int)) &&
+        !memcmp(old_matrix->columns, table->matrix.columns, table->matrix.numberofcolumns * sizeof(int));
+    if (!same_matrix) {
+        if (old_matrix->numberofrows)
+            release_matrix();
+        //
+        //  A matrix that failed is dropped from the table,
+        //  the next reload tries again
+        //
+        if (table->matrix.numberofrows &&
+            (setup_matrix(table->matrix.rows, table->matrix.numberofrows,
+                          table->matrix.columns, table->matrix.numberofcolumns) != 0)) {
+            logerr("Button matrix not set up, its keys stay released");
+            memset(&table->matrix, 0, sizeof(table->matrix));
+        }
+    }
+    //
+    //  Input devices are kept if their path and grab didn't change
+    //
+    for (int i = 0; old && (i < old->numberofinputs); i++) {
+        struct input_ctrl * ctrl = old->inputs + i;
+        struct input_ctrl * same = NULL;
+        for (int j = 0; j < table->numberofinputs; j++) {
+            if (!strcmp(table->inputs[j].path, ctrl->path) && (table->inputs[j].grab == ctrl->grab))
+                same = table->inputs + j;
+        }
+        if (same)
+            same->device = ctrl->device;
+        else if (ctrl->device)
+            release_input_device(ctrl->device);
+    }
+    for (int i = 0; i < table->numberofinputs; i++) {
+        struct input_ctrl * ctrl = table->inputs + i;
+        if (!ctrl->device)
+            ctrl->device = setup_input_device(ctrl->path, ctrl->grab, key_event_cb);
+    }
+    memset(key_down_us, 0, sizeof(key_down_us));
 
+    struct expander_ctrl no_expander = { .interrupt = 0 };
+    struct expander_ctrl * old_expander = old ? &old->expander : &no_expander;
+    if (memcmp(old_expander, &table->expander, sizeof(struct expander_ctrl))) {
+        if (old_expander->interrupt)
+            release_expander();
+        // like the matrix, a failed expander is tried again on the next reload
+        if (table->expander.interrupt &&
+            (setup_expander(table->expander.interrupt, table->expander.address,
+                            table->expander.bus) != 0)) {
+            logerr("I/O expander not set up, its inputs stay released");
+            memset(&table->expander, 0, sizeof(table->expander));
+        }
+    }
 
+    int kept = 0;
+    for (int i = 0; i < table->numberofbuttons; i++) {
+        struct button_ctrl * ctrl = table->buttons + i;
+        struct button_ctrl * same = same_button(old, ctrl);
+        if (same && same->gpio_button) {
+            ctrl->gpio_button = same->gpio_button;
+            kept++;
+        } else {
+            memset(pin_states + ctrl->pin, 0, sizeof(struct pin_state));
+            ctrl->gpio_button = setupbutton(ctrl->pin, button_press_cb, ctrl->resist,
+                                            ctrl->pressed, ctrl->long_time);
+        }
+        pin_states[ctrl->pin].select_layer = ctrl->layer;
+        if (ctrl->gpio_button)
+            ctrl->gpio_button->hold = ctrl->layer ? layer_hold_cb : NULL;
+    }
+    for (int i = 0; i < table->numberofencoders; i++) {
+        struct encoder_ctrl * ctrl = table->encoders + i;
+        struct encoder_ctrl * same = same_encoder(old, ctrl);
+        if (same && same->gpio_encoder) {
+            ctrl->gpio_encoder = same->gpio_encoder;
+            kept++;
+            continue;
+        }
+        memset(pin_states + ctrl->pin1, 0, sizeof(struct pin_state));
+        ctrl->gpio_encoder = setupencoder(ctrl->pin1, ctrl->pin2, encoder_rotate_cb, ctrl->edge);
+    }
 
+    active_layer = 0;
+    __atomic_store_n(&active_table, table, __ATOMIC_RELEASE);
+    free_table(old);
+    loginfo("Controls active: %d buttons, %d encoders, %d unchanged",
+            table->numberofbuttons, table->numberofencoders, kept);
+}
@@ -37,24 +37,54 @@
 
 #include "sbpd.h"
 #include "GPIO.h"
+#include "evdev.h"
+#include "stats.h"
 
 //
-//  Store command parameters for each button used
+//  Layers
+//  Layer 0 is the base layer. While a layer button is held the buttons
+//  and encoders use the bindings of its layer, elements not bound in a
+//  layer keep their base binding.
+//
+#define max_layers 4
+
+//
+//  Store GPIO parameters for each button used
+//  Part of the control table and never changed once the table is active,
+//  pending presses are kept per pin in control.c
 //
 struct button_ctrl
 {
-    struct button * gpio_button;
-    volatile bool waiting;
+    struct button * gpio_button;    // set when the table is activated
+    int pin;
+    int resist;
+    int pressed;
+    int long_time;
+    int layer;                      // layer button: layer selected while held
+};
+
+//
+//  Command parameters of a button in one layer
+//
+struct button_binding
+{
+    struct sbpd_player * player;    // NULL: does nothing in this layer
     char * shortfragment;
     char * longfragment;
-    bool presstype;
     int cmdtype;
     int cmd_longtype;
+    struct action_stats * shortstats;
+    struct action_stats * longstats;
+    bool inherited;                 // copy of the base layer binding
 };
 
 //
 //  Setup button control
+//  Adds the button to the control table being built, or binds a button
+//  already added to another layer
 //  Parameters:
+//      player: the player to control
+//      layer: 0 for the base layer, 1 .. max_layers - 1
 //      cmd: Command type LMS. One of
 //                  PLAY    - play/pause
 //                  VOL+    - increment volume
@@ -69,33 +99,135 @@ struct button_ctrl
 //                  2 - rising edge
 //                  0, 3 - both
 //
-int setup_button_ctrl(char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time);
+int setup_button_ctrl(struct sbpd_player * player, int layer, char * cmd, int pin, int resist, int pressed, char * cmd_long, int long_time);
 
 //
-//  Polling function: handle button commands
+//  Setup layer button
+//  Adds a button that selects a layer while it is held
+//  Parameters:
+//      pin: the GPIO-Pin-Number
+//      layer: 1 .. max_layers - 1
+//      resist, pressed: as for setup_button_ctrl
+//
+int setup_layer_ctrl(int pin, int layer, int resist, int pressed);
+
+//
+//  Button matrix of the control table
+//  The keys are used as buttons on virtual pins, see GPIO.h
+//
+struct matrix_ctrl
+{
+    int rows[max_matrix_rows];
+    int numberofrows;               // 0: no matrix
+    int columns[max_matrix_columns];
+    int numberofcolumns;
+};
+
+//
+//  Setup button matrix
+//  Define it before the buttons on its keys
+//  Parameters:
+//      rows, numberofrows: GPIO-Pin-Numbers of the rows
+//      columns, numberofcolumns: GPIO-Pin-Numbers of the columns
+//
+int setup_matrix_ctrl(const int * rows, int numberofrows, const int * columns, int numberofcolumns);
+
+//
+//  I/O expander of the control table
+//  The inputs are used as buttons and encoders on virtual pins, see GPIO.h
+//
+struct expander_ctrl
+{
+    int interrupt;                  // 0: no expander
+    int address;
+    int bus;
+};
+
+//
+//  Setup I/O expander
+//  Define it before the buttons and encoders on its inputs
+//  Parameters:
+//      interrupt: GPIO-Pin-Number the interrupt output is wired to
+//      address: I2C address, 0x20 .. 0x27
+//      bus: I2C bus number
+//
+int setup_expander_ctrl(int interrupt, int address, int bus);
+
+//
+//  Keys of input devices
+//  A key code is bound like a button on every input device. The press is
+//  decided when the key comes up and sent right away from the main loop.
+//
+#define max_keys 32
+
+struct key_ctrl
+{
+    int code;
+    int long_time;
+};
+
+struct input_ctrl
+{
+    struct input_device * device;   // set when the table is activated
+    char * path;
+    bool grab;
+};
+
+//
+//  Setup input device
 //  Parameters:
-//      server: the server to send commands to
+//      path: event device, e.g. /dev/input/event0
+//      grab: get the device exclusively
 //
-void handle_buttons(struct sbpd_server * server);
+int setup_input_ctrl(const char * path, bool grab);
 
 //
-//  Store command parameters for each button used
+//  Setup key control
+//  Adds the key to the control table being built, or binds a key
+//  already added to another layer
+//  Parameters:
+//      player, layer, cmd, cmd_long, long_time: as for setup_button_ctrl
+//      code: key code, see input_key_code()
+//
+int setup_key_ctrl(struct sbpd_player * player, int layer, char * cmd, int code, char * cmd_long, int long_time);
+
+//
+//  Polling function: handle button commands
+//  Commands go to the server of each button's player
+//
+void handle_buttons();
+
+//
+//  Store GPIO parameters for each encoder used
+//  Part of the control table, consumed steps are kept per pin in control.c
 //
 struct encoder_ctrl
 {
-    struct encoder * gpio_encoder;
-    volatile long last_value;
-    char * fragment;
-	int limit;
-	volatile long long last_time;
-	int min_time;
+    struct encoder * gpio_encoder;  // set when the table is activated
+    int pin1;
+    int pin2;
+    int edge;
 };
+
+//
+//  Command parameters of an encoder in one layer
+//
+struct encoder_binding
+{
+    struct sbpd_player * player;
+    struct encoder_action * action; // NULL: steps are dropped in this layer
+    struct action_stats * stats;
+};
+
 //
 //  Setup encoder control
+//  Adds the encoder to the control table being built, or binds an encoder
+//  already added to another layer
 //  Parameters:
-//      cmd: Command. Currently only
-//                  VOLU    - volume
-//          Can be NULL for volume or actually anything since it's ignored
+//      player: the player to control
+//      layer: 0 for the base layer, 1 .. max_layers - 1
+//      cmd: Name of an encoder action from the command configuration,
+//           VOLU and TRAC are builtin. Required, NULL is rejected
 //      pin1: the GPIO-Pin-Number for the first pin used
 //      pin2: the GPIO-Pin-Number for the second pin used
 //      edge: one of
@@ -103,27 +235,66 @@ struct encoder_ctrl
 //                  2 - rising edge
 //                  0, 3 - both
 //
-int setup_encoder_ctrl(char * cmd, int pin1, int pin2, int edge);
+int setup_encoder_ctrl(struct sbpd_player * player, int layer, char * cmd, int pin1, int pin2, int edge);
 
 //
 //  Polling function: handle encoders
-//  Parameters:
-//      server: the server to send commands to
+//  Commands go to the server of each encoder's player
 //
-void handle_encoders(struct sbpd_server * server);
+void handle_encoders();
 
 
 //
 // Set of commands to send to LMS server
+// Names of any length, kept in a hash table that grows as needed.
+// Elements get the fragment pointer when they are set up, sending a
+// command needs no lookup.
 //
 #define MAXLEN 255
-#define MAX_COMMANDS 80
+
+//
+//  Encoder action
+//  Defined as <NAME>=ENCODER:<limit>,<interval>,<sign>,<template>
+//  The template is split at its %d delta slot when it is added, sending
+//  only copies the parts around the formatted delta.
+//
+enum {
+    SIGN_EXPLICIT,      // "+": +3, -3
+    SIGN_NEGATIVE       // "-": 3, -3
+};
+struct encoder_action {
+    char * prefix;      // template before the delta
+    size_t prefix_len;
+    char * suffix;      // template after the delta
+    size_t suffix_len;
+    char * buffer;      // prefix, delta and suffix are put together here
+    int limit;          // maximum steps per command
+    int min_time;       // ms between commands
+    int sign;
+};
+
 struct lms_command {
-  int code;
-  char fragment[MAXLEN];
+  char * name;          // NULL: free slot
+  char * fragment;      // NULL for encoder actions
+  struct encoder_action * action;    // NULL for plain commands
 };
 
-int add_lms_command_frament ( char * name, char * value );
+int add_lms_command_frament ( const char * name, const char * value );
+
+//
+//  Control table
+//  Commands, buttons and encoders are set up in a new table which replaces
+//  the active one in one step. Elements whose pins and pin settings didn't
+//  change keep their GPIO registration and state.
+//
+//  begin_controls: start a new table, call before the commands and elements
+//                  are added. Returns 0 on success
+//  commit_controls: activate the new table and set up the GPIO changes
+//  abort_controls: drop the new table, the active one stays
+//
+int begin_controls();
+void commit_controls();
+void abort_controls();
 
 
 #endif /* control_h */
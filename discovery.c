@@ -38,6 +38,11 @@
 
 #include "discovery.h"
 #include "sbpd.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "stats.h"
+#include "tlv.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -49,136 +54,829 @@
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+
+//
+//  Define TCP states here to not have to include kernel header
+//
+enum {
+    TCP_ESTABLISHED = 1,
+    TCP_SYN_SENT,
+    TCP_SYN_RECV,
+    TCP_FIN_WAIT1,
+    TCP_FIN_WAIT2,
+    TCP_TIME_WAIT,
+    TCP_CLOSE,
+    TCP_CLOSE_WAIT,
+    TCP_LAST_ACK,
+    TCP_LISTEN,
+    TCP_CLOSING,    // Now a valid state
+    
+    TCP_MAX_STATES  // Leave at the end!
+};
+//
+//  Connections to port 3483 found in a scan
+//
+#define MAX_SERVER_SOCKETS 16
+struct server_socket {
+    struct in6_addr addr;
+    uint32_t        inode;
+};
 
 
 //
 // Prototypes
 //
-void update_server(sbpd_config_parameters_t * discovered,
-                   struct sbpd_server * server);
-void update_port();
-void _write_server_string(struct sbpd_server * server, in_addr_t s_addr);
-bool get_serverIPv4(uint32_t *ip);
-void send_discovery(uint32_t address);
-uint32_t read_discovery(uint32_t address);
+struct server_socket;
+struct server_record;
+struct player_record;
+static int get_sockets(struct server_socket * sockets);
+static int diag_server(int family, struct server_socket * sockets, int * count);
+static bool proc_server(const char * path, struct server_socket * sockets, int * count);
+static bool select_player_socket(struct player_record * record,
+                                 struct server_socket * sockets, int count,
+                                 struct in6_addr * ip);
+static void start_discovery(struct server_record * server, int max_tries);
+static void stop_discovery(struct server_record * server);
+static void retransmit_discovery();
 
 static bool get_mac(uint8_t mac[]);
 
 
-#define IP_SEARCH_TIMEOUT 3 // every 3 s
+//
+//  Scan scheduling
+//  Scans start fast after a connection loss or a failed command and back off
+//  to IP_SEARCH_TIMEOUT while no player connection exists, or to
+//  SCAN_HEALTHY_TIMEOUT while the connections are stable.
+//  Connection teardown notifications from the kernel trigger a scan, too.
+//
+#define IP_SEARCH_TIMEOUT       (3 * SCD_SECOND)
+#define SCAN_FAST_TIMEOUT       (SCD_SECOND / 2)
+#define SCAN_HEALTHY_TIMEOUT    (300 * SCD_SECOND)
 
 //
-//  Polling function for server discovery
-//  Call from main loop
-//  Handles internal scheduling between different
+// search scheduling
+//
+static uint64_t nextScan = 0;
+static uint64_t scanInterval = SCAN_FAST_TIMEOUT;
+static bool serverConnected = false;
+static void watch_connections();
+
+# define SIZE_SERVER_DISCOVERY_LONG 23
+# define SBS_UDP_PORT 3483
+
+//
+// get port through server discovery
+//
+// Discovery is a small state machine per server driven by the main loop:
+// the request is unicast to the server and retransmitted with exponential
+// backoff. If the server doesn't answer after DISCOVERY_UNICAST_TRIES
+// requests, IPv4 also falls back to broadcast. Replies are only accepted
+// from the server we are looking for, other servers on the network
+// answering the broadcast are ignored.
+//
+#define DISCOVERY_RTO_US            (250 * 1000)
+#define DISCOVERY_RTO_MAX_US        (4 * SCD_SECOND)
+#define DISCOVERY_UNICAST_TRIES     4
+
+enum discovery_state {
+    DISCOVERY_IDLE,
+    DISCOVERY_UNICAST,
+    DISCOVERY_BROADCAST
+};
+
+//
+//  Servers
+//  Players connected to the same server share one record: its address,
+//  the control port found by discovery, the sbpd_server commands go to
+//  and the server's health.
+//  Records no player uses anymore are kept as failover candidates, a player
+//  moving to a known server can be followed without waiting for discovery.
+//  IPv4 servers are kept as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d)
+//
+#define STATE_UUID_SIZE 37
+#define MAX_SERVERS             (2 * max_players)
+#define SERVER_MAX_FAILURES     3   // failed commands in a row until unhealthy
+struct server_record {
+    bool                    known;      // false: free record
+    int                     users;      // players using the server, 0: candidate
+    struct in6_addr         addr;       // unspecified for a configured host name
+    char                    host[256];
+    char                    uuid[STATE_UUID_SIZE];
+    struct sbpd_server      server;
+    // health
+    int                     failures;   // failed commands in a row
+    uint64_t                last_success;
+    uint64_t                last_used;  // least recently used candidate is replaced first
+    // port discovery
+    enum discovery_state    state;
+    int                     socket;
+    int                     tries;
+    int                     max_tries;  // 0: until answered
+    uint64_t                rto;
+    uint64_t                next_send;
+};
+static struct server_record servers[MAX_SERVERS];
+
+//
+//  Players
+//  The connection of every player is looked up in the same scan
+//
+struct player_record {
+    struct sbpd_player *    player;
+    struct server_record *  server;
+    pid_t                   pid;        // player process given as PID
+    uint32_t                cachedInodes[MAX_SERVER_SOCKETS];
+    int                     cachedCount;
+    uint32_t                inode;      // socket owned by the player process
+};
+static struct player_record playerRecords[max_players];
+static int numberofplayers = 0;
+
+//
+//  Command line configuration
+//
+static sbpd_config_parameters_t discoveryConfig;
+static struct sbpd_server * serverConfig;
+
+//
+//  Warm start state file
+//
+static const char * statePath = NULL;
+
+//
+//  Helpers for the dual stack address handling
+//
+static void map_ipv4(struct in6_addr * addr, uint32_t s_addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->s6_addr32[2] = htonl(0xffff);
+    addr->s6_addr32[3] = s_addr;
+}
+
+static bool parse_address(const char * host, struct in6_addr * addr) {
+    struct in_addr addr4;
+    if (inet_pton(AF_INET, host, &addr4) == 1) {
+        map_ipv4(addr, addr4.s_addr);
+        return true;
+    }
+    return inet_pton(AF_INET6, host, addr) == 1;
+}
+
+static const char * format_address(const struct in6_addr * addr,
+                                   char * buffer, socklen_t size) {
+    if (IN6_IS_ADDR_V4MAPPED(addr))
+        return inet_ntop(AF_INET, &addr->s6_addr32[3], buffer, size);
+    return inet_ntop(AF_INET6, addr, buffer, size);
+}
+
+static const char * player_name(const struct player_record * record) {
+    return record->player->name ? record->player->name : "default";
+}
+
+//
+//  Find the record of a server
+//
+static struct server_record * server_record_of(const struct sbpd_server * server) {
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if (servers[i].known && (&servers[i].server == server))
+            return servers + i;
+    }
+    return NULL;
+}
+
+//
+//  Set up a new server record
+//  A free record is used if there is one, otherwise the least recently
+//  used candidate is replaced.
+//  Host names can only be configured, addr is NULL for them.
+//
+static struct server_record * new_server(const struct in6_addr * addr, const char * host) {
+    struct server_record * slot = NULL;
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        struct server_record * server = servers + i;
+        if (!server->known) {
+            slot = server;
+            break;
+        }
+        if (!server->users && (!slot || (server->last_used < slot->last_used)))
+            slot = server;
+    }
+    if (!slot) {
+        logerr("Too many servers");
+        return NULL;
+    }
+    if (slot->known) {
+        loginfo("Forgetting server %s", slot->host);
+        stop_discovery(slot);
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    slot->known = true;
+    slot->socket = -1;
+    slot->last_used = us_timer();
+    if (addr) {
+        slot->addr = *addr;
+        format_address(addr, slot->host, sizeof(slot->host));
+    } else {
+        strncpy(slot->host, host, sizeof(slot->host) - 1);
+    }
+    slot->server = *serverConfig;   // credentials
+    slot->server.host = slot->host;
+    slot->server.port = (discoveryConfig & SBPD_cfg_port) ? serverConfig->port : 0;
+    return slot;
+}
+
 //
+//  Get a server record for an address
+//  Players already using the server share its record (and port), a known
+//  server is used as it is. Otherwise a new record is set up and its port
+//  discovery started.
+//  Until discovery answers the port of the server the player used before
+//  is tried, servers on one network mostly use the same port.
+//
+static struct server_record * acquire_server(const struct in6_addr * addr, const char * host,
+                                             uint32_t portHint) {
+    for (int i = 0; addr && (i < MAX_SERVERS); i++) {
+        struct server_record * server = servers + i;
+        if (server->known && IN6_ARE_ADDR_EQUAL(addr, &server->addr)) {
+            if (!server->users)
+                loginfo("Known server %s, port %u", server->host, server->server.port);
+            server->users++;
+            server->last_used = us_timer();
+            return server;
+        }
+    }
+    struct server_record * server = new_server(addr, host);
+    if (!server)
+        return NULL;
+    server->users = 1;
+    loginfo("Server address found: %s", server->host);
+    trace(TRACE_DISCOVERY, 0, server->addr.s6_addr32[3]);
+    PROBE2(discovery, server->host, server->server.port);
+    if (!server->server.port && addr) {
+        server->server.port = portHint;
+        if (portHint)
+            loginfo("Trying port %u until discovery answers", portHint);
+        start_discovery(server, 0);
+    }
+    return server;
+}
+
+static void release_server(struct server_record * server) {
+    if (!server || --server->users)
+        return;
+    loginfo("Server %s no longer used, keeping it as candidate", server->host);
+    server->last_used = us_timer();
+    stop_discovery(server);
+}
 
 //
-// counter for search scheduling
+//  Point a player to a server
 //
-static uint32_t search_timer = 0;
+static void assign_server(struct player_record * record, const struct in6_addr * addr) {
+    struct server_record * previous = record->server;
+    record->server = acquire_server(addr, NULL, previous ? previous->server.port : 0);
+    release_server(previous);
+    record->player->server = record->server ? &record->server->server : NULL;
+}
+
 //
-//  Helper variable; don't want to convert back and forth between string and net-addr
+//  Add a failover candidate server
+//  Parameters:
+//  address: IPv4 or IPv6 address, optionally followed by ",port".
+//           Without a port it is found by discovery
 //
-static in_addr_t foundAddr = 0;
+int add_candidate_server(const char * address) {
+    char host[INET6_ADDRSTRLEN];
+    strncpy(host, address, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    char * port = strchr(host, ',');
+    if (port)
+        *port++ = 0;
+    struct in6_addr addr;
+    if (!parse_address(host, &addr)) {
+        logerr("Candidate server %s is not an address", address);
+        return -1;
+    }
+    struct server_record * server = new_server(&addr, NULL);
+    if (!server)
+        return -1;
+    if (port)
+        server->server.port = (uint32_t)strtoul(port, NULL, 10);
+    if (!server->server.port)
+        start_discovery(server, DISCOVERY_UNICAST_TRIES);
+    loginfo("Candidate server %s, port %u", server->host, server->server.port);
+    return 0;
+}
+
 //
+//  Setup discovery for the players
 //  Parameters:
 //  config: defines which parameters are preconfigured and will not be discovered
-//  discovered: the discovered parameters
-//  server: server configuration
+//  server: configured server parameters, host and port only if configured
+//  players, count: the players controlled
 //
-void poll_discovery(sbpd_config_parameters_t config,
-                    sbpd_config_parameters_t *discovered,
-                    struct sbpd_server * server) {
-    //logdebug("Polling server discovery");
+void init_discovery(sbpd_config_parameters_t config,
+                    struct sbpd_server * server,
+                    struct sbpd_player * players, int count) {
+    discoveryConfig = config;
+    serverConfig = server;
+    numberofplayers = MIN(count, max_players);
+    for (int i = 0; i < numberofplayers; i++) {
+        struct player_record * record = playerRecords + i;
+        memset(record, 0, sizeof(*record));
+        record->player = players + i;
+        record->cachedCount = -1;
+        if (players[i].process) {
+            char * end;
+            long pid = strtol(players[i].process, &end, 10);
+            if (!*end && (pid > 0))
+                record->pid = (pid_t)pid;
+        }
+    }
+
     //
-    // search for server
+    //  Configured server: all players use it
     //
-    if (!(config & SBPD_cfg_host)) {
-        if (!search_timer--) {
-            search_timer = IP_SEARCH_TIMEOUT * SCD_SECOND / SCD_SLEEP_TIMEOUT;
-            in_addr_t addr = 0;
-            if (server->host)
-                addr = inet_addr(server->host);
-            bool change = get_serverIPv4(&addr);
-            logdebug("New or changed server address %s", (change) ? "found" : "not found");
-            if (change) {
-                //
-                // found server but not port
-                //
-                *discovered |= SBPD_cfg_host;
-                *discovered &= ~SBPD_cfg_port;
-                foundAddr = addr;
-                
-                // we don't update server struct, yet, if we also look for the port.
-                if (config & SBPD_cfg_port)
-                    _write_server_string(server, addr);
-                // otherwise: look for port
-                else
-                    send_discovery(addr);
-            }
+    if (config & SBPD_cfg_host) {
+        struct in6_addr addr;
+        bool numeric = parse_address(server->host, &addr);
+        struct server_record * configured = acquire_server(numeric ? &addr : NULL, server->host, 0);
+        if (!configured)
+            return;
+        configured->users = numberofplayers;
+        for (int i = 0; i < numberofplayers; i++) {
+            playerRecords[i].server = configured;
+            players[i].server = &configured->server;
         }
     }
+}
+
+//
+//  Scan for the player connections and update their servers
+//
+static void scan_servers() {
+    uint64_t now = us_timer();
+    metric_inc(M_DISCOVERY_RESCANS);
+    struct server_socket sockets[MAX_SERVER_SOCKETS];
+    int count = get_sockets(sockets);
+
+    bool connected = false;
+    bool change = false;
+    for (int i = 0; i < numberofplayers; i++) {
+        struct player_record * record = playerRecords + i;
+        struct in6_addr addr;
+        if (!select_player_socket(record, sockets, count, &addr))
+            continue;
+        connected = true;
+        char addrString[INET6_ADDRSTRLEN];
+        format_address(&addr, addrString, sizeof(addrString));
+        if (record->server && IN6_ARE_ADDR_EQUAL(&addr, &record->server->addr)) {
+            logdebug("Player %s: found server %s. Same as before", player_name(record), addrString);
+            continue;
+        }
+        loginfo("Player %s: found server %s. A new address", player_name(record), addrString);
+        assign_server(record, &addr);
+        change = true;
+    }
+    logdebug("New or changed server address %s", (change) ? "found" : "not found");
+
+    //
+    //  Schedule next scan
+    //
+    if (change || (serverConnected && !connected))
+        scanInterval = SCAN_FAST_TIMEOUT;
+    else
+        scanInterval = MIN(scanInterval * 2,
+                           connected ? SCAN_HEALTHY_TIMEOUT : IP_SEARCH_TIMEOUT);
+    serverConnected = connected;
+    nextScan = now + scanInterval;
+    logdebug("Next server scan in %llu ms", (unsigned long long)(scanInterval / 1000));
+    if (change)
+        save_state();
+}
+
+//
+//  Polling function for server discovery
+//  Call from main loop
+//  Handles internal scheduling between server scans and port discovery
+//
+void poll_discovery() {
+    //logdebug("Polling server discovery");
+    //
+    // search for servers
+    //
+    if (!(discoveryConfig & SBPD_cfg_host)) {
+        watch_connections();
+        if (us_timer() >= nextScan)
+            scan_servers();
+    }
     //
-    // only search if configured to do so and port is not yet found
+    // look for ports
     //
-    if (!(config & SBPD_cfg_port) &&
-        !(*discovered & SBPD_cfg_port)) {
-        logdebug("Looking for port");
-        uint32_t foundPort = read_discovery(foundAddr);
-        if (foundPort) {
-            loginfo("Squeezebox control port found: %d", foundPort);
-            if (!(config & SBPD_cfg_host))
-                _write_server_string(server, foundAddr);
-            server->port = foundPort;
-            *discovered |= SBPD_cfg_port;
+    retransmit_discovery();
+}
+
+//
+//  Server health
+//  A failed command may mean the server restarted with another port,
+//  so the port is confirmed by discovery again.
+//
+void report_server(struct sbpd_server * server, bool success) {
+    struct server_record * record = server_record_of(server);
+    if (!record)
+        return;
+    if (success) {
+        if (record->failures >= SERVER_MAX_FAILURES)
+            loginfo("Server %s is healthy again", record->host);
+        record->failures = 0;
+        record->last_success = us_timer();
+        return;
+    }
+    if (++record->failures == SERVER_MAX_FAILURES)
+        logwarn("Server %s unhealthy: %d commands failed in a row", record->host, record->failures);
+    if (!(discoveryConfig & SBPD_cfg_port) &&
+        !IN6_IS_ADDR_UNSPECIFIED(&record->addr) &&
+        (record->state == DISCOVERY_IDLE))
+        start_discovery(record, DISCOVERY_UNICAST_TRIES);
+}
+
+//
+//  Failover after a failed command
+//  Scans for the player's connection right away. If the player moved to
+//  another server that is healthy and has a port, that server is returned.
+//
+struct sbpd_server * failover_server(struct sbpd_player * player) {
+    if (discoveryConfig & SBPD_cfg_host)
+        return NULL;
+    struct sbpd_server * failed = player->server;
+    trigger_discovery("command failed");
+    scan_servers();
+    struct server_record * record = server_record_of(player->server);
+    if (!record || (player->server == failed) || !record->server.port ||
+        (record->failures >= SERVER_MAX_FAILURES))
+        return NULL;
+    return player->server;
+}
+
+//
+//  Find the player a state file key belongs to: "<player>.KEY" or "KEY"
+//
+static struct player_record * state_player(char ** key) {
+    char * dot = strrchr(*key, '.');
+    if (!dot)
+        return numberofplayers ? playerRecords : NULL;
+    *dot = 0;
+    for (int i = 1; i < numberofplayers; i++) {
+        if (!strcmp(playerRecords[i].player->name, *key)) {
+            *key = dot + 1;
+            return playerRecords + i;
         }
+    }
+    return NULL;
+}
 
+//
+//  Load the warm start state file
+//  Everything not configured is used right away and checked in the background:
+//  the first server scan runs immediately and ports are confirmed by a
+//  discovery request.
+//
+sbpd_config_parameters_t load_state(const char * path, char ** mac) {
+    static char stateMac[18];
+    struct {
+        bool            found;
+        struct in6_addr addr;
+        uint32_t        port;
+        char            uuid[STATE_UUID_SIZE];
+    } restore[max_players];
+    memset(restore, 0, sizeof(restore));
+    sbpd_config_parameters_t restored = 0;
+    statePath = path;
+    FILE * file = fopen(path, "r");
+    if (!file) {
+        loginfo("No state file %s, starting cold", path);
+        return 0;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        char * value = strchr(line, '=');
+        if (!value)
+            continue;
+        *value++ = 0;
+        char * name = trim(line);
+        value = trim(value);
+        struct player_record * record = state_player(&name);
+        if (!record)
+            continue;
+        int index = (int)(record - playerRecords);
+        if (!strcmp(name, "MAC") && !index && (strlen(value) == sizeof(stateMac) - 1)) {
+            strcpy(stateMac, value);
+            restored |= SBPD_cfg_MAC;
+        } else if (!strcmp(name, "SERVER")) {
+            restore[index].found = parse_address(value, &restore[index].addr);
+        } else if (!strcmp(name, "PORT")) {
+            restore[index].port = (uint32_t)strtoul(value, NULL, 10);
+        } else if (!strcmp(name, "UUID")) {
+            strncpy(restore[index].uuid, value, STATE_UUID_SIZE - 1);
+        }
     }
+    fclose(file);
+
+    restored &= ~discoveryConfig;
+    if (restored & SBPD_cfg_MAC)
+        *mac = stateMac;
+    if (!(discoveryConfig & SBPD_cfg_host)) {
+        for (int i = 0; i < numberofplayers; i++) {
+            if (!restore[i].found)
+                continue;
+            restored |= SBPD_cfg_host;
+            assign_server(playerRecords + i, &restore[i].addr);
+            struct server_record * server = playerRecords[i].server;
+            if (!server)
+                continue;
+            if (restore[i].uuid[0])
+                strcpy(server->uuid, restore[i].uuid);
+            if (!(discoveryConfig & SBPD_cfg_port) &&
+                restore[i].port && (restore[i].port <= UINT16_MAX)) {
+                restored |= SBPD_cfg_port;
+                server->server.port = restore[i].port;
+                start_discovery(server, DISCOVERY_UNICAST_TRIES);
+            }
+        }
+    }
+    loginfo("State file %s: restored%s%s%s", path,
+            (restored & SBPD_cfg_MAC) ? " MAC" : "",
+            (restored & SBPD_cfg_host) ? " server" : "",
+            (restored & SBPD_cfg_port) ? " port" : "");
+    return restored;
 }
 
 //
-//  Helper function to convert server address to string
+//  Write the state file
+//  Written to a temporary file and renamed, a crash never leaves half a file
 //
-void _write_server_string(struct sbpd_server * server, in_addr_t s_addr) {
-    struct in_addr addr;
-    addr.s_addr = s_addr;
-    static char foundServer[16]; // only one server, so we can do this statically
-    
-    char * aAddr = inet_ntoa(addr);
-    loginfo("Server address found: %s", aAddr);
-    strncpy(foundServer, aAddr, 16);
-    server->host = foundServer;
+void save_state() {
+    if (!statePath)
+        return;
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", statePath);
+    FILE * file = fopen(tmpPath, "w");
+    if (!file) {
+        logwarn("Can't write state file %s: %s", tmpPath, strerror(errno));
+        return;
+    }
+    for (int i = 0; i < numberofplayers; i++) {
+        struct player_record * record = playerRecords + i;
+        const char * prefix = i ? record->player->name : "";
+        const char * dot = i ? "." : "";
+        if (!i && record->player->mac)
+            fprintf(file, "MAC=%s\n", record->player->mac);
+        struct server_record * server = record->server;
+        if (!server || IN6_IS_ADDR_UNSPECIFIED(&server->addr))
+            continue;
+        fprintf(file, "%s%sSERVER=%s\n", prefix, dot, server->host);
+        if (server->server.port)
+            fprintf(file, "%s%sPORT=%u\n", prefix, dot, server->server.port);
+        if (server->uuid[0])
+            fprintf(file, "%s%sUUID=%s\n", prefix, dot, server->uuid);
+    }
+    if ((fclose(file) != 0) || (rename(tmpPath, statePath) != 0)) {
+        logwarn("Can't write state file %s: %s", statePath, strerror(errno));
+        unlink(tmpPath);
+        return;
+    }
+    logdebug("State file %s written", statePath);
+}
+
+
+//
+//
+// Get the connections to port 3483
+// IPv4 connections come first, then IPv6.
+// Asks the kernel through NETLINK_SOCK_DIAG, falls back to /proc/net/tcp
+// and /proc/net/tcp6 if that isn't available
+//
+// returns the number of connections found
+//
+//
+static int get_sockets(struct server_socket * sockets) {
+    int count = 0;
+    if ((diag_server(AF_INET, sockets, &count) < 0) ||
+        (diag_server(AF_INET6, sockets, &count) < 0)) {
+        count = 0;
+        proc_server("/proc/net/tcp", sockets, &count);
+        proc_server("/proc/net/tcp6", sockets, &count);
+    }
+    return count;
 }
 
 //
-//  Define TCP states here to not have to include kernel header
+//  sock_diag netlink socket, opened on first use
 //
-enum {
-    TCP_ESTABLISHED = 1,
-    TCP_SYN_SENT,
-    TCP_SYN_RECV,
-    TCP_FIN_WAIT1,
-    TCP_FIN_WAIT2,
-    TCP_TIME_WAIT,
-    TCP_CLOSE,
-    TCP_CLOSE_WAIT,
-    TCP_LAST_ACK,
-    TCP_LISTEN,
-    TCP_CLOSING,    // Now a valid state
-    
-    TCP_MAX_STATES  // Leave at the end!
+static int diagSocket = -1;
+static bool diagUnavailable = false;
+
+//
+//  Filter bytecode: destination port >= SBS_PORT and <= SBS_PORT
+//  Every condition is an op followed by an op carrying the port in "no".
+//  "yes" continues with the next condition, "no" jumps past the end
+//  which rejects the socket.
+//
+#define SBS_PORT 3483
+struct diag_port_filter {
+    struct inet_diag_bc_op ge;
+    struct inet_diag_bc_op ge_port;
+    struct inet_diag_bc_op le;
+    struct inet_diag_bc_op le_port;
 };
+
+//
+//
+// Get server IP through NETLINK_SOCK_DIAG
+// The kernel only returns ESTABLISHED sockets with destination port 3483,
+// nothing else on the box needs to be looked at
+//
+// Parameters:
+//  family: AF_INET or AF_INET6
+//  sockets, count: sockets found are appended, IPv4 gets mapped
+//
+// returns 0, -1 if sock_diag is not available
+//
+//
+static int diag_server(int family, struct server_socket * sockets, int * count) {
+    if (diagUnavailable)
+        return -1;
+    if (diagSocket < 0) {
+        diagSocket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+        if (diagSocket < 0) {
+            loginfo("sock_diag not available, using /proc/net/tcp");
+            diagUnavailable = true;
+            return -1;
+        }
+    }
+
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+        struct nlattr bytecode;
+        struct diag_port_filter filter;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.req.sdiag_family = family;
+    request.req.sdiag_protocol = IPPROTO_TCP;
+    request.req.idiag_states = 1 << TCP_ESTABLISHED;
+    request.bytecode.nla_type = INET_DIAG_REQ_BYTECODE;
+    request.bytecode.nla_len = NLA_HDRLEN + sizeof(request.filter);
+    unsigned short length = sizeof(request.filter);
+    request.filter.ge = (struct inet_diag_bc_op){ INET_DIAG_BC_D_GE, 8, length + 4 };
+    request.filter.ge_port = (struct inet_diag_bc_op){ 0, 0, SBS_PORT };
+    request.filter.le = (struct inet_diag_bc_op){ INET_DIAG_BC_D_LE, 8, length - 8 + 4 };
+    request.filter.le_port = (struct inet_diag_bc_op){ 0, 0, SBS_PORT };
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(diagSocket, &request, sizeof(request), 0,
+               (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        loginfo("sock_diag request failed (%s), using /proc/net/tcp", strerror(errno));
+        close(diagSocket);
+        diagSocket = -1;
+        diagUnavailable = true;
+        return -1;
+    }
+
+    //
+    //  Read the reply. Sockets beyond MAX_SERVER_SOCKETS are drained.
+    //
+    long buffer[8192 / sizeof(long)];
+    bool done = false;
+    while (!done) {
+        ssize_t size = recv(diagSocket, buffer, sizeof(buffer), 0);
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            logwarn("sock_diag receive failed: %s", strerror(errno));
+            return -1;
+        }
+        struct nlmsghdr * nlh = (struct nlmsghdr *)buffer;
+        for (; NLMSG_OK(nlh, size); nlh = NLMSG_NEXT(nlh, size)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                done = true;
+                break;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr * err = NLMSG_DATA(nlh);
+                loginfo("sock_diag error %d, using /proc/net/tcp", err->error);
+                close(diagSocket);
+                diagSocket = -1;
+                diagUnavailable = true;
+                return -1;
+            }
+            if ((*count >= MAX_SERVER_SOCKETS) || (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY))
+                continue;
+            struct inet_diag_msg * msg = NLMSG_DATA(nlh);
+            struct server_socket * found = sockets + (*count)++;
+            if (msg->idiag_family == AF_INET)
+                map_ipv4(&found->addr, msg->id.idiag_dst[0]);
+            else
+                memcpy(&found->addr, msg->id.idiag_dst, sizeof(found->addr));
+            found->inode = msg->idiag_inode;
+        }
+    }
+    return 0;
+}
+
+
+//
+//  Scan for the server connection on the next poll
+//
+void trigger_discovery(const char * reason) {
+    loginfo("Server scan triggered: %s", reason);
+    scanInterval = SCAN_FAST_TIMEOUT;
+    nextScan = 0;
+}
+
+//
+//  Kernel notifications for closed TCP sockets
+//  sock_diag multicasts every destroyed TCP socket to these groups,
+//  a closed connection to port 3483 means the player lost its server.
+//  Needs CAP_NET_ADMIN and a 4.10 kernel, without it we just scan.
+//
+static int watchSocket = -1;
+static bool watchUnavailable = false;
+
+static void connection_closed(int fd, void * context) {
+    long buffer[8192 / sizeof(long)];
+    ssize_t size;
+    while ((size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+        struct nlmsghdr * nlh = (struct nlmsghdr *)buffer;
+        for (; NLMSG_OK(nlh, size); nlh = NLMSG_NEXT(nlh, size)) {
+            if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+                continue;
+            struct inet_diag_msg * msg = NLMSG_DATA(nlh);
+            if (msg->id.idiag_dport == htons(SBS_PORT))
+                trigger_discovery("player connection closed");
+        }
+    }
+    if ((size < 0) && (errno == ENOBUFS))
+        trigger_discovery("missed connection notifications");
+}
+
+static void watch_connections() {
+    if ((watchSocket >= 0) || watchUnavailable)
+        return;
+    watchUnavailable = true;
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (fd < 0)
+        return;
+    struct sockaddr_nl local;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    int groups[] = { SKNLGRP_INET_TCP_DESTROY, SKNLGRP_INET6_TCP_DESTROY };
+    for (int i = 0; i < (int)(sizeof(groups) / sizeof(groups[0])); i++) {
+        if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+                       &groups[i], sizeof(groups[i])) != 0) {
+            loginfo("No connection notifications (%s), scanning only", strerror(errno));
+            close(fd);
+            return;
+        }
+    }
+    if ((bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0) ||
+        (register_poll_fd(fd, connection_closed, NULL) != 0)) {
+        close(fd);
+        return;
+    }
+    watchSocket = fd;
+    watchUnavailable = false;
+    loginfo("Watching for closed player connections");
+}
+
+
+//
 //
+// Get server IP from /proc/net/tcp or /proc/net/tcp6
+// Addresses are printed as 32 bit words in host order,
+// one word for tcp, four for tcp6
 //
-// Get server IP from /proc/net/tcp
+// Parameters:
+//  path: /proc/net/tcp or /proc/net/tcp6
+//  sockets, count: sockets found are appended, IPv4 gets mapped
 //
-// returns true if server IP was found and changed
+// returns true if a server IP was found
 //
 //
-bool get_serverIPv4(uint32_t *ip) {
-    uint32_t foundIp;
-    FILE * procTcp = fopen("/proc/net/tcp", "r");
+static bool proc_server(const char * path, struct server_socket * sockets, int * count) {
+    FILE * procTcp = fopen(path, "r");
     if (!procTcp)
         return false;
     char line[256];
@@ -186,13 +884,15 @@ bool get_serverIPv4(uint32_t *ip) {
         fclose(procTcp);
         return false;
     }
-    bool found = false;
     while (fgets(line, 255, procTcp)) {
-        logdebug("/proc/net/tcp line: %s", line);
+        logdebug("%s line: %s", path, line);
         strtok(line, " "); // line number
         strtok(NULL, " "); // source address
         char * target = strtok(NULL, " "); // target address
         char * socketState = strtok(NULL, " "); // socket state
+        char * inodeString = NULL;
+        for (int field = 0; field < 6; field++) // queues, timers, uid, timeout, inode
+            inodeString = strtok(NULL, " ");
         logdebug("target: %s\n", target);
         if (!target) {
             logwarn("no tcp target found");
@@ -201,162 +901,347 @@ bool get_serverIPv4(uint32_t *ip) {
         }
         char * ipString = strtok(target, ":");
         char * portString = strtok(NULL, ":");
-        if (!ipString || !portString || !socketState) {
+        if (!ipString || !portString || !socketState || !inodeString) {
             if (!ipString)
                 logwarn("no ipString found");
             if (!portString)
                 logwarn("no portString found");
             if (!socketState)
                 logwarn("no socketState found");
+            if (!inodeString)
+                logwarn("no inode found");
             fclose(procTcp);
             return false;
         }
-        char * portComp = "0D9B";
         //
-        // just be sure the port is upper case
+        //  port 3483 and socket state == TCP_ESTABLISHED?
         //
-        char * sTemp = portString;
-        while ((*sTemp = toupper(*sTemp)))
-            sTemp++;
-        //
-        //  state
-        //
-        unsigned long uSocketState = strtol(socketState, NULL, 16);
-        //
-        // port 3483 and socket state == TCP_ESTABLISHED?
-        //
-        if ((*((uint32_t *)portComp) == *((uint32_t *)portString)) &&
-            (uSocketState == TCP_ESTABLISHED)) {
-            foundIp = (uint32_t)strtoul(ipString, NULL, 16);
-            if (foundIp != *ip) {
-                if (!found) // only change once. The rest is for logging only
-                    *ip = foundIp;
-                loginfo("Found server %s. A new address", ipString);
-                // no logging: we're done
-                if (loglevel() < LOG_NOTICE) {
-                    fclose(procTcp);
-                    return true;
+        if ((strtoul(portString, NULL, 16) != SBS_PORT) ||
+            (strtoul(socketState, NULL, 16) != TCP_ESTABLISHED))
+            continue;
+        size_t words = strlen(ipString) / 8;
+        if ((words != 1) && (words != 4)) {
+            logwarn("unexpected address %s", ipString);
+            continue;
+        }
+        uint32_t foundIp[4];
+        for (size_t i = 0; i < words; i++) {
+            char word[9];
+            memcpy(word, ipString + i * 8, 8);
+            word[8] = 0;
+            foundIp[i] = (uint32_t)strtoul(word, NULL, 16);
+        }
+        if (*count >= MAX_SERVER_SOCKETS)
+            break;
+        struct server_socket * found = sockets + (*count)++;
+        if (words == 1)
+            map_ipv4(&found->addr, foundIp[0]);
+        else
+            memcpy(&found->addr, foundIp, sizeof(found->addr));
+        found->inode = (uint32_t)strtoul(inodeString, NULL, 10);
+    }
+    fclose(procTcp);
+    return *count > 0;
+}
+
+
+//
+//  Player process
+//  With more than one player on the box the connection to use is the one
+//  owned by the player process, matched by socket inode in /proc/<pid>/fd.
+//  Walking /proc is expensive so the result is kept until the set of
+//  connections to port 3483 changes.
+//
+static bool is_player(struct player_record * record, pid_t pid) {
+    if (record->pid)
+        return pid == record->pid;
+    char path[64];
+    char comm[32];
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+    FILE * file = fopen(path, "r");
+    if (!file)
+        return false;
+    bool match = fgets(comm, sizeof(comm), file) &&
+                 !strcmp(trim(comm), record->player->process);
+    fclose(file);
+    return match;
+}
+
+//
+//  Find the socket owned by the player process
+//  returns its inode, 0 if none
+//
+static uint32_t find_player_inode(struct player_record * record,
+                                  struct server_socket * sockets, int count) {
+    DIR * proc = opendir("/proc");
+    if (!proc)
+        return 0;
+    uint32_t inode = 0;
+    struct dirent * process;
+    while (!inode && (process = readdir(proc))) {
+        char * end;
+        long pid = strtol(process->d_name, &end, 10);
+        if (*end || (pid <= 0) || !is_player(record, (pid_t)pid))
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%ld/fd", pid);
+        DIR * fds = opendir(path);
+        if (!fds)
+            continue;
+        struct dirent * fd;
+        while (!inode && (fd = readdir(fds))) {
+            char target[64];
+            ssize_t length = readlinkat(dirfd(fds), fd->d_name, target, sizeof(target) - 1);
+            if (length <= 0)
+                continue;
+            target[length] = 0;
+            unsigned int socketInode;
+            if (sscanf(target, "socket:[%u]", &socketInode) != 1)
+                continue;
+            for (int i = 0; i < count; i++) {
+                if (sockets[i].inode == socketInode) {
+                    logdebug("Player process %ld owns socket %u", pid, socketInode);
+                    inode = socketInode;
+                    break;
                 }
-                found = true;
-            }
-            logdebug("Found server %s. Same as before");
-            // no logging? we're done
-            if (loglevel() < LOG_NOTICE) {
-                fclose(procTcp);
-                return false;
             }
         }
+        closedir(fds);
     }
-    fclose(procTcp);
-    return found;
+    closedir(proc);
+    return inode;
 }
 
-static int udpSocket = 0;
-static uint32_t udpAddress;
-# define SIZE_SERVER_DISCOVERY_LONG 23
-# define SBS_UDP_PORT 3483
+static int compare_inodes(const void * a, const void * b) {
+    uint32_t inodeA = *(const uint32_t *)a;
+    uint32_t inodeB = *(const uint32_t *)b;
+    return (inodeA > inodeB) - (inodeA < inodeB);
+}
 
 //
-// get port through server discovery
+//  Pick the player's connection
+//  Without a configured player process the first connection is used
+//
+static bool select_player_socket(struct player_record * record,
+                                 struct server_socket * sockets, int count,
+                                 struct in6_addr * ip) {
+    if (!count)
+        return false;
+    if (!record->player->process) {
+        *ip = sockets[0].addr;
+        return true;
+    }
+
+    uint32_t inodes[MAX_SERVER_SOCKETS];
+    for (int i = 0; i < count; i++)
+        inodes[i] = sockets[i].inode;
+    qsort(inodes, count, sizeof(inodes[0]), compare_inodes);
+    if ((count != record->cachedCount) ||
+        memcmp(inodes, record->cachedInodes, count * sizeof(inodes[0]))) {
+        memcpy(record->cachedInodes, inodes, count * sizeof(inodes[0]));
+        record->cachedCount = count;
+        record->inode = find_player_inode(record, sockets, count);
+        if (!record->inode)
+            loginfo("None of %d server connections belongs to player %s",
+                    count, player_name(record));
+    }
+    for (int i = 0; i < count; i++) {
+        if (record->inode && (sockets[i].inode == record->inode)) {
+            *ip = sockets[i].addr;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void discovery_readable(int fd, void * context);
+
 //
+// stop port discovery
+//
+static void stop_discovery(struct server_record * server) {
+    if (server->socket >= 0) {
+        unregister_poll_fd(server->socket);
+        close(server->socket);
+    }
+    server->socket = -1;
+    server->state = DISCOVERY_IDLE;
+}
 
 //
-// send server discovery
+// send one discovery request
 //
-void send_discovery(uint32_t address) {
-    if (udpSocket)
-        close(udpSocket);
-    // create discovery socket
-    udpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    
+static void send_discovery_packet(struct server_record * server,
+                                  const struct sockaddr * target, socklen_t targetSize) {
+    static const char data[] = "eIPAD\0NAME\0JSON\0UUID\0\0\0";
+    if (sendto(server->socket, data, SIZE_SERVER_DISCOVERY_LONG, 0, target, targetSize) < 0)
+        loginfo("Error sending discovery packet: %s", strerror(errno));
+}
+
+//
+// send (or resend) the discovery request for the current state
+// and schedule the next retransmit
+//
+static void transmit_discovery(struct server_record * server) {
+    struct sockaddr_storage target;
+    socklen_t targetSize;
+    memset(&target, 0, sizeof(target));
+    if (IN6_IS_ADDR_V4MAPPED(&server->addr)) {
+        struct sockaddr_in * addr4 = (struct sockaddr_in *)&target;
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(SBS_UDP_PORT);
+        addr4->sin_addr.s_addr = server->addr.s6_addr32[3];
+        targetSize = sizeof(*addr4);
+    } else {
+        struct sockaddr_in6 * addr6 = (struct sockaddr_in6 *)&target;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(SBS_UDP_PORT);
+        addr6->sin6_addr = server->addr;
+        targetSize = sizeof(*addr6);
+    }
+    send_discovery_packet(server, (struct sockaddr *)&target, targetSize);
+    if (server->state == DISCOVERY_BROADCAST) {
+        ((struct sockaddr_in *)&target)->sin_addr.s_addr = htonl(INADDR_BROADCAST);
+        send_discovery_packet(server, (struct sockaddr *)&target, targetSize);
+    }
+
+    server->tries++;
+    logdebug("Server discovery %s: request %d sent, next in %llu ms", server->host,
+             server->tries, (unsigned long long)(server->rto / 1000));
+    server->next_send = us_timer() + server->rto;
+    server->rto = MIN(server->rto * 2, DISCOVERY_RTO_MAX_US);
+    if ((server->state == DISCOVERY_UNICAST) &&
+        (server->tries >= DISCOVERY_UNICAST_TRIES) &&
+        IN6_IS_ADDR_V4MAPPED(&server->addr)) {
+        loginfo("Server discovery %s: no reply, adding broadcast", server->host);
+        server->state = DISCOVERY_BROADCAST;
+    }
+}
+
+//
+// start port discovery for a server
+// The first request goes out on the next poll
+//
+// Parameters:
+//  server: the server
+//  max_tries: give up after this many requests, 0 to retry until answered
+//
+static void start_discovery(struct server_record * server, int max_tries) {
+    stop_discovery(server);
+
+    int family = IN6_IS_ADDR_V4MAPPED(&server->addr) ? AF_INET : AF_INET6;
+    server->socket = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (server->socket < 0) {
+        logwarn("Can't create discovery socket: %s", strerror(errno));
+        return;
+    }
     int yes = 1;
-    setsockopt(udpSocket, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(int));
-    setsockopt(udpSocket, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
-    
-    // send packet
-    udpAddress = address;
-    struct sockaddr_in addr4;
-    memset(&addr4, 0, sizeof(addr4));
-    addr4.sin_family = AF_INET;
-    addr4.sin_port = htons(SBS_UDP_PORT);
-    addr4.sin_addr.s_addr = address;
-    
-    char * data = "eIPAD\0NAME\0JSON\0UUID\0\0\0";
-    
-    size_t error;
-    error = sendto(udpSocket, data, SIZE_SERVER_DISCOVERY_LONG, 0, (struct sockaddr*)&addr4, sizeof(addr4));
-    if (error == -1)
-        loginfo("Error sending discovery packet");
+    if (family == AF_INET)
+        setsockopt(server->socket, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(int));
+    setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
+    if (register_poll_fd(server->socket, discovery_readable, server) != 0) {
+        close(server->socket);
+        server->socket = -1;
+        return;
+    }
+
+    server->state = DISCOVERY_UNICAST;
+    server->tries = 0;
+    server->max_tries = max_tries;
+    server->rto = DISCOVERY_RTO_US;
+    server->next_send = 0;
+}
+
+//
+// send requests that are due
+// called from poll_discovery
+//
+static void retransmit_discovery() {
+    uint64_t now = us_timer();
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        struct server_record * server = servers + i;
+        if ((server->state == DISCOVERY_IDLE) || (now < server->next_send))
+            continue;
+        if (server->max_tries && (server->tries >= server->max_tries)) {
+            loginfo("Server discovery %s: no reply, keeping port %u",
+                    server->host, server->server.port);
+            stop_discovery(server);
+            continue;
+        }
+        transmit_discovery(server);
+    }
 }
 
+//
+// port found: update server configuration
+//
+static void found_port(struct server_record * server, const struct discovery_reply * reply) {
+    uint32_t foundPort = reply->port;
+    loginfo("Squeezebox control port found: %s:%d", server->host, foundPort);
+    if (reply->uuid[0]) {
+        if (server->uuid[0] && strcmp(server->uuid, reply->uuid))
+            loginfo("Server %s replaced server %s", reply->uuid, server->uuid);
+        // same size, the reply's UUID is always terminated
+        memcpy(server->uuid, reply->uuid, sizeof(server->uuid));
+    }
+    trace(TRACE_DISCOVERY, 1, foundPort);
+    PROBE2(discovery, server->host, foundPort);
+    server->server.port = foundPort;
+    save_state();
+}
 
 #define BUFSIZE 1600
 //
-// poll udp port for discovery reply
+// discovery socket readable: read all pending replies
+// Only replies from the target server's discovery port count
 //
-uint32_t read_discovery(uint32_t address) {
+static void discovery_readable(int fd, void * context) {
+    struct server_record * server = context;
     char buffer[BUFSIZE];
-    static struct sockaddr_in returnAddr;
-    memset(&returnAddr, 0, sizeof(returnAddr));
-    returnAddr.sin_family = AF_INET;
-    //returnAddr.sin_port = htons(SBS_UDP_PORT);
-    returnAddr.sin_addr.s_addr = address;
-    //returnAddr.sin_len = sizeof(returnAddr);
-    socklen_t addrSize = sizeof(returnAddr);
-    
-    ssize_t size = recvfrom(udpSocket,
-                            (void *)buffer,
-                            sizeof(buffer),
-                            MSG_DONTWAIT,
-                            (struct sockaddr *)&returnAddr,
-                            &addrSize);
-    
-    if ((size <= 0) ||
-        (buffer[0] != 'E')) {
-        logdebug("Server discovery: no reply, yet");
-        return 0;
-    }
-    
-    logdebug("Server discovery: packet found");
-    unsigned int pos = 1;
-//    char code[5];
-//    code[4] = 0;
-    // this is the whole packet interpretation for debug purposes
-    // not needed in final code
-    char port[6];
-    strncpy(port, "9000\0", 6);
-    if (loglevel() >= LOG_NOTICE) {
-        char name[256];
-        memset(name, 0, sizeof(name));
-        char UUID[256];
-        memset(UUID, 0, sizeof(UUID));
-        while (pos < (size - 5)) {
-            unsigned int fieldLen = buffer[pos + 4];
-            uint32_t * selector = (uint32_t *)(buffer + pos);
-            if (*selector == STRTOU32("NAME")) {
-                strncpy(name, buffer + pos + 5, MIN(fieldLen, sizeof(name)));
-            } else if (*selector == STRTOU32("JSON")) {
-                strncpy(port, buffer + pos + 5, MIN(fieldLen, sizeof(port)));
-            } else if (*selector == STRTOU32("UUID")) {
-                strncpy(UUID, buffer + pos + 5, MIN(fieldLen, sizeof(UUID)));
-            }
-            pos += fieldLen + 5;
+    while (server->state != DISCOVERY_IDLE) {
+        struct sockaddr_storage returnAddr;
+        socklen_t addrSize = sizeof(returnAddr);
+        ssize_t size = recvfrom(fd,
+                                (void *)buffer,
+                                sizeof(buffer),
+                                MSG_DONTWAIT,
+                                (struct sockaddr *)&returnAddr,
+                                &addrSize);
+        if (size < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                logwarn("Server discovery: receive failed: %s", strerror(errno));
+            return;
         }
-        loginfo("discovery packet: port: %s, name: %s, uuid: %s", port, name, UUID);
-    } else {
-        while (pos < (size - 5)) {
-            unsigned int fieldLen = buffer[pos + 4];
-            uint32_t * selector = (uint32_t *)(buffer + pos);
-            if (*selector == STRTOU32("JSON")) {
-                strncpy(port, buffer + pos + 5, MIN(fieldLen, sizeof(port)));
-            }
-            pos += fieldLen + 5;
+
+        struct in6_addr source;
+        uint16_t sourcePort;
+        if (returnAddr.ss_family == AF_INET) {
+            struct sockaddr_in * addr4 = (struct sockaddr_in *)&returnAddr;
+            map_ipv4(&source, addr4->sin_addr.s_addr);
+            sourcePort = ntohs(addr4->sin_port);
+        } else {
+            struct sockaddr_in6 * addr6 = (struct sockaddr_in6 *)&returnAddr;
+            source = addr6->sin6_addr;
+            sourcePort = ntohs(addr6->sin6_port);
+        }
+        if (!IN6_ARE_ADDR_EQUAL(&source, &server->addr) ||
+            (sourcePort != SBS_UDP_PORT)) {
+            char addrString[INET6_ADDRSTRLEN];
+            format_address(&source, addrString, sizeof(addrString));
+            logdebug("Server discovery: ignoring reply from %s:%u", addrString, sourcePort);
+            continue;
         }
-        loginfo("discovery packet: port: %s", port);
+
+        struct discovery_reply reply;
+        if (!parse_discovery_reply(buffer, size, &reply)) {
+            logdebug("Server discovery: malformed reply of %zd bytes", size);
+            continue;
+        }
+        loginfo("discovery packet: port: %u, name: %s, uuid: %s",
+                reply.port, reply.name, reply.uuid);
+        stop_discovery(server);
+        found_port(server, &reply);
     }
-    close(udpSocket);
-    
-    return (uint32_t)strtoul(port, NULL, 10);
 }
 
 
@@ -446,3 +1331,4 @@ static bool get_mac(uint8_t mac[]) {
 
 
 
+
@@ -37,19 +37,92 @@
 
 #include "sbpd.h"
 
+//
+//  Setup discovery for the players
+//
+//  Parameters:
+//  config: defines which parameters are preconfigured and will not be discovered
+//  server: server configuration, host and port only if configured.
+//          Credentials are used for every server found
+//  players, count: the players controlled. Their server is set by discovery,
+//                  NULL until found
+//
+void init_discovery(sbpd_config_parameters_t config,
+                    struct sbpd_server * server,
+                    struct sbpd_player * players, int count);
+
+
 //
 //  Polling function for server discovery
 //  Call from main loop
-//  Handles internal scheduling between different
+//  Handles internal scheduling between server scans and port discovery
+//
+void poll_discovery();
+
+
+//
+//  Scan for the server connection on the next poll
+//  Call when the server stopped answering
 //
 //  Parameters:
-//  config: defines which parameters are preconfigured and will not be discovered
-//  discovered: the discovered parameters
-//  server: server configuration
+//  reason: for logging
+//
+void trigger_discovery(const char * reason);
+
+
+//
+//  Add a failover candidate server
+//  Call after init_discovery
+//
+//  Parameters:
+//  address: IPv4 or IPv6 address, optionally followed by ",port".
+//           Without a port it is found by discovery
+//  returns: 0 on success
+//
+int add_candidate_server(const char * address);
+
+
+//
+//  Server health tracking
+//  Call with the result of every command sent
+//
+//  Parameters:
+//  server: the server the command was sent to
+//  success: command result
+//
+void report_server(struct sbpd_server * server, bool success);
+
+
+//
+//  Failover after a failed command
+//  Looks for the player's server connection right away
+//
+//  Parameters:
+//  player: the player the command was for
+//  returns: the healthy server the player moved to, NULL if it didn't move
+//
+struct sbpd_server * failover_server(struct sbpd_player * player);
+
+
+//
+//  Warm start state file
+//  Restores the last known MAC, server address, port and server UUID
+//  Restored values are used at once and revalidated by discovery,
+//  the file is rewritten when discovery finds something new.
+//  Keys of named players are prefixed with "<player>."
+//  Call after init_discovery
+//
+//  Parameters:
+//  path: state file
+//  mac: set to the MAC address of the default player if restored
+//  returns: the restored parameters
+//
+sbpd_config_parameters_t load_state(const char * path, char ** mac);
+
+//
+//  Write the state file, e.g. after the MAC address changed
 //
-void poll_discovery(sbpd_config_parameters_t config,
-                    sbpd_config_parameters_t *discovered,
-                    struct sbpd_server * server);
+void save_state();
 
 
 //
@@ -0,0 +1,270 @@
+//
+//  evdev.c
+//  SqueezeButtonPi
+//
+//  Input devices
+//  Event devices are read in the main loop, events come in batches of
+//  struct input_event. Only key changes are passed on, the mapping to
+//  commands is done by the control table.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "evdev.h"
+#include "sbpd.h"
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define INPUT_BATCH     64      // events per read
+#define INPUT_RETRY_MS  5000    // open attempts for missing devices
+
+static struct input_device devices[max_input_devices];
+
+//
+//  Key names
+//  The keys found on remotes, media keys and keyboards used as such
+//
+#define KEY_NAME(key) { #key, KEY_##key }
+static const struct {
+    const char * name;
+    int code;
+} key_names[] = {
+    KEY_NAME(PLAYPAUSE), KEY_NAME(PLAY), KEY_NAME(PAUSE), KEY_NAME(PLAYCD),
+    KEY_NAME(PAUSECD), KEY_NAME(STOP), KEY_NAME(STOPCD), KEY_NAME(NEXTSONG),
+    KEY_NAME(PREVIOUSSONG), KEY_NAME(NEXT), KEY_NAME(PREVIOUS), KEY_NAME(FASTFORWARD),
+    KEY_NAME(REWIND), KEY_NAME(FORWARD), KEY_NAME(BACK), KEY_NAME(RECORD),
+    KEY_NAME(SHUFFLE), KEY_NAME(MEDIA_REPEAT), KEY_NAME(VOLUMEUP), KEY_NAME(VOLUMEDOWN),
+    KEY_NAME(MUTE), KEY_NAME(POWER), KEY_NAME(SLEEP), KEY_NAME(WAKEUP),
+    KEY_NAME(CHANNELUP), KEY_NAME(CHANNELDOWN), KEY_NAME(UP), KEY_NAME(DOWN),
+    KEY_NAME(LEFT), KEY_NAME(RIGHT), KEY_NAME(OK), KEY_NAME(SELECT),
+    KEY_NAME(ENTER), KEY_NAME(SPACE), KEY_NAME(ESC), KEY_NAME(EXIT),
+    KEY_NAME(MENU), KEY_NAME(HOME), KEY_NAME(INFO), KEY_NAME(FAVORITES),
+    KEY_NAME(RADIO), KEY_NAME(AUDIO), KEY_NAME(RED), KEY_NAME(GREEN),
+    KEY_NAME(YELLOW), KEY_NAME(BLUE), KEY_NAME(0), KEY_NAME(1),
+    KEY_NAME(2), KEY_NAME(3), KEY_NAME(4), KEY_NAME(5),
+    KEY_NAME(6), KEY_NAME(7), KEY_NAME(8), KEY_NAME(9),
+    KEY_NAME(NUMERIC_0), KEY_NAME(NUMERIC_1), KEY_NAME(NUMERIC_2), KEY_NAME(NUMERIC_3),
+    KEY_NAME(NUMERIC_4), KEY_NAME(NUMERIC_5), KEY_NAME(NUMERIC_6), KEY_NAME(NUMERIC_7),
+    KEY_NAME(NUMERIC_8), KEY_NAME(NUMERIC_9), KEY_NAME(F1), KEY_NAME(F2),
+    KEY_NAME(F3), KEY_NAME(F4), KEY_NAME(F5), KEY_NAME(F6),
+    KEY_NAME(F7), KEY_NAME(F8), KEY_NAME(F9), KEY_NAME(F10),
+    KEY_NAME(F11), KEY_NAME(F12),
+};
+
+//
+//
+//  Key code by name
+//
+//
+int input_key_code(const char * name) {
+    char * end;
+    long code = strtol(name, &end, 0);
+    if ((end != name) && !*end)
+        return ((code > 0) && (code < KEY_CNT)) ? (int)code : -1;
+    if (!strncmp(name, "KEY_", 4))
+        name += 4;
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+        if (!strcasecmp(name, key_names[i].name))
+            return key_names[i].code;
+    }
+    return -1;
+}
+
+static bool key_down(const uint8_t * keys, int code) {
+    return (keys[code / 8] >> (code % 8)) & 1;
+}
+
+//
+//  Pass a key change on, keys already in that state are ignored
+//
+static void report_key(struct input_device * device, int code, bool down, uint64_t time_us) {
+    if ((code >= KEY_CNT) || (key_down(device->keys, code) == down))
+        return;
+    device->keys[code / 8] ^= 1 << (code % 8);
+    device->callback(device, code, down, time_us);
+}
+
+//
+//  After the kernel dropped events take the key states from the device
+//
+static void resync_keys(struct input_device * device, uint64_t time_us) {
+    uint8_t keys[sizeof(device->keys)];
+    device->dropped = false;
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(device->fd, EVIOCGKEY(sizeof(keys)), keys) < 0)
+        return;
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (key_down(keys, code) != key_down(device->keys, code))
+            report_key(device, code, key_down(keys, code), time_us);
+    }
+}
+
+static void close_input(struct input_device * device);
+
+//
+//  Main loop callback: read all pending events
+//  Autorepeat is dropped, key states are resynced after a SYN_DROPPED
+//
+static void read_input(int fd, void * context) {
+    struct input_device * device = context;
+    struct input_event events[INPUT_BATCH];
+    ssize_t size;
+    while ((size = read(fd, events, sizeof(events))) > 0) {
+        int count = size / sizeof(*events);
+        metric_add(M_INPUT_EVENTS, count);
+        for (struct input_event * event = events; event < events + count; event++) {
+            uint64_t time_us = device->monotonic ?
+                (uint64_t)event->input_event_sec * 1000000 + event->input_event_usec : us_timer();
+            if (event->type == EV_SYN) {
+                if (event->code == SYN_DROPPED)
+                    device->dropped = true;
+                else if ((event->code == SYN_REPORT) && device->dropped)
+                    resync_keys(device, time_us);
+                continue;
+            }
+            if (device->dropped || (event->type != EV_KEY) || (event->value == 2))
+                continue;
+            report_key(device, event->code, event->value != 0, time_us);
+        }
+        if (count < INPUT_BATCH)
+            return;
+    }
+    if ((size < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+        return;
+    //
+    //  Unplugged, keys held now never come up
+    //
+    logwarn("Input device %s gone: %s", device->path, size ? strerror(errno) : "end of file");
+    close_input(device);
+    memset(device->keys, 0, sizeof(device->keys));
+    device->retry_ms = ms_timer() + INPUT_RETRY_MS;
+}
+
+//
+//  Open a device and add it to the main loop
+//  Keys down already are taken as they are, they don't cause presses
+//
+static void open_input(struct input_device * device) {
+    int fd = open(device->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        if (!device->retry_ms)
+            logwarn("Input device %s not available: %s, retrying", device->path, strerror(errno));
+        device->retry_ms = ms_timer() + INPUT_RETRY_MS;
+        return;
+    }
+    // event times in the us_timer() time base
+    int clock = CLOCK_MONOTONIC;
+    device->monotonic = (ioctl(fd, EVIOCSCLOCKID, &clock) == 0);
+    if (device->grab && (ioctl(fd, EVIOCGRAB, 1) != 0))
+        logwarn("Could not grab input device %s: %s", device->path, strerror(errno));
+    char name[64] = "unknown";
+    ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+    name[sizeof(name) - 1] = 0;
+    memset(device->keys, 0, sizeof(device->keys));
+    ioctl(fd, EVIOCGKEY(sizeof(device->keys)), device->keys);
+    if (register_poll_fd(fd, read_input, device) != 0) {
+        logerr("No main loop slot for input device %s", device->path);
+        close(fd);
+        device->retry_ms = ms_timer() + INPUT_RETRY_MS;
+        return;
+    }
+    device->fd = fd;
+    device->dropped = false;
+    device->retry_ms = 0;
+    loginfo("Input device %s: %s%s", device->path, name, device->grab ? ", grabbed" : "");
+}
+
+//
+//  Closing the device also ends a grab
+//
+static void close_input(struct input_device * device) {
+    if (device->fd < 0)
+        return;
+    unregister_poll_fd(device->fd);
+    close(device->fd);
+    device->fd = -1;
+}
+
+//
+//
+//  Configuration function to add an input device
+//
+//
+struct input_device * setup_input_device(const char * path, bool grab,
+                                         input_key_callback_t callback) {
+    struct input_device * device = devices;
+    while ((device < devices + max_input_devices) && device->active)
+        device++;
+    if (device == devices + max_input_devices) {
+        logerr("Maximum number of input devices exceded: %i", max_input_devices);
+        return NULL;
+    }
+    device->path = strdup(path);
+    if (!device->path)
+        return NULL;
+    device->grab = grab;
+    device->callback = callback;
+    device->fd = -1;
+    device->retry_ms = 0;
+    device->active = true;
+    open_input(device);
+    return device;
+}
+
+//
+//
+//  Release an input device
+//
+//
+void release_input_device(struct input_device * device) {
+    close_input(device);
+    free(device->path);
+    device->path = NULL;
+    device->active = false;
+}
+
+//
+//
+//  Polling function: open missing input devices again
+//
+//
+void poll_input_devices() {
+    long long now = ms_timer();
+    for (struct input_device * device = devices; device < devices + max_input_devices; device++) {
+        if (device->active && (device->fd < 0) && (now >= device->retry_ms))
+            open_input(device);
+    }
+}
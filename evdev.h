@@ -0,0 +1,112 @@
+//
+//  evdev.h
+//  SqueezeButtonPi
+//
+//  Input devices
+//  Keys of IR receivers, USB media keys and keyboards read from
+//  /dev/input/event* in the main loop.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#ifndef evdev_h
+#define evdev_h
+
+#include "sbpd.h"
+
+#include <linux/input.h>
+
+#define max_input_devices 4
+
+struct input_device;
+
+//
+//  A callback executed on the main loop when a key goes down or up.
+//  Autorepeat is not reported. Time of the event in the us_timer() time base.
+//
+typedef void (*input_key_callback_t)(const struct input_device * device, int code,
+                                     bool down, uint64_t time_us);
+
+struct input_device {
+    bool active;                // false: slot unused
+    char * path;
+    bool grab;
+    int fd;                     // -1 while the device is missing
+    long long retry_ms;         // next open attempt while missing, ms_timer()
+    bool dropped;               // events lost, resync at the next report
+    bool monotonic;             // event times are CLOCK_MONOTONIC
+    uint8_t keys[(KEY_CNT + 7) / 8];    // keys down
+    input_key_callback_t callback;
+};
+
+//
+//
+//  Configuration function to add an input device
+//  The device is read in the main loop. A device that is missing or goes
+//  away is opened again by poll_input_devices()
+//
+//  Parameters:
+//      path: event device, e.g. /dev/input/event0 or a /dev/input/by-id link
+//      grab: get the device exclusively, its keys don't reach the console
+//            or other programs
+//      callback: called for every key that goes down or up
+//  Returns: pointer to the new device structure
+//           The pointer will be NULL is the function failed for any reason
+//
+//
+struct input_device * setup_input_device(const char * path, bool grab,
+                                         input_key_callback_t callback);
+
+//
+//
+//  Release an input device, e.g. when a reload removed it
+//
+//
+void release_input_device(struct input_device * device);
+
+//
+//
+//  Polling function: open missing input devices again
+//
+//
+void poll_input_devices();
+
+//
+//
+//  Key code by name
+//  Parameters:
+//      name: KEY_ name from linux/input-event-codes.h, with or without
+//            the KEY_ prefix, or a key code number
+//  Returns: the key code, -1 if unknown
+//
+//
+int input_key_code(const char * name);
+
+#endif /* evdev_h */
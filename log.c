@@ -0,0 +1,474 @@
+//
+//  log.c
+//  SqueezeButtonPi
+//
+//  Logging facility
+//
+//  Log calls only copy the format pointer, the arguments and a timestamp
+//  into a lock free ring owned by the calling thread. A background thread
+//  formats the records and does the I/O. Messages with more arguments or
+//  string bytes than a record holds are formatted synchronously.
+//  Until the logger thread is started (argument parsing, daemonizing)
+//  messages are formatted and written synchronously.
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "sbpd.h"
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+//
+//  Log levels
+//
+static int streamloglevel = LOG_NOTICE;
+static int sysloglevel = LOG_ALERT;
+//
+//  Most verbose level any output takes, checked before calling _mylog()
+//
+int log_threshold = LOG_NOTICE;
+
+//
+//  Log record
+//  String arguments are copied, everything else is stored by value
+//
+#define LOG_MAX_ARGS    8
+#define LOG_STRINGS     160
+#define LOG_LINE        512
+
+union log_arg {
+    long long i;
+    double d;
+    const void * p;
+    size_t s;           // offset of a copied string
+};
+
+struct log_record {
+    uint64_t time_us;
+    const char * file;
+    const char * fmt;
+    int line;
+    int prio;
+    union log_arg args[LOG_MAX_ARGS];
+    char strings[LOG_STRINGS];
+};
+
+//
+//  Single producer single consumer ring, one per logging thread
+//
+#define LOG_RING_SIZE   256     // power of two
+#define LOG_MAX_RINGS   16
+
+struct log_ring {
+    uint32_t head;              // written by the owning thread
+    uint32_t tail;              // written by the logger thread
+    uint32_t dropped;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+static struct log_ring * rings[LOG_MAX_RINGS];
+static uint32_t numberofrings = 0;
+static __thread struct log_ring * thread_ring = NULL;
+
+static pthread_t logger_thread;
+static volatile bool logger_running = false;
+static volatile bool logger_stop = false;
+
+#define LOG_IDLE_SLEEP  20000   // µs
+
+static uint64_t realtime_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+//  Conversion specifications
+//  Walks one "%..." specification starting after the '%'.
+//  Returns the conversion character and sets the length modifier, the
+//  number of '*' width/precision arguments and where the length modifier
+//  starts.
+//
+enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T, LEN_LD };
+
+static char parse_spec(const char ** pos, int * length, int * stars, const char ** modifier) {
+    const char * p = *pos;
+    *length = LEN_NONE;
+    *stars = 0;
+    while (*p && strchr("-+ #0", *p))
+        p++;
+    while (*p && (isdigit((unsigned char)*p) || (*p == '*') || (*p == '.'))) {
+        if (*p == '*')
+            (*stars)++;
+        p++;
+    }
+    *modifier = p;
+    if (*p == 'h') {
+        *length = (p[1] == 'h') ? LEN_HH : LEN_H;
+        p += (p[1] == 'h') ? 2 : 1;
+    } else if (*p == 'l') {
+        *length = (p[1] == 'l') ? LEN_LL : LEN_L;
+        p += (p[1] == 'l') ? 2 : 1;
+    } else if (*p == 'z') {
+        *length = LEN_Z; p++;
+    } else if (*p == 'j') {
+        *length = LEN_J; p++;
+    } else if (*p == 't') {
+        *length = LEN_T; p++;
+    } else if (*p == 'L') {
+        *length = LEN_LD; p++;
+    }
+    char conversion = *p;
+    *pos = *p ? p + 1 : p;
+    return conversion;
+}
+
+static bool is_integer(char conversion) {
+    return conversion && strchr("diuxXo", conversion);
+}
+
+static bool is_float(char conversion) {
+    return conversion && strchr("eEfFgGaA", conversion);
+}
+
+//
+//  Copy arguments into a record
+//  Returns false if they don't fit: more arguments than LOG_MAX_ARGS or
+//  more string bytes than LOG_STRINGS. The caller formats the message
+//  synchronously then.
+//
+static bool capture(struct log_record * record, va_list a_list) {
+    const char * p = record->fmt;
+    const char * modifier;
+    size_t strings = 0;
+    int arg = 0;
+    while ((p = strchr(p, '%'))) {
+        p++;
+        int length, stars;
+        char conversion = parse_spec(&p, &length, &stars, &modifier);
+        bool has_arg = is_integer(conversion) || is_float(conversion) ||
+                       ((conversion != 0) && strchr("csp", conversion));
+        if (arg + stars + has_arg > LOG_MAX_ARGS)
+            return false;
+        for (; stars; stars--)
+            record->args[arg++].i = va_arg(a_list, int);
+        if (is_integer(conversion) || (conversion == 'c')) {
+            // keep the signedness of the conversion when widening
+            bool is_signed = (conversion == 'd') || (conversion == 'i');
+            long long value;
+            switch (length) {
+                case LEN_HH: value = is_signed ? (signed char)va_arg(a_list, int) :
+                                                 (unsigned char)va_arg(a_list, int); break;
+                case LEN_H:  value = is_signed ? (short)va_arg(a_list, int) :
+                                                 (unsigned short)va_arg(a_list, int); break;
+                case LEN_L:  value = is_signed ? va_arg(a_list, long) :
+                                                 (long long)va_arg(a_list, unsigned long); break;
+                case LEN_LL: value = va_arg(a_list, long long); break;
+                case LEN_Z:  value = (long long)va_arg(a_list, size_t); break;
+                case LEN_J:  value = (long long)va_arg(a_list, intmax_t); break;
+                case LEN_T:  value = va_arg(a_list, ptrdiff_t); break;
+                default:     value = is_signed ? va_arg(a_list, int) :
+                                                 (long long)va_arg(a_list, unsigned int); break;
+            }
+            record->args[arg++].i = value;
+        } else if (is_float(conversion)) {
+            if (length == LEN_LD)
+                record->args[arg++].d = (double)va_arg(a_list, long double);
+            else
+                record->args[arg++].d = va_arg(a_list, double);
+        } else if (conversion == 's') {
+            const char * string = va_arg(a_list, const char *);
+            if (!string)
+                string = "(null)";
+            size_t len = strnlen(string, LOG_STRINGS - strings);
+            if (strings + len >= LOG_STRINGS)
+                return false;
+            memcpy(record->strings + strings, string, len + 1);
+            record->args[arg++].s = strings;
+            strings += len + 1;
+        } else if (conversion == 'p') {
+            record->args[arg++].p = va_arg(a_list, void *);
+        }
+        // "%%" or unknown: no argument
+    }
+    return true;
+}
+
+//
+//  Format a record's message
+//  Every conversion is formatted on its own with the stored argument.
+//  Integers are stored as long long, so their length modifier is replaced.
+//
+static void format_record(const struct log_record * record, char * buffer, size_t size) {
+    const char * p = record->fmt;
+    const char * modifier;
+    size_t len = 0;
+    int arg = 0;
+    char spec[32];
+    while (*p && (len < size - 1)) {
+        if (*p != '%') {
+            buffer[len++] = *p++;
+            continue;
+        }
+        const char * start = p++;
+        int length, stars;
+        char conversion = parse_spec(&p, &length, &stars, &modifier);
+        if (conversion == '%') {
+            buffer[len++] = '%';
+            continue;
+        }
+        int star[2] = { 0, 0 };
+        for (int i = 0; (i < stars) && (arg < LOG_MAX_ARGS); i++)
+            star[MIN(i, 1)] = (int)record->args[arg++].i;
+        if ((arg >= LOG_MAX_ARGS) || !(is_integer(conversion) || is_float(conversion) ||
+                                       strchr("csp", conversion))) {
+            // out of arguments or unknown conversion: copy verbatim
+            size_t specLen = MIN((size_t)(p - start), size - 1 - len);
+            memcpy(buffer + len, start, specLen);
+            len += specLen;
+            continue;
+        }
+        size_t prefix = MIN((size_t)(modifier - start), sizeof(spec) - 4);
+        memcpy(spec, start, prefix);
+        snprintf(spec + prefix, sizeof(spec) - prefix, "%s%c",
+                 is_integer(conversion) ? "ll" : "", conversion);
+
+        const union log_arg * value = record->args + arg++;
+        size_t space = size - len;
+        int written = 0;
+#define LOG_FORMAT(v) ((stars == 0) ? snprintf(buffer + len, space, spec, v) : \
+                       (stars == 1) ? snprintf(buffer + len, space, spec, star[0], v) : \
+                                      snprintf(buffer + len, space, spec, star[0], star[1], v))
+        if (is_integer(conversion))
+            written = LOG_FORMAT(value->i);
+        else if (conversion == 'c')
+            written = LOG_FORMAT((int)value->i);
+        else if (is_float(conversion))
+            written = LOG_FORMAT(value->d);
+        else if (conversion == 's')
+            written = LOG_FORMAT(record->strings + value->s);
+        else
+            written = LOG_FORMAT(value->p);
+#undef LOG_FORMAT
+        if (written > 0)
+            len += MIN((size_t)written, space - 1);
+    }
+    buffer[len] = 0;
+}
+
+//
+//  Write a formatted message to stream and syslog
+//
+static void write_message(uint64_t time_us, const char * file, int line, int prio,
+                          const char * message) {
+    if (prio <= streamloglevel) {
+        // select stream due to priority
+        FILE *f = (prio < LOG_INFO) ? stderr : stdout;
+        if (file)
+            fprintf(f, "%.4f %d %s,%d: %s\n", time_us * 1E-6, prio, file, line, message);
+        else
+            fprintf(f, "%.4f %d: %s\n", time_us * 1E-6, prio, message);
+    }
+    //
+    //  use syslog facility, hide debugging messages from syslog
+    //
+    if (prio <= sysloglevel && prio < LOG_DEBUG)
+        syslog(prio, "%s", message);
+}
+
+//
+//  Ring of the calling thread, registered on first use
+//
+static struct log_ring * get_ring() {
+    if (thread_ring)
+        return thread_ring;
+    uint32_t index = __atomic_load_n(&numberofrings, __ATOMIC_ACQUIRE);
+    if (index >= LOG_MAX_RINGS)
+        return NULL;
+    struct log_ring * ring = calloc(1, sizeof(struct log_ring));
+    if (!ring)
+        return NULL;
+    index = __atomic_fetch_add(&numberofrings, 1, __ATOMIC_ACQ_REL);
+    if (index >= LOG_MAX_RINGS) {
+        free(ring);
+        return NULL;
+    }
+    __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+    thread_ring = ring;
+    return ring;
+}
+
+//
+//  Logging facility
+//
+void _mylog( const char *file, int line,  int prio, const char *fmt, ... )
+{
+    if ((prio > streamloglevel) && ((prio > sysloglevel) || (prio >= LOG_DEBUG)))
+        return;
+
+    va_list a_list;
+    va_start( a_list, fmt );
+
+    struct log_ring * ring = logger_running ? get_ring() : NULL;
+    bool queued = false;
+    if (ring) {
+        uint32_t head = ring->head;
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= LOG_RING_SIZE) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            queued = true;
+        } else {
+            struct log_record * record = ring->records + (head & (LOG_RING_SIZE - 1));
+            record->time_us = realtime_us();
+            record->file = file;
+            record->line = line;
+            record->prio = prio;
+            record->fmt = fmt;
+            va_list args;
+            va_copy(args, a_list);
+            queued = capture(record, args);
+            va_end(args);
+            if (queued)
+                __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (!queued) {
+        //
+        //  Synchronous: format once, use for stream and syslog
+        //  Also used for messages that don't fit a record, they may show up
+        //  ahead of records still queued
+        //
+        char message[LOG_LINE];
+        vsnprintf(message, sizeof(message), fmt, a_list);
+        write_message(realtime_us(), file, line, prio, message);
+        if (prio <= streamloglevel)
+            fflush((prio < LOG_INFO) ? stderr : stdout);
+    }
+    va_end ( a_list );
+}
+
+//
+//  Drain all rings, oldest record first
+//  Returns number of records written
+//
+static int drain() {
+    int written = 0;
+    char message[LOG_LINE];
+    uint32_t count = MIN(__atomic_load_n(&numberofrings, __ATOMIC_ACQUIRE), LOG_MAX_RINGS);
+    for (uint32_t i = 0; i < count; i++) {
+        struct log_ring * ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (ring && __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED))
+            write_message(realtime_us(), NULL, 0, LOG_WARNING, "Log ring full, messages dropped");
+    }
+    while (true) {
+        struct log_ring * oldest = NULL;
+        struct log_record * next = NULL;
+        // rings registered meanwhile may hold older records
+        count = MIN(__atomic_load_n(&numberofrings, __ATOMIC_ACQUIRE), LOG_MAX_RINGS);
+        for (uint32_t i = 0; i < count; i++) {
+            struct log_ring * ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+            if (!ring)
+                continue;
+            uint32_t tail = ring->tail;
+            if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+                continue;
+            struct log_record * record = ring->records + (tail & (LOG_RING_SIZE - 1));
+            if (!next || (record->time_us < next->time_us)) {
+                oldest = ring;
+                next = record;
+            }
+        }
+        if (!next)
+            break;
+        format_record(next, message, sizeof(message));
+        write_message(next->time_us, next->file, next->line, next->prio, message);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+    if (written) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+}
+
+//
+//  Logger thread
+//
+static void * logger(void * arg) {
+    while (!logger_stop) {
+        if (!drain())
+            usleep(LOG_IDLE_SLEEP);
+    }
+    drain();
+    return NULL;
+}
+
+//
+//  Flush and stop the logger thread at exit
+//
+static void stop_logger() {
+    if (!logger_running)
+        return;
+    logger_stop = true;
+    pthread_join(logger_thread, NULL);
+    logger_running = false;
+}
+
+//
+//  Start the logger thread
+//  Call after daemonizing, threads don't survive fork()
+//
+int start_logger() {
+    if (pthread_create(&logger_thread, NULL, logger, NULL) != 0) {
+        logwarn("Could not start logger thread, logging synchronously");
+        return -1;
+    }
+    logger_running = true;
+    atexit(stop_logger);
+    return 0;
+}
+
+void set_loglevel(int level) {
+    streamloglevel = level;
+    // syslog never gets debug messages
+    log_threshold = MAX(streamloglevel, MIN(sysloglevel, LOG_INFO));
+}
+
+int loglevel() {
+    return MAX(sysloglevel, streamloglevel);
+}
@@ -0,0 +1,296 @@
+//
+//  metrics.c
+//  SqueezeButtonPi
+//
+//  Daemon counters and Prometheus exposition endpoint
+//  The endpoint runs on a thread of its own and only reads counters,
+//  so scrapes never get in the way of input handling.
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "metrics.h"
+#include "GPIO.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+uint64_t metric_counters[M_COUNTERS];
+uint64_t metric_edges[max_pins];
+struct histogram metric_rtt = { .name = "Server round trip" };
+
+static pthread_t metrics_thread;
+
+#define METRICS_BUFSIZE (64 * 1024)
+#define METRICS_MAXSIZE (1024 * 1024)
+
+//
+//  Response buffer
+//  Grows up to METRICS_MAXSIZE, beyond that output is dropped in whole
+//  pieces so length never exceeds what the buffer holds
+//
+struct output {
+    char * buffer;
+    size_t length;
+    size_t size;
+    bool truncated;
+};
+
+static void out(struct output * output, const char * fmt, ...) {
+    while (!output->truncated) {
+        va_list a_list;
+        va_start(a_list, fmt);
+        int len = vsnprintf(output->buffer + output->length,
+                            output->size - output->length, fmt, a_list);
+        va_end(a_list);
+        if (len < 0)
+            return;
+        if ((size_t)len < output->size - output->length) {
+            output->length += len;
+            return;
+        }
+        size_t size = output->size * 2;
+        while (size - output->length <= (size_t)len)
+            size *= 2;
+        char * buffer = (size <= METRICS_MAXSIZE) ? realloc(output->buffer, size) : NULL;
+        if (!buffer) {
+            output->truncated = true;
+            return;
+        }
+        output->buffer = buffer;
+        output->size = size;
+    }
+}
+
+static void out_counter(struct output * output, const char * name, const char * help,
+                        const char * labels, int counter) {
+    if (help)
+        out(output, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    out(output, "%s%s %llu\n", name, labels,
+        (unsigned long long)__atomic_load_n(&metric_counters[counter], __ATOMIC_RELAXED));
+}
+
+//
+//  Histogram as Prometheus summary in seconds
+//
+static void out_summary(struct output * output, const char * name, const char * labels,
+                        const struct histogram * hist) {
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    static const char * quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+    uint64_t values[4];
+    hist_percentiles(hist, percentiles, 4, values);
+    const char * open = *labels ? "{" : "";
+    const char * close = *labels ? "}" : "";
+    for (int i = 0; i < 4; i++)
+        out(output, "%s{%s%squantile=\"%s\"} %.6f\n", name, labels, *labels ? "," : "",
+            quantiles[i], values[i] / 1e6);
+    out(output, "%s_sum%s%s%s %.6f\n", name, open, labels, close,
+        __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1e6);
+    out(output, "%s_count%s%s%s %llu\n", name, open, labels, close,
+        (unsigned long long)__atomic_load_n(&hist->total, __ATOMIC_RELAXED));
+}
+
+//
+//  Format all metrics
+//
+static void format_metrics(struct output * output) {
+    out(output, "# HELP sbpd_gpio_edges_total GPIO edges per pin\n"
+                "# TYPE sbpd_gpio_edges_total counter\n");
+    for (int pin = 0; pin < max_pins; pin++) {
+        uint64_t edges = __atomic_load_n(&metric_edges[pin], __ATOMIC_RELAXED);
+        if (edges)
+            out(output, "sbpd_gpio_edges_total{pin=\"%d\"} %llu\n", pin,
+                (unsigned long long)edges);
+    }
+    out_counter(output, "sbpd_button_presses_total", "Button presses by type",
+                "{type=\"short\"}", M_BUTTON_SHORT);
+    out_counter(output, "sbpd_button_presses_total", NULL,
+                "{type=\"long\"}", M_BUTTON_LONG);
+    out_counter(output, "sbpd_encoder_steps_total", "Rotary encoder steps", "", M_ENCODER_STEPS);
+    out_counter(output, "sbpd_commands_total", "Commands by result",
+                "{result=\"sent\"}", M_COMMANDS_SENT);
+    out_counter(output, "sbpd_commands_total", NULL,
+                "{result=\"failed\"}", M_COMMANDS_FAILED);
+    out_counter(output, "sbpd_commands_total", NULL,
+                "{result=\"coalesced\"}", M_COMMANDS_COALESCED);
+    out_counter(output, "sbpd_commands_total", NULL,
+                "{result=\"failover\"}", M_COMMANDS_FAILOVER);
+    uint64_t queued = __atomic_load_n(&metric_counters[M_QUEUE_IN], __ATOMIC_RELAXED);
+    uint64_t dequeued = __atomic_load_n(&metric_counters[M_QUEUE_OUT], __ATOMIC_RELAXED);
+    out(output, "# HELP sbpd_queue_depth Commands waiting for the main loop\n"
+                "# TYPE sbpd_queue_depth gauge\n"
+                "sbpd_queue_depth %lld\n", (long long)(queued - dequeued));
+    out_counter(output, "sbpd_discovery_rescans_total", "Server discovery scans", "",
+                M_DISCOVERY_RESCANS);
+    out_counter(output, "sbpd_matrix_scans_total", "Button matrix scans", "",
+                M_MATRIX_SCANS);
+    out_counter(output, "sbpd_expander_reads_total", "I/O expander reads", "",
+                M_EXPANDER_READS);
+    out_counter(output, "sbpd_input_events_total", "Events read from input devices", "",
+                M_INPUT_EVENTS);
+
+    out(output, "# HELP sbpd_server_rtt_seconds Server round trip time of commands\n"
+                "# TYPE sbpd_server_rtt_seconds summary\n");
+    out_summary(output, "sbpd_server_rtt_seconds", "", &metric_rtt);
+    out(output, "# HELP sbpd_edge_dispatch_seconds GPIO edge to decoder dispatch\n"
+                "# TYPE sbpd_edge_dispatch_seconds summary\n");
+    out_summary(output, "sbpd_edge_dispatch_seconds", "", GPIO_latency());
+    out(output, "# HELP sbpd_matrix_scan_seconds Time per button matrix scan\n"
+                "# TYPE sbpd_matrix_scan_seconds summary\n");
+    out_summary(output, "sbpd_matrix_scan_seconds", "", matrix_scan_time());
+    out(output, "# HELP sbpd_expander_read_seconds Time per I/O expander read\n"
+                "# TYPE sbpd_expander_read_seconds summary\n");
+    out_summary(output, "sbpd_expander_read_seconds", "", expander_read_time());
+
+    static const char * stages[STAGES] = { "decide", "queue", "prepare", "send", "total" };
+    out(output, "# HELP sbpd_action_latency_seconds Input event latency per action and stage\n"
+                "# TYPE sbpd_action_latency_seconds summary\n");
+    struct action_stats * stats;
+    for (int i = 0; (stats = get_action(i)); i++) {
+        for (int stage = 0; stage < STAGES; stage++) {
+            char labels[96];
+            snprintf(labels, sizeof(labels), "action=\"%s\",stage=\"%s\"",
+                     stats->name, stages[stage]);
+            out_summary(output, "sbpd_action_latency_seconds", labels, &stats->stage[stage]);
+        }
+    }
+}
+
+//
+//  Metrics thread
+//  Serves every connection with the current metrics as HTTP/1.0 reply
+//
+static void * metrics_service(void * arg) {
+    int listener = (int)(intptr_t)arg;
+    struct output output = { malloc(METRICS_BUFSIZE), 0, METRICS_BUFSIZE, false };
+    if (!output.buffer) {
+        logerr("Metrics endpoint: no memory");
+        return NULL;
+    }
+    char header[160];
+    char request[1024];
+    while (true) {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if ((errno != EINTR) && (errno != ECONNABORTED))
+                logwarn("Metrics endpoint: accept failed: %s", strerror(errno));
+            continue;
+        }
+        // don't let a stuck client hold the endpoint
+        struct timeval timeout = { 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        recv(client, request, sizeof(request), 0);  // any request gets the metrics
+
+        // the buffer is kept for the next scrape
+        output.length = 0;
+        output.truncated = false;
+        format_metrics(&output);
+        if (output.truncated)
+            logwarn("Metrics endpoint: output truncated to %zu bytes", output.length);
+        int len = snprintf(header, sizeof(header),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n\r\n", output.length);
+        if (send(client, header, len, MSG_NOSIGNAL) == len)
+            send(client, output.buffer, output.length, MSG_NOSIGNAL);
+        close(client);
+    }
+    return NULL;
+}
+
+//
+//  Start the metrics endpoint
+//
+int start_metrics(const char * listen_on) {
+    int listener;
+    if (listen_on[0] == '/') {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, listen_on, sizeof(addr.sun_path) - 1);
+        unlink(listen_on);
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0) {
+            logerr("Metrics endpoint: no socket: %s", strerror(errno));
+            return -1;
+        }
+        if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            logerr("Metrics endpoint: can't bind to %s: %s", listen_on, strerror(errno));
+            close(listener);
+            return -1;
+        }
+    } else {
+        char * end;
+        unsigned long port = strtoul(listen_on, &end, 10);
+        if ((end == listen_on) || *end || (port < 1) || (port > 65535)) {
+            logerr("Metrics endpoint: invalid port %s", listen_on);
+            return -1;
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0) {
+            logerr("Metrics endpoint: no socket: %s", strerror(errno));
+            return -1;
+        }
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            logerr("Metrics endpoint: can't bind to port %s: %s", listen_on, strerror(errno));
+            close(listener);
+            return -1;
+        }
+    }
+    if (listen(listener, 4) != 0) {
+        logerr("Metrics endpoint: listen failed: %s", strerror(errno));
+        close(listener);
+        return -1;
+    }
+    int err = pthread_create(&metrics_thread, NULL, metrics_service, (void *)(intptr_t)listener);
+    if (err) {
+        logerr("Metrics endpoint: could not start thread: %s", strerror(err));
+        close(listener);
+        return -1;
+    }
+    loginfo("Metrics endpoint listening on %s", listen_on);
+    return 0;
+}
@@ -0,0 +1,86 @@
+//
+//  metrics.h
+//  SqueezeButtonPi
+//
+//  Daemon counters and Prometheus exposition endpoint
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#ifndef metrics_h
+#define metrics_h
+
+#include "sbpd.h"
+#include "stats.h"
+
+//
+//  Counters
+//  Updated with relaxed atomics from any thread, never blocks
+//
+enum {
+    M_BUTTON_SHORT,         // short button presses
+    M_BUTTON_LONG,          // long button presses
+    M_ENCODER_STEPS,        // encoder steps decoded
+    M_COMMANDS_SENT,        // commands sent successfully
+    M_COMMANDS_FAILED,      // commands failed
+    M_COMMANDS_COALESCED,   // encoder steps merged into another command
+    M_COMMANDS_FAILOVER,    // failed commands sent again to the player's new server
+    M_QUEUE_IN,             // commands queued for the main loop
+    M_QUEUE_OUT,            // commands taken from the queue
+    M_DISCOVERY_RESCANS,    // server discovery scans
+    M_MATRIX_SCANS,         // button matrix scans
+    M_EXPANDER_READS,       // I/O expander reads
+    M_INPUT_EVENTS,         // events read from input devices
+    M_COUNTERS
+};
+#define max_pins 64
+
+extern uint64_t metric_counters[M_COUNTERS];
+extern uint64_t metric_edges[max_pins];
+
+//
+//  Server round trip time of commands
+//
+extern struct histogram metric_rtt;
+
+#define metric_add(counter, n)  __atomic_fetch_add(&metric_counters[counter], (n), __ATOMIC_RELAXED)
+#define metric_inc(counter)     metric_add(counter, 1)
+#define metric_edge(pin)        __atomic_fetch_add(&metric_edges[(pin) & (max_pins - 1)], 1, __ATOMIC_RELAXED)
+
+//
+//  Start the metrics endpoint
+//  Serves the metrics in Prometheus text format from a thread of its own
+//
+//  Parameters:
+//      listen_on: TCP port on localhost, or path of a unix socket if it starts with "/"
+//  Returns: 0 on success
+//
+int start_metrics(const char * listen_on);
+
+#endif /* metrics_h */
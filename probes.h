@@ -0,0 +1,73 @@
+//
+//  probes.h
+//  SqueezeButtonPi
+//
+//  USDT static probes for bpftrace/perf
+//  The probes compile to a nop and cost nothing while nobody is attached.
+//  Without <sys/sdt.h> (systemtap-sdt-dev) or with -DSBPD_NO_USDT they
+//  compile to nothing.
+//
+//  List them with: bpftrace -l 'usdt:/usr/local/bin/sbpd:*'
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#ifndef probes_h
+#define probes_h
+
+#if !defined(SBPD_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SBPD_USDT 1
+#endif
+#endif
+
+#ifdef SBPD_USDT
+#define PROBE1(name, a)             DTRACE_PROBE1(sbpd, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(sbpd, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(sbpd, name, a, b, c)
+#else
+// sizeof keeps the arguments "used" without evaluating them
+#define PROBE1(name, a)             do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b)          do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c)       do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+//
+//  Probes
+//      edge(pin, level, kernel timestamp ns)       GPIO edge received
+//      press(pin, press type, duration ms)         button press classified
+//      encoder_delta(pin a, delta)                 encoder delta computed
+//      enqueue(pin, press type)                    command queued for the main loop
+//      send_start(command type, fragment)          sending a command starts
+//      send_end(command type, success, rtt µs)     sending a command finished
+//      discovery(address, port)                    server address (string) or port changed
+//
+
+#endif /* probes_h */
@@ -45,12 +45,21 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <argp.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <ctype.h>
 #include "sbpd.h"
 #include "discovery.h"
 #include "servercomm.h"
 #include "control.h"
+#include "stats.h"
+#include "metrics.h"
+#include "trace.h"
 
 //
 //  Server configuration
@@ -58,19 +67,31 @@
 static sbpd_config_parameters_t configured_parameters = 0;
 static sbpd_config_parameters_t discovered_parameters = 0;
 static struct sbpd_server server;
-static char * MAC;
+
+//
+//  Players
+//  players[0] is the default player, zones add named players
+//
+static struct sbpd_player players[max_players];
+static int player_count = 1;
+uint64_t start_us;
 
 //
 //  signal handling
 //
 static volatile int stop_signal;
+static volatile int stats_signal;
 static void sigHandler( int sig, siginfo_t *siginfo, void *context );
+static void log_resources(const char * stage);
 
 //
-//  Logging
+//  Main loop file descriptors
 //
-static int streamloglevel = LOG_NOTICE;
-static int sysloglevel = LOG_ALERT;
+static struct pollfd pollFds[MAX_POLL_FDS];
+static poll_callback_t pollCallbacks[MAX_POLL_FDS];
+static void * pollContexts[MAX_POLL_FDS];
+static int pollCount = 0;
+static void wait_poll_fds(uint64_t timeout);
 
 //
 //  Argument Parsing
@@ -79,6 +100,8 @@ const char *argp_program_version = USER_AGENT " " VERSION;
 const char *argp_program_bug_address = "<coolio@penguinlovesmusic.com>";
 static error_t parse_opt(int key, char *arg, struct argp_state *state);
 static error_t parse_arg();
+static error_t parse_element(char * arg);
+static void reload_config(int fd, void * context);
 //
 //  OPTIONS.  Field 1 in ARGP.
 //  Order of fields: {NAME, KEY, ARG, FLAGS, DOC, GROUP}.
@@ -91,11 +114,21 @@ static struct argp_option options[] =
     { "address",   'A', "Server-Address", 0,
         "Set server address. Default: autodetect", 0 },
     { "port",      'P', "xxxx", 0, "Set server control port. Default: autodetect", 0 },
+    { "candidate", 'C', "Server-Address[,port]", 0, "Known server to fail over to without waiting for discovery. Can be repeated", 0 },
+    { "player",    'n', "name|PID", 0, "Follow the server of this player process. Default: first player found", 0 },
+    { "zone",      'Z', "name=MAC[,process]", 0, "Also control the player with this MAC, elements prefixed with \"name:\" control it", 0 },
     { "username",  'u', "user name", 0, "Set user name for server. Default: none", 0 },
     { "password",  'p', "password", 0, "Set password for server. Default: none", 0 },
     { "verbose",   'v', 0, 0, "Produce verbose output", 1 },
     { "silent",    's', 0, 0, "Don't produce output", 1 },
     { "daemonize", 'd', 0, 0, "Daemonize", 1 },
+    { "priority",  'r', "1-99", 0, "Run GPIO edge service with SCHED_FIFO priority. Default: normal scheduling", 1 },
+    { "cpu",       'c', "core", 0, "Pin GPIO edge service to CPU core. Default: any", 1 },
+    { "metrics",   'm', "port|/path", 0, "Serve metrics in Prometheus format on localhost port or unix socket. Default: off", 1 },
+    { "trace",     't', "</path/trace-file>", 0, "Write binary event trace, decode with sbpd-trace. Default: off", 1 },
+    { "state",     'S', "</path/state-file>", 0, "Remember MAC, server and port for a fast start. Default: off", 1 },
+    { "realtime",  'R', 0, 0, "Realtime mode: lock memory, run GPIO edge service with SCHED_FIFO on a dedicated core", 1 },
+    { "simulate",  'G', "</path/fifo>", 0, "Simulate GPIO, input levels are written to this FIFO. For testing and benchmarks", 1 },
 //    { "kill",      'k', 0, 0, "Kill daemon", 1 },
     { "debug",     'z', 0, 0, "Produce debug output", 1 },
     {0}
@@ -103,7 +136,7 @@ static struct argp_option options[] =
 //
 //  ARGS_DOC. Field 3 in ARGP.
 //  Non-Option arguments.
-static char args_doc[] = "[e,pin1,pin2,CMD,edge] [b,pin,CMD,resist,pressed...]";
+static char args_doc[] = "[[zone:]e,pin1,pin2,CMD,edge] [[zone:]b,pin,CMD,resist,pressed...]";
 //
 //
 //  DOC.  Field 4 in ARGP.
@@ -112,11 +145,11 @@ static char args_doc[] = "[e,pin1,pin2,CMD,edge] [b,pin,CMD,resist,pressed...]";
 static char doc[] = "sbpd - SqueezeButtinPiDaemon is a button and rotary encoder handling daemon for Raspberry Pi and a Squeezebox player software.\nsbpd connects to a Squeezebox server and sends the configured control commands on behalf of a player running on the RPi.\n<C>2017 Joerg Schwieder/PenguinLovesMusic.com\n\n\
 At least one needs to be specified for the daemon to do anything useful\n\
 Arguments are a comma-separated list of configuration parameters:\n\
-For rotary encoders (one, volume only):\n\
+For rotary encoders:\n\
     e,pin1,pin2,CMD[,edge]\n\
         \"e\" for \"Encoder\"\n\
         p1, p2: GPIO PIN numbers in BCM-notation\n\
-        CMD: Command. one of. \n\
+        CMD: Encoder action from the command configuration or\n\
                     VOLU for Volume\n\
                     TRAC for Prev/Next track\n\
         edge: Optional. one of\n\
@@ -145,24 +178,79 @@ For buttons:\n\
               0 - state is 0 (default)\n\
               1 - state is 1\n\
          CMD_LONG: Command to be used for a long button push, see above list\n\
-         long_time: Number of milliseconds for a long button press\n";
+         long_time: Number of milliseconds for a long button press\n\
+For a button matrix:\n\
+    m,row/row/...,column/column/...\n\
+        \"m\" for \"Matrix\", rows and columns GPIO PIN numbers in BCM-notation\n\
+        Key (row, column) is used as button on pin 32 + row * columns + column\n\
+For an I/O expander:\n\
+    x,pin[,address,bus]\n\
+        \"x\" for \"eXpander\", MCP23017 with its interrupt output on pin,\n\
+        address 0x20..0x27 (default 0x20) on I2C bus (default 1)\n\
+        Input GPA0..GPB7 is used as button or encoder pin 48..63\n\
+For input devices (IR receivers, media keys, keyboards):\n\
+    i,/dev/input/eventN[,grab]\n\
+        \"i\" for \"Input device\", grab 1 to get its keys exclusively\n\
+    k,KEY,CMD[,CMD_LONG,long_time]\n\
+        \"k\" for \"Key\" of all input devices, KEY is a code or name,\n\
+        e.g. KEY_PLAYPAUSE, commands as for buttons\n\
+For layer buttons:\n\
+    l,pin,layer[,resist,pressed]\n\
+        \"l\" for \"Layer\", while held buttons and encoders use layer 1..3\n\
+        Bind elements in a layer with the layer number after the type,\n\
+        e.g. e1,23,24,TRAC or b1,17,NEXT\n\
+Elements control the default player, prefix them with a zone name given\n\
+with -Z to control that player instead, e.g. kitchen:b,17,PLAY\n";
 //
 //  ARGP parsing structure
 //
 static struct argp argp = {options, parse_opt, args_doc, doc};
 static bool arg_daemonize = false;
+static int arg_priority = 0;
+static int arg_cpu = -1;
+static bool arg_realtime = false;
+static char * arg_metrics = NULL;
+static char * arg_trace = NULL;
+static char * arg_simulate = NULL;
+static char * arg_state = NULL;
+static char * arg_candidates[max_candidates];
+static int arg_candidate_count = 0;
+
+//
+//  Realtime mode defaults
+//
+#define RT_PRIORITY         50
+#define RT_STACK_PREFAULT   (128 * 1024)
+static void enter_realtime();
 static char *arg_elements[max_buttons + max_encoders];
 static int arg_element_count = 0;
+//
+//  Elements from the config file, read again on reload
+//
+static char *config_elements[max_buttons + max_encoders];
+static int config_element_count = 0;
 
 int main(int argc, char * argv[]) {
+    start_us = us_timer();
     //
     //  Parse Arguments
     //
 
     argp_parse (&argp, argc, argv, 0, 0, 0);
     //
+    //  SIGHUP reloads the configuration. It's read from a signalfd by the
+    //  main loop, block it before any thread is started so none gets it.
+    //
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &reload_signals, NULL);
+    //
     //  Parse command config file
     //
+    if (begin_controls() != 0)
+        return -1;
+    // at startup a missing config file falls back to the builtin commands
     parse_config();
 
     //
@@ -188,10 +276,19 @@ int main(int argc, char * argv[]) {
         }
     }
     
+    //
+    //  Log from a background thread from now on
+    //
+    start_logger();
+    if (arg_trace && (start_trace(arg_trace) != 0))
+        return -2;
+
     //
     //  Init GPIO
     //  Done after daemonization becasue child process needs to have GPIO initilized
     //
+    if (arg_simulate && (simulate_GPIO(arg_simulate) != 0))
+        return -2;
     init_GPIO();
     
     //
@@ -203,6 +300,19 @@ int main(int argc, char * argv[]) {
 	if ( arg_err != 0 ) {
        return -2;
     }
+    commit_controls();
+    //
+    //  Start servicing GPIO edges
+    //
+    log_resources("before GPIO edge service");
+    if (arg_realtime)
+        enter_realtime();
+    if (start_GPIO(arg_priority, arg_cpu) != 0)
+        return -2;
+    log_resources("after GPIO edge service");
+    if (arg_metrics && (start_metrics(arg_metrics) != 0))
+        return -2;
+
     //
     // Configure signal handling
     //
@@ -212,22 +322,37 @@ int main(int argc, char * argv[]) {
     act.sa_flags     = SA_SIGINFO;
     sigaction( SIGINT, &act, NULL );
     sigaction( SIGTERM, &act, NULL );
+    sigaction( SIGUSR1, &act, NULL );
+    int reload_fd = signalfd(-1, &reload_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if ((reload_fd < 0) || (register_poll_fd(reload_fd, reload_config, NULL) != 0))
+        logwarn("Configuration reload on SIGHUP not available");
     
     
+    //
+    //  Warm start: use what we found last time
+    //
+    init_discovery(configured_parameters, &server, players, player_count);
+    for (int i = 0; i < arg_candidate_count; i++)
+        add_candidate_server(arg_candidates[i]);
+    if (arg_state)
+        discovered_parameters |= load_state(arg_state, &players[0].mac);
+    bool revalidate_mac = (discovered_parameters & SBPD_cfg_MAC);
+
     //
     // Find MAC
     //
-    if (!(configured_parameters & SBPD_cfg_MAC)) {
-        MAC = find_mac();
-        if (!MAC)
+    if (!(configured_parameters & SBPD_cfg_MAC) && !revalidate_mac) {
+        players[0].mac = find_mac();
+        if (!players[0].mac)
             return -1;  // no MAC, no control
         discovered_parameters |= SBPD_cfg_MAC;
+        save_state();
     }
     
     //
     //  Initialize server communication
     //
-    init_comm(MAC);
+    init_comm();
     
     //
     //
@@ -235,19 +360,44 @@ int main(int argc, char * argv[]) {
     //
     //
     loginfo("Starting main loop polling");
+    uint64_t next_tick = us_timer();
     while( !stop_signal ) {
+        uint64_t now = us_timer();
+        if (now >= next_tick) {
+            next_tick = now + SCD_SLEEP_TIMEOUT; // 0.1s
+            //
+            //  Poll the server discovery
+            //
+            poll_discovery();
+            handle_buttons();
+            handle_encoders();
+            poll_input_devices();
+            //
+            //  MAC from the state file: check it once we're running
+            //
+            if (revalidate_mac) {
+                revalidate_mac = false;
+                char * found = find_mac();
+                if (found && strcmp(found, players[0].mac)) {
+                    loginfo("MAC address changed from %s", players[0].mac);
+                    players[0].mac = found;
+                    save_state();
+                }
+            }
+            //
+            //  Latency statistics requested?
+            //
+            if (stats_signal) {
+                stats_signal = 0;
+                log_GPIO_latency();
+                log_action_stats();
+            }
+            now = us_timer();
+        }
         //
-        //  Poll the server discovery
-        //
-        poll_discovery(configured_parameters,
-                       &discovered_parameters,
-                       &server);
-        handle_buttons(&server);
-        handle_encoders(&server);
-        //
-        // Just sleep...
+        // Wait for the next tick or a registered descriptor
         //
-        usleep( SCD_SLEEP_TIMEOUT ); // 0.1s
+        wait_poll_fds((next_tick > now) ? next_tick - now : 0);
         
     } // end of: while( !stop_signal )
     
@@ -255,6 +405,8 @@ int main(int argc, char * argv[]) {
     //  Shutdown server communication
     //
     shutdown_comm();
+    log_GPIO_latency();
+    log_action_stats();
     
     return 0;
 }
@@ -278,17 +430,17 @@ parse_opt (int key, char *arg, struct argp_state *state)
             //
             //  Verbose mode
         case 'v':
-            streamloglevel = LOG_INFO;
+            set_loglevel(LOG_INFO);
             loginfo("Options parsing: Set verbose mode");
             break;
             //  Debug mode
         case 'z':
-            streamloglevel = LOG_DEBUG;
+            set_loglevel(LOG_DEBUG);
             loginfo("Options parsing: Set debug mode");
             break;
             //  Silent Mode
         case 's':
-            streamloglevel = 0;
+            set_loglevel(0);
             loginfo("Options parsing: Set quiet mode");
             break;
             //  Daemonize
@@ -297,14 +449,75 @@ parse_opt (int key, char *arg, struct argp_state *state)
             // don't daemonize here, parse all args first
             arg_daemonize = true;
             break;
+            //  GPIO edge service scheduling
+        case 'r':
+            arg_priority = (int)strtol(arg, NULL, 10);
+            loginfo("Options parsing: GPIO edge service priority %d", arg_priority);
+            break;
+        case 'c':
+            arg_cpu = (int)strtol(arg, NULL, 10);
+            loginfo("Options parsing: GPIO edge service on CPU %d", arg_cpu);
+            break;
+        case 'm':
+            arg_metrics = arg;
+            loginfo("Options parsing: Metrics endpoint on %s", arg_metrics);
+            break;
+        case 't':
+            arg_trace = arg;
+            loginfo("Options parsing: Tracing to %s", arg_trace);
+            break;
+        case 'G':
+            arg_simulate = arg;
+            loginfo("Options parsing: Simulating GPIO, input from %s", arg_simulate);
+            break;
+        case 'n':
+            players[0].process = arg;
+            loginfo("Options parsing: Player process %s", arg);
+            break;
+        case 'Z': {
+            //  name=MAC[,process]
+            char * mac = strchr(arg, '=');
+            if (!mac || (mac == arg) || !mac[1]) {
+                logerr("Zone argument error: %s", arg);
+                return ARGP_ERR_UNKNOWN;
+            }
+            *mac++ = 0;
+            if (player_count == max_players) {
+                logerr("Too many zones defined");
+                return ARGP_ERR_UNKNOWN;
+            }
+            if (find_player(arg)) {
+                logerr("Zone %s defined twice", arg);
+                return ARGP_ERR_UNKNOWN;
+            }
+            struct sbpd_player * player = players + player_count++;
+            player->name = arg;
+            player->mac = mac;
+            char * process = strchr(mac, ',');
+            if (process) {
+                *process++ = 0;
+                player->process = process;
+            }
+            loginfo("Options parsing: Zone %s, MAC %s, player process %s",
+                    player->name, player->mac, player->process ? player->process : "any");
+        }
+            break;
+        case 'S':
+            arg_state = arg;
+            loginfo("Options parsing: State file %s", arg_state);
+            break;
+        case 'R':
+            arg_realtime = true;
+            loginfo("Options parsing: Realtime mode");
+            break;
             
             //
             //  Player parameter
             //
             //  MAC Address
         case 'M':
-            MAC = arg;
-            loginfo("Options parsing: Manually set MAC: %s", MAC);
+            players[0].mac = arg;
+            loginfo("Options parsing: Manually set MAC: %s", players[0].mac);
             configured_parameters |= SBPD_cfg_MAC;
             break;
             
@@ -317,10 +530,19 @@ parse_opt (int key, char *arg, struct argp_state *state)
             loginfo("Options parsing: Manually set http address %s", server.host);
             configured_parameters |= SBPD_cfg_host;
             break;
+            //  Failover candidate servers
+        case 'C':
+            if (arg_candidate_count == max_candidates) {
+                logerr("Too many candidate servers defined");
+                return ARGP_ERR_UNKNOWN;
+            }
+            arg_candidates[arg_candidate_count++] = arg;
+            loginfo("Options parsing: Candidate server %s", arg);
+            break;
             //  Server port
         case 'P':
             server.port = (uint32_t)strtoul(arg, NULL, 10);
-            loginfo("Options parsing: Manually set http port %s", server.port);
+            loginfo("Options parsing: Manually set http port %u", server.port);
             configured_parameters |= SBPD_cfg_port;
             break;
             //  Server user name
@@ -357,16 +579,17 @@ parse_opt (int key, char *arg, struct argp_state *state)
     return 0;
 }
 //
-//  Parse non-option arguments
+//  Parse non-option arguments and the elements of the config file
 //
 //  GPIO devices
 //
 //  Arguments are a comma-separated list of configuration parameters:
-//  For rotary encoders (one, volume only):
+//  For rotary encoders:
 //      e,pin1,pin2,CMD[,edge]
 //          "e" for "Encoder"
 //          p1, p2: GPIO PIN numbers in BCM-notation
-//          CMD:        VOLU for Volume
+//          CMD:        Encoder action from the command configuration or
+//                      VOLU for Volume
 //                      TRAC for Playlist previous/next
 //          edge: Optional. one of
 //                  1 - falling edge
@@ -393,79 +616,301 @@ parse_opt (int key, char *arg, struct argp_state *state)
 //                1 - state is 1
 //           CMD_LONG: Command to be used for a long button push, see above command list
 //           long_time: Number of millivoid seconds to define a long press
+//  For a button matrix:
+//      m,row/row/...,column/column/...
+//          "m" for "Matrix"
+//           rows, columns: GPIO PIN numbers in BCM-notation, separated by "/"
+//           Key (row, column), counted from 0, is used as a button on pin
+//           32 + row * columns + column
+//  For an I/O expander:
+//      x,pin[,address,bus]
+//          "x" for "eXpander", MCP23017 class
+//           pin: GPIO PIN number in BCM-notation of the interrupt output
+//           address: Optional I2C address 0x20..0x27, default 0x20
+//           bus: Optional I2C bus, default 1
+//           Inputs GPA0..7, GPB0..7 are used as buttons or encoders on
+//           pins 48..63
+//  For input devices:
+//      i,path[,grab]
+//          "i" for "Input device"
+//           path: event device, e.g. /dev/input/event0
+//           grab: Optional 1 to get the device exclusively
+//      k,KEY,CMD[,CMD_LONG,long_time]
+//          "k" for "Key", pressed on any of the input devices
+//           KEY: key code or name from linux/input-event-codes.h, e.g. KEY_PLAYPAUSE
+//           CMD, CMD_LONG, long_time: as for buttons
+//  For layer buttons:
+//      l,pin,layer[,resist,pressed]
+//          "l" for "Layer"
+//           layer: 1 .. max_layers - 1, selected while the button is held
+//           resist, pressed: as for buttons
+//
+//  "e" and "b" followed by a layer number bind the element in that layer,
+//  e.g. e1,23,24,TRAC. Elements not bound in a layer act as in the base layer.
+//
+//  Elements control the default player, "zone:" in front of them
+//  selects a player defined with -Z
 //
 static error_t parse_arg() {
-    for (int arg_num = 0; arg_num < arg_element_count; arg_num++) {
-        char * arg = arg_elements[arg_num];
-        {
-            char * code = strtok(arg, ",");
-            if (strlen(code) != 1)
+    for (int arg_num = 0; arg_num < arg_element_count + config_element_count; arg_num++) {
+        //
+        //  Parse a copy, elements are parsed again on reload
+        //
+        char element[MAXLEN];
+        strncpy(element, (arg_num < arg_element_count) ? arg_elements[arg_num] :
+                         config_elements[arg_num - arg_element_count], sizeof(element) - 1);
+        element[sizeof(element) - 1] = 0;
+        error_t err = parse_element(element);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+//
+//  Parse a list of pins separated by "/"
+//  Returns: number of pins, -1 on errors
+//
+static int parse_pins(const char * list, int * pins, int max) {
+    int count = 0;
+    if (!list)
+        return -1;
+    while (*list) {
+        char * end;
+        int pin = (int)strtol(list, &end, 10);
+        if ((end == list) || (pin <= 0) || (count == max) || ((*end != '/') && *end))
+            return -1;
+        pins[count++] = pin;
+        list = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+static error_t parse_element(char * arg) {
+    struct sbpd_player * player = players;
+    char * zone = strchr(arg, ':');
+    if (zone && (zone < strchrnul(arg, ','))) {
+        *zone = 0;
+        player = find_player(arg);
+        if (!player || !player->name) {
+            logerr("Unknown zone %s", arg);
+            return ARGP_ERR_UNKNOWN;
+        }
+        arg = zone + 1;
+    }
+    {
+        char * code = strtok(arg, ",");
+        if (!code || !code[0])
+            return ARGP_ERR_UNKNOWN;
+        //
+        //  A layer number may follow the element type
+        //
+        int layer = 0;
+        if (code[1]) {
+            char * end;
+            layer = (int)strtol(code + 1, &end, 10);
+            if (*end || (layer < 1) || (layer >= max_layers) || !strchr("ebk", code[0])) {
+                logerr("Invalid element type %s", code);
                 return ARGP_ERR_UNKNOWN;
-            switch (code[0]) {
-                case 'e': {
-                    char * string = strtok(NULL, ",");
-                    int p1 = 0;
-                    if (string)
-                        p1 = (int)strtol(string, NULL, 10);
-                    string = strtok(NULL, ",");
-                    int p2 = 0;
-                    if (string)
-                        p2 = (int)strtol(string, NULL, 10);
-                    char * cmd = strtok(NULL, ",");
-                    string = strtok(NULL, ",");
-                    int edge = 0;
-                    if (string)
-                        edge = (int)strtol(string, NULL, 10);
-                    if ( (p1 == 0) | (p2 == 0) | (cmd == NULL) ) {
-                        logerr("Encoder argument error");
-                        return ARGP_ERR_UNKNOWN;
-                    }
-                    setup_encoder_ctrl(cmd, p1, p2, edge);
+            }
+        }
+        switch (code[0]) {
+            case 'e': {
+                char * string = strtok(NULL, ",");
+                int p1 = 0;
+                if (string)
+                    p1 = (int)strtol(string, NULL, 10);
+                string = strtok(NULL, ",");
+                int p2 = 0;
+                if (string)
+                    p2 = (int)strtol(string, NULL, 10);
+                char * cmd = strtok(NULL, ",");
+                string = strtok(NULL, ",");
+                int edge = 0;
+                if (string)
+                    edge = (int)strtol(string, NULL, 10);
+                if ( (p1 == 0) | (p2 == 0) | (cmd == NULL) ) {
+                    logerr("Encoder argument error");
+                    return ARGP_ERR_UNKNOWN;
                 }
-                    break;
-                case 'b': {
-                    char * string = strtok(NULL, ",");
-                    int pin = 0;
-                    if (string)
-                        pin = (int)strtol(string, NULL, 10);
-                    char * cmd = strtok(NULL, ",");
-                    int resist = 2;
-                    string = strtok(NULL, ",");
-                    if (string)
-                        resist = (int)strtol(string, NULL, 10);
-                    bool pressed = 0;
-                    string = strtok(NULL, ",");
-                    if (string)
-                        pressed = (int)strtol(string, NULL, 10);
-                    char * cmd_long = NULL;
-                    if (string)
-                        cmd_long = strtok(NULL, ",");
-                    string = strtok(NULL, ",");
-                    uint32_t long_time=3000;
-                    if (string)
-                        long_time = (int)strtol(string, NULL, 10);
-                    if ( (pin == 0) | (cmd == NULL) ) {
-                        logerr("Button argument error");
-                        return ARGP_ERR_UNKNOWN;
-                    }
-                    setup_button_ctrl(cmd, pin, resist, pressed, cmd_long, long_time);
+                //
+                //  strtok skips an empty action field, the edge then
+                //  takes its place: e,5,6,,1
+                //
+                if (isdigit((unsigned char)cmd[0])) {
+                    logerr("Encoder on pins %d, %d: action name missing", p1, p2);
+                    return ARGP_ERR_UNKNOWN;
+                }
+                if (setup_encoder_ctrl(player, layer, cmd, p1, p2, edge) != 0)
+                    return ARGP_ERR_UNKNOWN;
+            }
+                break;
+            case 'b': {
+                char * string = strtok(NULL, ",");
+                int pin = 0;
+                if (string)
+                    pin = (int)strtol(string, NULL, 10);
+                char * cmd = strtok(NULL, ",");
+                int resist = 2;
+                string = strtok(NULL, ",");
+                if (string)
+                    resist = (int)strtol(string, NULL, 10);
+                bool pressed = 0;
+                string = strtok(NULL, ",");
+                if (string)
+                    pressed = (int)strtol(string, NULL, 10);
+                char * cmd_long = NULL;
+                if (string)
+                    cmd_long = strtok(NULL, ",");
+                string = strtok(NULL, ",");
+                uint32_t long_time=3000;
+                if (string)
+                    long_time = (int)strtol(string, NULL, 10);
+                if ( (pin == 0) | (cmd == NULL) ) {
+                    logerr("Button argument error");
+                    return ARGP_ERR_UNKNOWN;
+                }
+                if (setup_button_ctrl(player, layer, cmd, pin, resist, pressed, cmd_long, long_time) != 0)
+                    return ARGP_ERR_UNKNOWN;
+            }
+                break;
+            case 'l': {
+                char * string = strtok(NULL, ",");
+                int pin = 0;
+                if (string)
+                    pin = (int)strtol(string, NULL, 10);
+                string = strtok(NULL, ",");
+                int select = 0;
+                if (string)
+                    select = (int)strtol(string, NULL, 10);
+                int resist = 2;
+                string = strtok(NULL, ",");
+                if (string)
+                    resist = (int)strtol(string, NULL, 10);
+                bool pressed = 0;
+                string = strtok(NULL, ",");
+                if (string)
+                    pressed = (int)strtol(string, NULL, 10);
+                if ( (pin == 0) | (select == 0) ) {
+                    logerr("Layer button argument error");
+                    return ARGP_ERR_UNKNOWN;
+                }
+                if (setup_layer_ctrl(pin, select, resist, pressed) != 0)
+                    return ARGP_ERR_UNKNOWN;
+            }
+                break;
+            case 'm': {
+                int rows[max_matrix_rows];
+                int columns[max_matrix_columns];
+                int numberofrows = parse_pins(strtok(NULL, ","), rows, max_matrix_rows);
+                int numberofcolumns = parse_pins(strtok(NULL, ","), columns, max_matrix_columns);
+                if ( (numberofrows <= 0) | (numberofcolumns <= 0) ) {
+                    logerr("Button matrix argument error");
+                    return ARGP_ERR_UNKNOWN;
+                }
+                if (setup_matrix_ctrl(rows, numberofrows, columns, numberofcolumns) != 0)
+                    return ARGP_ERR_UNKNOWN;
+            }
+                break;
+            case 'x': {
+                char * string = strtok(NULL, ",");
+                int pin = 0;
+                if (string)
+                    pin = (int)strtol(string, NULL, 10);
+                int address = 0x20;
+                string = strtok(NULL, ",");
+                if (string)
+                    address = (int)strtol(string, NULL, 0);
+                int bus = 1;
+                string = strtok(NULL, ",");
+                if (string)
+                    bus = (int)strtol(string, NULL, 10);
+                if (pin == 0) {
+                    logerr("I/O expander argument error");
+                    return ARGP_ERR_UNKNOWN;
+                }
+                if (setup_expander_ctrl(pin, address, bus) != 0)
+                    return ARGP_ERR_UNKNOWN;
+            }
+                break;
+            case 'i': {
+                char * path = strtok(NULL, ",");
+                bool grab = false;
+                char * string = strtok(NULL, ",");
+                if (string)
+                    grab = (int)strtol(string, NULL, 10);
+                if (path == NULL) {
+                    logerr("Input device argument error");
+                    return ARGP_ERR_UNKNOWN;
                 }
-                    break;
-                    
-                default:
-                    break;
+                if (setup_input_ctrl(path, grab) != 0)
+                    return ARGP_ERR_UNKNOWN;
             }
+                break;
+            case 'k': {
+                char * string = strtok(NULL, ",");
+                int key = -1;
+                if (string)
+                    key = input_key_code(string);
+                char * cmd = strtok(NULL, ",");
+                char * cmd_long = strtok(NULL, ",");
+                string = strtok(NULL, ",");
+                uint32_t long_time=3000;
+                if (string)
+                    long_time = (int)strtol(string, NULL, 10);
+                if ( (key < 0) | (cmd == NULL) ) {
+                    logerr("Key argument error");
+                    return ARGP_ERR_UNKNOWN;
+                }
+                if (setup_key_ctrl(player, layer, cmd, key, cmd_long, long_time) != 0)
+                    return ARGP_ERR_UNKNOWN;
+            }
+                break;
+                
+            default:
+                logerr("Unknown element type %s", code);
+                return ARGP_ERR_UNKNOWN;
         }
     }
     return 0;
 }
 
-void parse_config() {
-    char *s, buff[256];
+//
+//  Find a player by zone name, NULL for the default player
+//  returns NULL if there is no such zone
+//
+struct sbpd_player * find_player(const char * name) {
+    if (!name)
+        return players;
+    for (int i = 1; i < player_count; i++) {
+        if (!strcmp(players[i].name, name))
+            return players + i;
+    }
+    return NULL;
+}
+
+//
+//  Parse the config file
+//  Lines are
+//      <CODE>=<JSON command fragment>    a command
+//      element=<element>                 a button or encoder, as on the command line
+//  Without a config file the builtin commands are used
+//  Returns: 0 on success, -1 if the config file could not be read or has errors
+//
+int parse_config() {
+    int err = 0;
+    char *buff = NULL;
+    size_t buffsize = 0;
     FILE *fp = NULL;
+    for (int i = 0; i < config_element_count; i++)
+        free(config_elements[i]);
+    config_element_count = 0;
     if (configured_parameters & SBPD_cfg_config) {
         fp = fopen ( server.config_file, "r");
-        if (fp == NULL) loginfo("Config file %s : not found", server.config_file);
+        if (fp == NULL) {
+            logerr("Config file %s : %s", server.config_file, strerror(errno));
+            err = -1;
+        }
     }
     if (fp == NULL) {
         loginfo("Using builtin button configuration");
@@ -475,42 +920,71 @@ void parse_config() {
         add_lms_command_frament ( "PREV", "[\"button\",\"rew\"]" );
         add_lms_command_frament ( "NEXT", "[\"button\",\"fwd\"]" );
         add_lms_command_frament ( "POWR", "[\"button\",\"power\"]" );
-        return;
+        return err;
     }
     //Start reading file, line by line
-    while ((s = fgets (buff, sizeof buff, fp)) != NULL) {
+    while (getline (&buff, &buffsize, fp) != -1) {
         //Skip blank lines and comments
         if (buff[0] == '\n' || buff[0] == '#')
             continue;
 
         //Parse name/value pair from line
-        // names are 4 characters only.
-        char name[MAXLEN] = "";
-        char value[MAXLEN] = "";
-        s = strtok (buff, "=");
-        if (s==NULL)
+        //Names and values have no length limit
+        char *name, *value;
+        name = strtok (buff, "=");
+        if (name==NULL)
             continue;
-        else
-            strncpy (name, s, 4);
-        s = strtok (NULL, "=");
-        if (s==NULL)
+        value = strtok (NULL, "");
+        if (value==NULL)
             continue;
-        else
-            strncpy (value, s, MAXLEN);
         // Remove beginning and trailing whitespace
+        trim (name);
         trim (value);
 
         loginfo ("name=%s, value=%s", name, value);
-        if (strlen(name) == 4) {  
-            if ( add_lms_command_frament ( name, value ) != 0 ) {  
-                loginfo ("Too many commands in config file, reduce the number of commands");
+        if (strcmp(name, "element") == 0) {
+            if (config_element_count == (max_encoders + max_buttons)) {
+                logerr ("Too many control elements in config file");
+                err = -1;
+                continue;
+            }
+            config_elements[config_element_count++] = strdup(value);
+        } else if (*name) {
+            if ( add_lms_command_frament ( name, value ) != 0 ) {
+                logerr ("Could not add command %s", name);
+                err = -1;
                 continue;
-            } 
+            }
         } else {
             loginfo ("Invalid or missing commands in config file.");
         }
     }
+    free (buff);
     fclose (fp);
+    return err;
+}
+
+//
+//  SIGHUP: reload the configuration
+//  Commands and elements from the config file and the command line are
+//  parsed into a new control table, on errors the current one stays active
+//
+static void reload_config(int fd, void * context) {
+    struct signalfd_siginfo info;
+    bool reload = false;
+    while (read(fd, &info, sizeof(info)) == sizeof(info))
+        reload = true;
+    if (!reload)
+        return;
+    loginfo("Reloading configuration");
+    if (begin_controls() != 0)
+        return;
+    if ((parse_config() != 0) || (parse_arg() != 0)) {
+        logerr("Configuration error, keeping the current configuration");
+        abort_controls();
+        return;
+    }
+    commit_controls();
 }
 
 //
@@ -539,6 +1013,118 @@ char * trim (char * s) {
     return s;
 }
 
+//
+//  Realtime mode
+//  Lock all memory and pre-fault the main stack so input handling never
+//  waits for a page fault. The GPIO edge service gets SCHED_FIFO and a core
+//  of its own (the last one) unless configured otherwise. The main thread
+//  doing the network communication stays at normal priority and is moved
+//  off that core.
+//
+static void enter_realtime() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        logwarn("Realtime mode: could not lock memory");
+    volatile char prefault[RT_STACK_PREFAULT];
+    memset((char *)prefault, 0, sizeof(prefault));
+
+    if (!arg_priority)
+        arg_priority = RT_PRIORITY;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((arg_cpu < 0) && (cpus > 1))
+        arg_cpu = (int)cpus - 1;
+    if ((arg_cpu >= 0) && (cpus > 1)) {
+        cpu_set_t others;
+        CPU_ZERO(&others);
+        for (int cpu = 0; cpu < cpus; cpu++)
+            if (cpu != arg_cpu)
+                CPU_SET(cpu, &others);
+        if (sched_setaffinity(0, sizeof(others), &others) != 0)
+            logwarn("Realtime mode: could not set main thread affinity");
+    }
+    lognotice("Realtime mode: GPIO edge service priority %d on CPU %d",
+              arg_priority, arg_cpu);
+}
+
+//
+//  Register a descriptor with the main loop
+//  returns 0 on success, -1 if there are too many
+//
+int register_poll_fd(int fd, poll_callback_t callback, void * context) {
+    if (pollCount >= MAX_POLL_FDS) {
+        logerr("Too many main loop descriptors, can't add %d", fd);
+        return -1;
+    }
+    pollFds[pollCount].fd = fd;
+    pollFds[pollCount].events = POLLIN;
+    pollFds[pollCount].revents = 0;
+    pollCallbacks[pollCount] = callback;
+    pollContexts[pollCount] = context;
+    pollCount++;
+    return 0;
+}
+
+void unregister_poll_fd(int fd) {
+    for (int i = 0; i < pollCount; i++) {
+        if (pollFds[i].fd != fd)
+            continue;
+        pollCount--;
+        pollFds[i] = pollFds[pollCount];
+        pollCallbacks[i] = pollCallbacks[pollCount];
+        pollContexts[i] = pollContexts[pollCount];
+        return;
+    }
+}
+
+//
+//  Wait up to timeout µs for registered descriptors and run their callbacks
+//  Callbacks may register and unregister descriptors, so we work on a copy
+//  and look every ready descriptor up again before calling back.
+//
+static void wait_poll_fds(uint64_t timeout) {
+    struct pollfd fds[MAX_POLL_FDS];
+    int count = pollCount;
+    memcpy(fds, pollFds, count * sizeof(struct pollfd));
+    int ready = poll(fds, count, (int)((timeout + 999) / 1000));
+    if (ready <= 0) {
+        if ((ready < 0) && (errno != EINTR))
+            logwarn("Main loop poll failed: %s", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!fds[i].revents)
+            continue;
+        for (int j = 0; j < pollCount; j++) {
+            if (pollFds[j].fd == fds[i].fd) {
+                pollCallbacks[j](pollFds[j].fd, pollContexts[j]);
+                break;
+            }
+        }
+    }
+}
+
+//
+// Log thread count and resident memory of the daemon
+//
+static void log_resources(const char * stage) {
+    FILE * status = fopen("/proc/self/status", "r");
+    if (!status)
+        return;
+    char line[128];
+    char * threads = NULL;
+    char * rss = NULL;
+    char threadsBuf[32] = "";
+    char rssBuf[32] = "";
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, "Threads:", 8) == 0)
+            threads = strncpy(threadsBuf, trim(line + 8), sizeof(threadsBuf) - 1);
+        else if (strncmp(line, "VmRSS:", 6) == 0)
+            rss = strncpy(rssBuf, trim(line + 6), sizeof(rssBuf) - 1);
+    }
+    fclose(status);
+    loginfo("Resources %s: threads: %s, RSS: %s", stage,
+            threads ? threads : "?", rss ? rss : "?");
+}
+
 //
 // Handle signals
 //
@@ -556,6 +1142,12 @@ static void sigHandler( int sig, siginfo_t *siginfo, void *context )
             stop_signal = sig;
             break;
             //
+            // Dump latency statistics
+            //
+        case SIGUSR1:
+            stats_signal = sig;
+            break;
+            //
             // Ignore broken pipes
             //
         case SIGPIPE:
@@ -563,62 +1155,6 @@ static void sigHandler( int sig, siginfo_t *siginfo, void *context )
     }
 }
 
-//
-//  Logging facility
-//
-void _mylog( const char *file, int line,  int prio, const char *fmt, ... )
-{
-    //
-    // Init arguments, lock mutex
-    //
-    va_list a_list;
-    va_start( a_list, fmt );
-    
-    //
-    //  Log to stream
-    //
-    if( prio <= streamloglevel) {
-        
-        // select stream due to priority
-        FILE *f = (prio < LOG_INFO) ? stderr : stdout;
-        //FILE *f = stderr;
-        
-        // print timestamp, prio and thread info
-        struct timeval tv;
-        gettimeofday( &tv, NULL );
-        double time = tv.tv_sec+tv.tv_usec*1E-6;
-        fprintf( f, "%.4f %d", time, prio);
-        
-        // prepend location to message (if available)
-        if( file )
-            fprintf( f, " %s,%d: ", file, line );
-        else
-            fprintf( f, ": " );
-        
-        // the message itself
-        vfprintf( f, fmt, a_list );
-        
-        // New line and flush stream buffer
-        fprintf( f, "\n" );
-        fflush( f );
-    }
-    
-    //
-    //  use syslog facility, hide debugging messages from syslog
-    //
-    if( prio <= sysloglevel && prio < LOG_DEBUG)
-        vsyslog( prio, fmt, a_list );
-    
-    //
-    //  Clean variable argument list, unlock mutex
-    //
-    va_end ( a_list );
-}
-
-int loglevel() {
-    return MAX(sysloglevel, streamloglevel);
-}
-
 long long ms_timer(void) {
     struct timespec tv;
 
@@ -89,30 +89,77 @@ struct sbpd_server {
     char *      config_file;
 };
 
+//
+//  Players
+//  One daemon can control several players, e.g. one per zone.
+//  The first player is the default, buttons and encoders without a
+//  player name control it.
+//
+#define max_players 4
+struct sbpd_player {
+    const char *            name;       // NULL for the default player
+    char *                  mac;
+    const char *            process;    // player process name or PID, NULL: first found
+    struct sbpd_server *    server;     // set by discovery, NULL until found
+};
+struct sbpd_player * find_player(const char * name);
+
+//
+//  Failover candidate servers given on the command line
+//
+#define max_candidates 4
+
 //
 //  Define scheduling behavior
-//  We use usleep so this is in µs
+//  Main loop tick in µs
 //
 #define SCD_SLEEP_TIMEOUT   100000
 #define SCD_SECOND          1000000
 
 //
-//  Helpers
+//  Main loop file descriptors
+//  The main loop waits on registered descriptors between its ticks,
+//  the callback runs on the main thread when the descriptor is readable
 //
-#define STRTOU32(x) (*((uint32_t *)x))  // make a 32 bit integer from a 4 char string
+#define MAX_POLL_FDS        16
+typedef void (*poll_callback_t)(int fd, void * context);
+int register_poll_fd(int fd, poll_callback_t callback, void * context);
+void unregister_poll_fd(int fd);
 
-void parse_config();
+//
+//  Helpers
+//
+int parse_config();
 char * trim (char * s);
 
 //
 //  Logging
-//
-#define logerr( args... )     _mylog( __FILE__, __LINE__, LOG_ERR, args )
-#define logwarn( args... )    _mylog( __FILE__, __LINE__, LOG_WARNING, args )
-#define lognotice( args... )  _mylog( __FILE__, __LINE__, LOG_NOTICE, args )
-#define loginfo( args... )    _mylog( __FILE__, __LINE__, LOG_INFO, args )
-#define logdebug( args... )    _mylog( __FILE__, __LINE__, LOG_DEBUG, args )
-void _mylog( const char *file, int line, int prio, const char *fmt, ... );
+//  Log calls are cheap: arguments are copied into a per thread ring and
+//  formatted by a background thread once start_logger() was called
+//
+//  SBPD_LOG_LEVEL is the most verbose level compiled in, calls above it
+//  are removed by the compiler including their arguments.
+//  Calls above the runtime threshold don't evaluate their arguments.
+//
+#ifndef SBPD_LOG_LEVEL
+#define SBPD_LOG_LEVEL LOG_DEBUG
+#endif
+extern int log_threshold;
+#define _log( prio, args... ) \
+    do { \
+        if (((prio) <= SBPD_LOG_LEVEL) && ((prio) <= log_threshold)) \
+            _mylog( __FILE__, __LINE__, prio, args ); \
+    } while (0)
+#define logerr( args... )     _log( LOG_ERR, args )
+#define logwarn( args... )    _log( LOG_WARNING, args )
+#define lognotice( args... )  _log( LOG_NOTICE, args )
+#define loginfo( args... )    _log( LOG_INFO, args )
+#define logdebug( args... )   _log( LOG_DEBUG, args )
+void _mylog( const char *file, int line, int prio, const char *fmt, ... )
+    __attribute__((format(printf, 4, 5)));
+int start_logger();
+void set_loglevel(int level);
 int loglevel();
 long long ms_timer(void);
+extern uint64_t start_us;   // us_timer() at program start
 #endif /* sbpd_h */
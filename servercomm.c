@@ -36,10 +36,18 @@
 
 #include "servercomm.h"
 #include "sbpd.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "discovery.h"
 #include <curl/curl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 //
 // lock for asynchronous sending of commands - we don't do this right now
@@ -49,13 +57,224 @@
 static volatile bool commLock;
 static pthread_mutex_t lock;*/
 
-static CURL *curl;
-static char * MAC = NULL;
+static bool commInitialized = false;
+static bool firstCommandSent = false;
 static struct curl_slist * headerList = NULL;
 
 #define JSON_CALL_MASK	"{\"id\":%ld,\"method\":\"slim.request\",\"params\":[\"%s\",%s]}"
 #define SERVER_ADDRESS_TEMPLATE "http://localhost/jsonrpc.js"
 
+//
+//  Connection pool
+//  Every server gets a curl handle of its own. Curl keeps the connection
+//  to the server open between commands, failing over to another server
+//  and back doesn't cost a new connection.
+//  The least recently used handle is replaced when all are taken.
+//
+#define MAX_CONNECTIONS 8
+static struct {
+    const struct sbpd_server *  server;
+    CURL *                      curl;
+    uint64_t                    last_used;
+} connections[MAX_CONNECTIONS];
+
+size_t write_data(char *buffer, size_t size, size_t nmemb, void *userp);
+
+//
+//  Setup a curl handle for a server
+//
+static CURL * new_connection() {
+    CURL * curl = curl_easy_init();
+    if (!curl)
+        return NULL;
+    //
+    //  Set verbose mode for communication debugging
+    //
+    if (loglevel() == LOG_DEBUG)
+        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
+    curl_easy_setopt(curl, CURLOPT_URL, SERVER_ADDRESS_TEMPLATE);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    return curl;
+}
+
+//
+//  Get the curl handle of a server
+//
+static CURL * get_connection(const struct sbpd_server * server) {
+    int slot = -1;
+    int oldest = 0;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].server == server) {
+            slot = i;
+            break;
+        }
+        if (connections[i].last_used < connections[oldest].last_used)
+            oldest = i;
+    }
+    if (slot < 0) {
+        slot = oldest;
+        if (connections[slot].curl)
+            curl_easy_cleanup(connections[slot].curl);
+        connections[slot].curl = new_connection();
+        connections[slot].server = connections[slot].curl ? server : NULL;
+        logdebug("New connection for server %s", server->host);
+    }
+    connections[slot].last_used = us_timer();
+    return connections[slot].curl;
+}
+
+//
+//  Send a command fragment to one server
+//  Returns: success flag
+//
+static bool send_lms(struct sbpd_server * server, const char * mac, char * fragment,
+                     struct latency_stamps * stamps) {
+    CURL * curl = get_connection(server);
+    if (!curl)
+        return false;
+
+    //
+    //  Payload (JSON/RPC CLI command) for the POST command
+    //  Fragments have no length limit, long ones get a buffer of their own
+    //
+    char buffer[256];
+    char * jsonFragment = buffer;
+    int length = snprintf(buffer, sizeof(buffer), JSON_CALL_MASK, 1l, mac, fragment);
+    if (length >= (int)sizeof(buffer)) {
+        jsonFragment = malloc(length + 1);
+        if (jsonFragment)
+            snprintf(jsonFragment, length + 1, JSON_CALL_MASK, 1l, mac, fragment);
+    }
+    if ((length < 0) || !jsonFragment) {
+        logerr("Could not build the command for fragment %s", fragment);
+        metric_inc(M_COMMANDS_FAILED);
+        return false;
+    }
+
+    //
+    //  Sending commands asynchronously? Secure with a mutex
+    //  But right now we are actually not doing that, so comment out
+    //
+    /*pthread_mutex_lock(&lock);
+    if (commLock) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    commLock = true;
+    pthread_mutex_unlock(&lock);*/
+
+    //
+    //  target setup. We call an IP address so we need to replace a default host
+    //  IPv6 addresses need brackets
+    //
+    struct curl_slist * targetList = NULL;
+
+    char target[100];
+    if (strchr(server->host, ':'))
+        snprintf(target, sizeof(target), "::[%s]:%d", server->host, server->port);
+    else
+        snprintf(target, sizeof(target), "::%s:%d", server->host, server->port);
+    //logdebug("Command Target: %s", target);
+    targetList = curl_slist_append(targetList, target);
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, targetList);
+
+    // Setup an error buffer to log errors
+    char errbuf[CURL_ERROR_SIZE];
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+    errbuf[0] = 0;
+    //
+    //  username/password?
+    //
+    char secret[255];
+    if (server->user && server->password) {
+        snprintf(secret, sizeof(secret), "%s:%s", server->user, server->password);
+        curl_easy_setopt(curl, CURLOPT_USERPWD, secret);
+    }
+
+    logdebug("Server %s command: %s", target, jsonFragment);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonFragment);
+
+    //
+    //  Send command and clean up
+    //  Note: one could retrieve a result here since all communication is synchronous!
+    //
+    trace(TRACE_SEND_START, LMS, 0);
+    PROBE2(send_start, LMS, fragment);
+    uint64_t send_start = us_timer();
+    CURLcode res = curl_easy_perform(curl);
+    uint64_t reply = us_timer();
+    long httpStatus = 0;
+    if (res == CURLE_OK)
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpStatus);
+    bool success = (res == CURLE_OK) && (httpStatus < 400);
+    trace(TRACE_SEND_END, LMS, success);
+    PROBE3(send_end, LMS, success, reply - send_start);
+    hist_record(&metric_rtt, reply - send_start);
+    if (stamps) {
+        stamps->send_start = send_start;
+        stamps->reply = reply;
+    }
+    metric_inc(success ? M_COMMANDS_SENT : M_COMMANDS_FAILED);
+    if (success && !firstCommandSent) {
+        firstCommandSent = true;
+        lognotice("First command sent %llu ms after start",
+                  (unsigned long long)((reply - start_us) / 1000));
+    }
+    if(res != CURLE_OK) {
+        size_t len = strlen(errbuf);
+        loginfo("Curl Error: (%d) ", res);
+        if(len)
+            loginfo( "%s%s", errbuf,((errbuf[len - 1] != '\n') ? "\n" : ""));
+        else
+            loginfo( "%s\n", curl_easy_strerror(res));
+    } else if (!success) {
+        loginfo("Server replied with HTTP status %ld", httpStatus);
+    }
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, NULL);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+    curl_slist_free_all(targetList);
+    targetList = NULL;
+    if (jsonFragment != buffer)
+        free(jsonFragment);
+
+    //commLock = false;
+    report_server(server, success);
+    return success;
+}
+
+//
+//  Run a script command line with /bin/sh, like system()
+//  The main thread blocks SIGHUP for the reload signalfd and children
+//  inherit the signal mask, so it is unblocked for the script.
+//  Returns: wait status as from system(), -1 if it could not be started
+//
+static int run_script(const char * cmdline) {
+    sigset_t mask;
+    pthread_sigmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, SIGHUP);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    char * argv[] = { "sh", "-c", (char *)cmdline, NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        logerr("Could not run %s: %s", cmdline, strerror(err));
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return status;
+}
+
 //
 //
 //  Send CLI command fragment to Logitech Media Server/Squeezebox Server
@@ -63,93 +282,58 @@ static struct curl_slist * headerList = NULL;
 //  In timing critical situations this should be called from a separate thread
 //
 //  Parameters:
-//      server: the server information structure defining host, port etc.
+//      player: the player to control. Its MAC and server are used
 //      frament: the command fragment to be sent as JSON array
 //               e.g. "[\"mixer\”,\"volume\",\"+2\"]"
 //               optionally: some CLI commands can take parameter hashes as "params:{}"
-//  Returns: success flag
+//      stamps: latency stamps of the event, send start and reply get set.
+//              Can be NULL
+//  Returns: success flag. Fails if the server can't be reached or replies
+//           with an HTTP error, or the player's server isn't known yet.
+//           A failed command is sent again if the player moved to another
+//           server in the meantime
 //
 //
-bool send_command(struct sbpd_server * server, int command, char * fragment) {
+bool send_command(struct sbpd_player * player, int command, char * fragment,
+                  struct latency_stamps * stamps) {
     loginfo("Send Command:%d, Fragment:%s", command, fragment);
     if ( command == LMS ) {
-        if (!curl)
+        struct sbpd_server * server = player->server;
+        if (!commInitialized || !server || !server->host || !server->port)
             return false;
+        bool success = send_lms(server, player->mac, fragment, stamps);
 
         //
-        //  Sending commands asynchronously? Secure with a mutex
-        //  But right now we are actually not doing that, so comment out
+        //  Server gone or changed? If the player already moved to
+        //  another server the command goes there
         //
-        /*pthread_mutex_lock(&lock);
-        if (commLock) {
-            pthread_mutex_unlock(&lock);
-            return false;
+        if (!success && (server = failover_server(player))) {
+            loginfo("Failing over to server %s", server->host);
+            metric_inc(M_COMMANDS_FAILOVER);
+            success = send_lms(server, player->mac, fragment, stamps);
         }
-        commLock = true;
-        pthread_mutex_unlock(&lock);*/
-
-        //
-        //  target setup. We call an IPv4 ip so we need to replace a default host
-        //
-        struct curl_slist * targetList = NULL;
-        
-        curl_easy_setopt(curl, CURLOPT_URL, SERVER_ADDRESS_TEMPLATE);
-        char target[100];
-        snprintf(target, sizeof(target), "::%s:%d", server->host, server->port);
-        //logdebug("Command Target: %s", target);
-        targetList = curl_slist_append(targetList, target);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-        curl_easy_setopt(curl, CURLOPT_CONNECT_TO, targetList);
-
-        // Setup an error buffer to log errors
-        char errbuf[CURL_ERROR_SIZE];
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
-        errbuf[0] = 0;
-        //
-        //  username/password?
-        //
-        char secret[255];
-        if (server->user && server->password) {
-            snprintf(secret, sizeof(secret), "%s:%s", server->user, server->password);
-            curl_easy_setopt(curl, CURLOPT_USERPWD, secret);
-        }
-
-        //
-        //  setup payload (JSON/RPC CLI command) for POST command
-        //
-        char jsonFragment[256];
-        snprintf(jsonFragment, sizeof(jsonFragment), JSON_CALL_MASK, 1l, MAC, fragment);
-        logdebug("Server %s command: %s", target, jsonFragment);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonFragment);
-        if (headerList)
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerList);
-
-        //
-        //  Send command and clean up
-        //  Note: one could retrieve a result here since all communication is synchronous!
-        //
-        CURLcode res = curl_easy_perform(curl);
-        if(res != CURLE_OK) {
-            size_t len = strlen(errbuf);
-            loginfo("Curl Error: (%d) ", res);
-            if(len)
-                loginfo( "%s%s", errbuf,((errbuf[len - 1] != '\n') ? "\n" : ""));
-            else
-                loginfo( "%s\n", curl_easy_strerror(res));
-        }
-        curl_slist_free_all(targetList);
-        targetList = NULL;
-
-        //commLock = false;
-        return true;
+        return success;
     } else if ( command == SCRIPT ) {
-        char * cmdline = (char *) malloc(strlen(fragment));
+        char * cmdline = strdup(fragment);
         int err;
-        strcpy( cmdline, fragment);
+        if (!cmdline)
+            return false;
         loginfo("Sending commandline: %s\n", cmdline);
-        if ((err = system(cmdline)) != 0){
+        if (stamps)
+            stamps->send_start = us_timer();
+        trace(TRACE_SEND_START, SCRIPT, 0);
+        PROBE2(send_start, SCRIPT, fragment);
+        uint64_t send_start = us_timer();
+        err = run_script(cmdline);
+        trace(TRACE_SEND_END, SCRIPT, err == 0);
+        PROBE3(send_end, SCRIPT, err == 0, us_timer() - send_start);
+        if (stamps)
+            stamps->reply = us_timer();
+        metric_inc((err == 0) ? M_COMMANDS_SENT : M_COMMANDS_FAILED);
+        if (err != 0){
             loginfo ("%s exit status = %d\n", cmdline, err);
-                return false;
+            free (cmdline);
+            return false;
         }
         free (cmdline);
     }
@@ -169,12 +353,11 @@ size_t write_data(char *buffer, size_t size, size_t nmemb, void *userp) {
 
 //
 //
-//  Initialize CURL for server communication and set MAC address
+//  Initialize CURL for server communication
 //
 //
-int init_comm(char * use_mac) {
+int init_comm() {
     loginfo("Initializing CURL");
-    MAC = use_mac;
     //
     //  Setup mutex lock for comm - unused
     //
@@ -185,20 +368,10 @@ int init_comm(char * use_mac) {
     
     //
     //  Initialize curl comm
+    //  Handles are set up per server when used first
     //
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
-    if (!curl) {
-        curl_global_cleanup();
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
         return -1;
-    }
-    
-    //
-    //  Set verbose mode for communication debugging
-    //
-    if (loglevel() == LOG_DEBUG)
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
     headerList = curl_slist_append(headerList, "Content-Type: application/json");
     char userAgent[50];
     snprintf(userAgent, sizeof(userAgent), "User-Agent: %s/%s)", USER_AGENT, VERSION);
@@ -207,6 +380,7 @@ int init_comm(char * use_mac) {
     //  Add session-ID? Only needed for MySB which is not supported
     //
     //headerList = curl_slist_append(headerList, "x-sdi-squeezenetwork-session: ...")
+    commInitialized = true;
     return 0;
 }
 
@@ -216,8 +390,13 @@ int init_comm(char * use_mac) {
 //
 //
 void shutdown_comm() {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].curl)
+            curl_easy_cleanup(connections[i].curl);
+        connections[i].curl = NULL;
+        connections[i].server = NULL;
+    }
     curl_slist_free_all(headerList);
-    curl_easy_cleanup(curl);
     curl_global_cleanup();
 }
 
@@ -36,13 +36,14 @@
 #define servercomm_h
 
 #include "sbpd.h"
+#include "stats.h"
 
 //
 //
-//  Initialize CURL for server communication and set MAC address
+//  Initialize CURL for server communication
 //
 //
-int init_comm(char * use_mac);
+int init_comm();
 
 //
 //
@@ -58,12 +59,16 @@ void shutdown_comm();
 //  In timing critical situations this should be called from a separate thread
 //
 //  Parameters:
-//      server: the server information structure defining host, port etc.
+//      player: the player to control. Its MAC and server are used
 //      frament: the command fragment to be sent as JSON array
 //               e.g. "[\"mixer\”,\"volume\",\"+2\"]"
-//  Returns: success flag
+//      stamps: latency stamps of the event, send start and reply get set.
+//              Can be NULL
+//  Returns: success flag. A failed command is sent again if the player
+//           moved to another server in the meantime
 //
 //
-bool send_command(struct sbpd_server * server, int command, char * fragment);
+bool send_command(struct sbpd_player * player, int command, char * fragment,
+                  struct latency_stamps * stamps);
 
 #endif /* servercomm_h */
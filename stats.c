@@ -0,0 +1,206 @@
+//
+//  stats.c
+//  SqueezeButtonPi
+//
+//  Latency histograms
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "stats.h"
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+
+static struct action_stats * actions[MAX_ACTIONS];
+static int numberofactions = 0;
+static const char * stage_names[STAGES] = {
+    "edge->decided", "decided->dispatched", "dispatched->send", "send->reply", "edge->reply"
+};
+
+//
+//  Bucket index for a value
+//
+static int hist_index(uint64_t us) {
+    if (us >= (1ULL << 32))
+        return HIST_BUCKETS - 1;
+    if (us < HIST_SUB)
+        return (int)us;
+    int exponent = 63 - __builtin_clzll(us);
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB +
+           (int)((us >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+//
+//  Largest value falling into a bucket
+//
+static uint64_t hist_bucket_max(int index) {
+    if (index < HIST_SUB)
+        return index;
+    int exponent = index / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t sub = index % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+//
+//  Record one value
+//
+void hist_record(struct histogram * hist, uint64_t us) {
+    __atomic_fetch_add(&hist->count[hist_index(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, us, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while ((us > max) &&
+           !__atomic_compare_exchange_n(&hist->max, &max, us, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+//
+//  Values at several ascending percentiles in one pass over the buckets
+//
+void hist_percentiles(const struct histogram * hist, const double * percentiles,
+                      int count, uint64_t * values) {
+    uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+    int index = 0;
+    for (int i = 0; i < count; i++) {
+        if (!total) {
+            values[i] = 0;
+            continue;
+        }
+        uint64_t target = (uint64_t)(total * percentiles[i] / 100.0 + 0.5);
+        if (target < 1)
+            target = 1;
+        while ((seen < target) && (index < HIST_BUCKETS))
+            seen += __atomic_load_n(&hist->count[index++], __ATOMIC_RELAXED);
+        uint64_t value = (seen >= target) ? hist_bucket_max(index - 1) : max;
+        values[i] = (value < max) ? value : max;
+    }
+}
+
+//
+//  Value at percentile (0..100), upper bound of the bucket
+//
+uint64_t hist_percentile(const struct histogram * hist, double percentile) {
+    uint64_t value;
+    hist_percentiles(hist, &percentile, 1, &value);
+    return value;
+}
+
+//
+//  Log summary
+//
+void hist_log(const struct histogram * hist) {
+    uint64_t total = hist->total;
+    if (!total) {
+        lognotice("%s: no samples", hist->name);
+        return;
+    }
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    uint64_t values[4];
+    hist_percentiles(hist, percentiles, 4, values);
+    lognotice("%s: n=%llu mean=%lluus p50=%lluus p90=%lluus p99=%lluus p99.9=%lluus max=%lluus",
+              hist->name,
+              (unsigned long long)total,
+              (unsigned long long)(hist->sum / total),
+              (unsigned long long)values[0],
+              (unsigned long long)values[1],
+              (unsigned long long)values[2],
+              (unsigned long long)values[3],
+              (unsigned long long)hist->max);
+}
+
+//
+//  Monotonic time in µs
+//
+uint64_t us_timer(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+//  Get the statistics for an action, create them if needed
+//
+struct action_stats * get_action_stats(const char * name) {
+    for (int i = 0; i < numberofactions; i++) {
+        if (strncmp(actions[i]->name, name, sizeof(actions[i]->name) - 1) == 0)
+            return actions[i];
+    }
+    if (numberofactions == MAX_ACTIONS)
+        return NULL;
+    struct action_stats * stats = calloc(1, sizeof(struct action_stats));
+    if (!stats)
+        return NULL;
+    strncpy(stats->name, name, sizeof(stats->name) - 1);
+    for (int stage = 0; stage < STAGES; stage++) {
+        snprintf(stats->labels[stage], sizeof(stats->labels[stage]), "%s %s",
+                 stats->name, stage_names[stage]);
+        stats->stage[stage].name = stats->labels[stage];
+    }
+    actions[numberofactions++] = stats;
+    return stats;
+}
+
+//
+//  Iterate actions
+//
+struct action_stats * get_action(int index) {
+    if ((index < 0) || (index >= numberofactions))
+        return NULL;
+    return actions[index];
+}
+
+static void record_stage(struct histogram * hist, uint64_t from, uint64_t to) {
+    if (from && to && (to >= from))
+        hist_record(hist, to - from);
+}
+
+//
+//  Record the stage latencies of a completed event
+//
+void record_action(struct action_stats * stats, const struct latency_stamps * stamps) {
+    if (!stats)
+        return;
+    record_stage(&stats->stage[STAGE_DECIDE], stamps->edge, stamps->decided);
+    record_stage(&stats->stage[STAGE_QUEUE], stamps->decided, stamps->dispatched);
+    record_stage(&stats->stage[STAGE_PREPARE], stamps->dispatched, stamps->send_start);
+    record_stage(&stats->stage[STAGE_SEND], stamps->send_start, stamps->reply);
+    record_stage(&stats->stage[STAGE_TOTAL], stamps->edge, stamps->reply);
+}
+
+//
+//  Log the histogram summaries of all actions
+//
+void log_action_stats() {
+    for (int i = 0; i < numberofactions; i++) {
+        for (int stage = 0; stage < STAGES; stage++)
+            hist_log(&actions[i]->stage[stage]);
+    }
+}
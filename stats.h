@@ -0,0 +1,143 @@
+//
+//  stats.h
+//  SqueezeButtonPi
+//
+//  Latency histograms
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef stats_h
+#define stats_h
+
+#include "sbpd.h"
+
+//
+//  Log-linear histogram of latencies in µs
+//  Values below 8 get their own bucket, above that every power of two is
+//  split into 8 buckets. That keeps the relative error below 12.5%
+//  over the full range up to ~71 minutes.
+//
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+    const char * name;
+    uint32_t count[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+//
+//  Record one value
+//  Safe to call from any thread, recording is lock free
+//
+void hist_record(struct histogram * hist, uint64_t us);
+
+//
+//  Value at percentile (0..100), upper bound of the bucket
+//
+uint64_t hist_percentile(const struct histogram * hist, double percentile);
+
+//
+//  Values at several ascending percentiles in one pass over the buckets
+//
+void hist_percentiles(const struct histogram * hist, const double * percentiles,
+                      int count, uint64_t * values);
+
+//
+//  Log summary: count, mean, p50, p90, p99, p99.9, max
+//
+void hist_log(const struct histogram * hist);
+
+//
+//  Monotonic time in µs
+//
+uint64_t us_timer(void);
+
+//
+//  End-to-end latency of an input event
+//  Every event is stamped (us_timer() time base) when the edge happened,
+//  when the press or step was decided, when the main loop dispatched it and
+//  when sending to the server started and the reply came in.
+//
+struct latency_stamps {
+    uint64_t edge;
+    uint64_t decided;
+    uint64_t dispatched;
+    uint64_t send_start;
+    uint64_t reply;
+};
+
+//
+//  Stages measured between the stamps
+//
+enum {
+    STAGE_DECIDE,       // edge -> decided
+    STAGE_QUEUE,        // decided -> dispatched
+    STAGE_PREPARE,      // dispatched -> send start
+    STAGE_SEND,         // send start -> reply
+    STAGE_TOTAL,        // edge -> reply
+    STAGES
+};
+
+//
+//  Per action latency histograms, one per stage
+//
+#define MAX_ACTIONS 32
+struct action_stats {
+    char name[32];
+    char labels[STAGES][48];
+    struct histogram stage[STAGES];
+};
+
+//
+//  Get the statistics for an action, create them if needed
+//  Resolve at setup time, not on the dispatch path
+//  Returns NULL if too many actions are defined
+//
+struct action_stats * get_action_stats(const char * name);
+
+//
+//  Iterate actions: returns NULL for index past the last action
+//
+struct action_stats * get_action(int index);
+
+//
+//  Record the stage latencies of a completed event
+//  Stages with missing stamps are skipped
+//
+void record_action(struct action_stats * stats, const struct latency_stamps * stamps);
+
+//
+//  Log the histogram summaries of all actions
+//
+void log_action_stats();
+
+#endif /* stats_h */
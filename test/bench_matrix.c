@@ -0,0 +1,163 @@
+//
+//  bench_matrix.c
+//  SqueezeButtonPi
+//
+//  Benchmark for the button matrix scanner on simulated GPIO
+//      make bench_matrix && ./bench_matrix [seconds]
+//  Holds a key of a 4 x 8 matrix down so the scanner runs all the time and
+//  taps the other keys. Prints the scans per second and the CPU share of the
+//  process, then the scanner statistics with the time per scan.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "GPIO.h"
+#include "metrics.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SECONDS 10
+#define TAP_DOWN_US     80000   // long enough to count as a press
+#define TAP_UP_US       20000
+#define FIFO_PATH       "/tmp/bench_matrix.fifo"
+
+//
+//  Daemon functions used by GPIO.c and stats.c
+//
+int log_threshold = LOG_WARNING;   // no press logging while measuring
+uint64_t metric_counters[M_COUNTERS];
+uint64_t metric_edges[max_pins];
+struct trace_header * trace_map;
+
+void trace_event(uint16_t event, uint16_t a, uint32_t b) {
+}
+
+void _mylog(const char * file, int line, int prio, const char * fmt, ...) {
+    if (prio > log_threshold)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+static volatile unsigned long presses = 0;
+
+static void pressed(const struct button * button, int change, bool presstype) {
+    __atomic_fetch_add(&presses, 1, __ATOMIC_RELAXED);
+}
+
+static int fifo;
+
+static void key(int row, int column, bool down) {
+    char line[32];
+    int length = snprintf(line, sizeof(line), "k %d %d %d\n", row, column, down);
+    if (write(fifo, line, length) != length) {
+        perror("write " FIFO_PATH);
+        exit(1);
+    }
+}
+
+static double seconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv[]) {
+    int duration = (argc > 1) ? atoi(argv[1]) : DEFAULT_SECONDS;
+    if (duration <= 0) {
+        fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    static const int rows[] = { 5, 6, 13, 19 };
+    static const int columns[] = { 12, 16, 20, 21, 22, 23, 24, 25 };
+    const int numberofrows = sizeof(rows) / sizeof(rows[0]);
+    const int numberofcolumns = sizeof(columns) / sizeof(columns[0]);
+
+    unlink(FIFO_PATH);
+    if (simulate_GPIO(FIFO_PATH) != 0)
+        return 1;
+    init_GPIO();
+    if (setup_matrix(rows, numberofrows, columns, numberofcolumns) != 0)
+        return 1;
+    for (int k = 0; k < numberofrows * numberofcolumns; k++) {
+        if (!setupbutton(VIRTUAL_PIN_BASE + k, pressed, 2, false, 1000))
+            return 1;
+    }
+    if (start_GPIO(0, -1) != 0)
+        return 1;
+    fifo = open(FIFO_PATH, O_WRONLY);
+    if (fifo < 0) {
+        perror("open " FIFO_PATH);
+        return 1;
+    }
+
+    //
+    //  Key 0 is held, the others are tapped in turn
+    //
+    key(0, 0, true);
+    usleep(TAP_UP_US);
+    const struct histogram * scan = matrix_scan_time();
+    uint64_t scans = scan->total;
+    double wall = seconds(CLOCK_MONOTONIC);
+    double cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+    int taps = 0;
+    while (seconds(CLOCK_MONOTONIC) - wall < duration) {
+        int k = 1 + taps++ % (numberofrows * numberofcolumns - 1);
+        key(k / numberofcolumns, k % numberofcolumns, true);
+        usleep(TAP_DOWN_US);
+        key(k / numberofcolumns, k % numberofcolumns, false);
+        usleep(TAP_UP_US);
+    }
+    wall = seconds(CLOCK_MONOTONIC) - wall;
+    cpu = seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    scans = scan->total - scans;
+    key(0, 0, false);
+
+    printf("%d x %d matrix, %d taps, %lu presses in %.3f s\n",
+           numberofrows, numberofcolumns, taps, presses, wall);
+    printf("%llu scans: %.0f scans/s, %.2f%% CPU for the whole process\n",
+           (unsigned long long)scans, scans / wall, cpu * 100 / wall);
+    // time per scan and the scanner's own CPU share
+    log_threshold = LOG_INFO;
+    log_GPIO_latency();
+    return 0;
+}
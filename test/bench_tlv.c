@@ -0,0 +1,98 @@
+//
+//  bench_tlv.c
+//  SqueezeButtonPi
+//
+//  Benchmark for the discovery reply decoder
+//      make bench_tlv && ./bench_tlv [packets]
+//  Prints the packets decoded per second for a typical reply
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+#include "tlv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_PACKETS 10000000L
+
+//
+//  Append a field to a packet
+//
+static size_t add_field(char * packet, size_t pos, const char * tag, const char * value) {
+    size_t length = strlen(value);
+    memcpy(packet + pos, tag, 4);
+    packet[pos + 4] = (char)length;
+    memcpy(packet + pos + TLV_HEADER_SIZE, value, length);
+    return pos + TLV_HEADER_SIZE + length;
+}
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv[]) {
+    long packets = (argc > 1) ? atol(argv[1]) : DEFAULT_PACKETS;
+    if (packets <= 0) {
+        fprintf(stderr, "usage: %s [packets]\n", argv[0]);
+        return 1;
+    }
+
+    //
+    //  Typical reply: name, JSON port and UUID
+    //
+    char packet[256];
+    size_t size = 1;
+    packet[0] = 'E';
+    size = add_field(packet, size, "NAME", "LogitechMediaServer");
+    size = add_field(packet, size, "JSON", "9000");
+    size = add_field(packet, size, "UUID", "0c1b3e9a-6f1d-4b9e-9d0e-3c5a7f2b8e41");
+
+    struct discovery_reply reply;
+    unsigned long ports = 0;
+    double start = seconds();
+    for (long i = 0; i < packets; i++) {
+        // keep the compiler from hoisting the decoder out of the loop
+        __asm__ volatile("" : : "r"(packet) : "memory");
+        if (!parse_discovery_reply(packet, size, &reply)) {
+            fprintf(stderr, "reply rejected\n");
+            return 1;
+        }
+        ports += reply.port;
+    }
+    double elapsed = seconds() - start;
+
+    printf("%ld packets of %zu bytes in %.3f s: %.0f packets/s (%lu)\n",
+           packets, size, elapsed, packets / elapsed, ports / packets);
+    return 0;
+}
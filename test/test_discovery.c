@@ -0,0 +1,318 @@
+//
+//  test_discovery.c
+//  SqueezeButtonPi
+//
+//  Test for the server port discovery
+//      make check
+//  A stand-in server answers discovery requests on 127.0.0.x:3483 and
+//  drops a given number or share of them. Another server and the right
+//  address on a wrong port answer first and must be ignored. The clock
+//  is simulated, so the retransmit backoff runs in a moment.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "discovery.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int failures = 0;
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define SBS_UDP_PORT    3483
+#define ROGUE_PORT      1111
+#define ROGUE_SERVER    "127.0.0.99"
+
+//
+//  Daemon functions used by discovery.c
+//
+int log_threshold = LOG_DEBUG;
+uint64_t metric_counters[M_COUNTERS];
+struct trace_header * trace_map;
+
+void trace_event(uint16_t event, uint16_t a, uint32_t b) {
+}
+
+// replies discovery turned down
+static int ignored = 0;
+static int malformed = 0;
+
+void _mylog(const char * file, int line, int prio, const char * fmt, ...) {
+    if (strstr(fmt, "ignoring reply"))
+        ignored++;
+    if (strstr(fmt, "malformed reply"))
+        malformed++;
+    if (prio > LOG_WARNING)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    printf("  log: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+char * trim(char * s) {
+    return s;
+}
+
+// simulated clock, advanced while nothing is happening
+static uint64_t now_us = 1000 * SCD_SECOND;
+uint64_t us_timer(void) {
+    return now_us;
+}
+
+//
+//  Main loop descriptors
+//
+#define max_fds 8
+static struct {
+    int fd;
+    poll_callback_t callback;
+    void * context;
+} fds[max_fds];
+static int numberoffds = 0;
+
+int register_poll_fd(int fd, poll_callback_t callback, void * context) {
+    if (numberoffds == max_fds)
+        return -1;
+    fds[numberoffds].fd = fd;
+    fds[numberoffds].callback = callback;
+    fds[numberoffds].context = context;
+    numberoffds++;
+    return 0;
+}
+
+void unregister_poll_fd(int fd) {
+    for (int i = 0; i < numberoffds; i++) {
+        if (fds[i].fd == fd) {
+            fds[i] = fds[--numberoffds];
+            return;
+        }
+    }
+}
+
+//
+//  Stand-in servers
+//
+struct responder {
+    int socket;
+    int requests;       // requests received
+    int drop_first;     // drop this many requests
+    int drop_percent;   // then drop this share at random
+    int dropped;
+    uint16_t port;      // JSON port in the reply
+};
+
+static int bind_udp(const char * address, uint16_t port) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address, &addr.sin_addr);
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if ((fd < 0) || (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)) {
+        printf("FAIL can't bind %s:%u: %s\n", address, port, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static size_t add_field(char * packet, size_t pos, const char * tag, const char * value) {
+    size_t length = strlen(value);
+    memcpy(packet + pos, tag, 4);
+    packet[pos + 4] = (char)length;
+    memcpy(packet + pos + 5, value, length);
+    return pos + 5 + length;
+}
+
+static void send_reply(int fd, const struct sockaddr_in * to, uint16_t port) {
+    char packet[128];
+    char value[8];
+    snprintf(value, sizeof(value), "%u", port);
+    size_t size = 1;
+    packet[0] = 'E';
+    size = add_field(packet, size, "NAME", "stand-in");
+    size = add_field(packet, size, "JSON", value);
+    size = add_field(packet, size, "UUID", "00000000-0000-4000-8000-000000000000");
+    sendto(fd, packet, size, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+//
+//  Answer or drop a request
+//  Answers are preceded by a malformed reply and replies from the other
+//  server and from the wrong port
+//
+static int rogue;
+static int wrong_port;
+
+static void respond(struct responder * responder) {
+    char packet[64];
+    struct sockaddr_in from;
+    socklen_t size = sizeof(from);
+    ssize_t length;
+    while ((length = recvfrom(responder->socket, packet, sizeof(packet), 0,
+                              (struct sockaddr *)&from, &size)) > 0) {
+        if (packet[0] != 'e')
+            continue;
+        responder->requests++;
+        if ((responder->requests <= responder->drop_first) ||
+            (rand() % 100 < responder->drop_percent)) {
+            responder->dropped++;
+            continue;
+        }
+        send_reply(rogue, &from, ROGUE_PORT);
+        send_reply(wrong_port, &from, ROGUE_PORT);
+        static const char truncated[] = "EJSON\x04" "11";
+        sendto(responder->socket, truncated, sizeof(truncated) - 1, 0,
+               (struct sockaddr *)&from, sizeof(from));
+        send_reply(responder->socket, &from, responder->port);
+    }
+}
+
+//
+//  Run the main loop until the port is found
+//  Returns: false if not found within a simulated minute
+//
+static bool discover(const char * address, struct responder * responder, uint64_t * time) {
+    static struct sbpd_server config;
+    static struct sbpd_player player;
+    static char host[32];
+    snprintf(host, sizeof(host), "%s", address);
+    memset(&config, 0, sizeof(config));
+    memset(&player, 0, sizeof(player));
+    config.host = host;
+    uint64_t start = now_us;
+    init_discovery(SBPD_cfg_host, &config, &player, 1);
+    if (!player.server)
+        return false;
+    while (now_us - start < 60 * SCD_SECOND) {
+        poll_discovery();
+        if (player.server->port)
+            break;
+        struct pollfd ready[max_fds + 1];
+        for (int i = 0; i < numberoffds; i++) {
+            ready[i].fd = fds[i].fd;
+            ready[i].events = POLLIN;
+        }
+        ready[numberoffds].fd = responder->socket;
+        ready[numberoffds].events = POLLIN;
+        int count = poll(ready, numberoffds + 1, 1);
+        if (count <= 0) {
+            now_us += 10 * 1000;
+            continue;
+        }
+        if (ready[numberoffds].revents)
+            respond(responder);
+        for (int i = 0; i < numberoffds; i++) {
+            if (ready[i].revents) {
+                fds[i].callback(fds[i].fd, fds[i].context);
+                break;  // the registry may have changed
+            }
+        }
+    }
+    CHECK(player.server->port != ROGUE_PORT);
+    *time = now_us - start;
+    return player.server->port == responder->port;
+}
+
+static void test_case(int number, int drop_first, int drop_percent) {
+    char address[16];
+    snprintf(address, sizeof(address), "127.0.0.%d", number + 2);
+    struct responder responder = {
+        .socket = bind_udp(address, SBS_UDP_PORT),
+        .drop_first = drop_first,
+        .drop_percent = drop_percent,
+        .port = 9000 + number
+    };
+    wrong_port = bind_udp(address, SBS_UDP_PORT + 1);
+    ignored = 0;
+    malformed = 0;
+    uint64_t time = 0;
+    bool found = discover(address, &responder, &time);
+    printf("%s: %d requests, %d dropped, port found after %llu ms\n", address,
+           responder.requests, responder.dropped, (unsigned long long)(time / 1000));
+    CHECK(found);
+    CHECK(responder.requests == responder.dropped + 1);
+    // the other server, the wrong port and the malformed reply came first
+    CHECK(ignored == 2);
+    CHECK(malformed == 1);
+    if (drop_first && !drop_percent) {
+        // backoff: 250, 500, 1000, 2000, 4000, 4000 ms ...
+        uint64_t expected = 0;
+        uint64_t rto = 250 * 1000;
+        for (int i = 0; i < drop_first; i++) {
+            expected += rto;
+            rto = (rto * 2 < 4 * SCD_SECOND) ? rto * 2 : 4 * SCD_SECOND;
+        }
+        CHECK((time >= expected) && (time <= expected + 100 * 1000));
+    }
+    close(wrong_port);
+    close(responder.socket);
+}
+
+//
+//  Every case is a server of its own, discovery keeps up to 8
+//
+int main() {
+    srand(36);
+    rogue = bind_udp(ROGUE_SERVER, SBS_UDP_PORT);
+
+    printf("no loss\n");
+    test_case(0, 0, 0);
+    printf("first requests lost\n");
+    test_case(1, 1, 0);
+    test_case(2, 6, 0);
+    printf("random loss\n");
+    for (int i = 0; i < 5; i++)
+        test_case(3 + i, 0, 50);
+
+    close(rogue);
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
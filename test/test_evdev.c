@@ -0,0 +1,355 @@
+//
+//  test_evdev.c
+//  SqueezeButtonPi
+//
+//  Test for the input device reader
+//      make check
+//  The device is a FIFO fed with struct input_event, the key state ioctl
+//  is answered by the test (linked with -Wl,--wrap=ioctl). Covers batched
+//  reads, autorepeat, the resync after SYN_DROPPED and reopening a device
+//  that went away or was missing.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "evdev.h"
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+static int failures = 0;
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+//
+//  Daemon functions used by evdev.c
+//
+int log_threshold = LOG_INFO;
+uint64_t metric_counters[M_COUNTERS];
+
+void _mylog(const char * file, int line, int prio, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    printf("  log: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+uint64_t us_timer(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// retry timing is driven by the test
+static long long now_ms = 100000;
+long long ms_timer(void) {
+    return now_ms;
+}
+
+//
+//  Main loop: one descriptor is enough here
+//
+static int poll_fd = -1;
+static poll_callback_t poll_callback;
+static void * poll_context;
+
+int register_poll_fd(int fd, poll_callback_t callback, void * context) {
+    if (poll_fd >= 0)
+        return -1;
+    poll_fd = fd;
+    poll_callback = callback;
+    poll_context = context;
+    return 0;
+}
+
+void unregister_poll_fd(int fd) {
+    if (fd == poll_fd)
+        poll_fd = -1;
+}
+
+static void run_main_loop() {
+    struct pollfd ready = { .fd = poll_fd, .events = POLLIN };
+    if ((poll_fd >= 0) && (poll(&ready, 1, 100) > 0))
+        poll_callback(ready.fd, poll_context);
+}
+
+//
+//  Key state of the simulated device, returned by EVIOCGKEY
+//
+static uint8_t device_keys[(KEY_CNT + 7) / 8];
+
+static void set_device_key(int code, bool down) {
+    if (down)
+        device_keys[code / 8] |= 1 << (code % 8);
+    else
+        device_keys[code / 8] &= ~(1 << (code % 8));
+}
+
+int __real_ioctl(int fd, unsigned long request, ...);
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void * arg = va_arg(args, void *);
+    va_end(args);
+    if ((_IOC_TYPE(request) == _IOC_TYPE(EVIOCGKEY(0))) &&
+        (_IOC_NR(request) == _IOC_NR(EVIOCGKEY(0)))) {
+        size_t size = _IOC_SIZE(request);
+        memcpy(arg, device_keys, (size < sizeof(device_keys)) ? size : sizeof(device_keys));
+        return 0;
+    }
+    return __real_ioctl(fd, request, arg);
+}
+
+//
+//  Key changes reported by the device
+//
+#define max_reports 512
+static struct {
+    int code;
+    bool down;
+} reports[max_reports];
+static int numberofreports = 0;
+
+static void key_callback(const struct input_device * device, int code, bool down, uint64_t time_us) {
+    if (numberofreports < max_reports) {
+        reports[numberofreports].code = code;
+        reports[numberofreports].down = down;
+    }
+    numberofreports++;
+}
+
+static bool reported(int index, int code, bool down) {
+    return (index < numberofreports) && (reports[index].code == code) &&
+           (reports[index].down == down);
+}
+
+//
+//  Event source
+//
+static int writer = -1;
+
+static void event(int type, int code, int value) {
+    struct input_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    if (write(writer, &event, sizeof(event)) != sizeof(event))
+        perror("write");
+}
+
+static void key(int code, int value) {
+    event(EV_KEY, code, value);
+    event(EV_SYN, SYN_REPORT, 0);
+}
+
+//
+//  Tests
+//
+static void test_keys(struct input_device * device) {
+    numberofreports = 0;
+    key(KEY_PLAYPAUSE, 1);
+    key(KEY_PLAYPAUSE, 2);
+    key(KEY_PLAYPAUSE, 2);
+    event(EV_MSC, MSC_SCAN, 0xc00cd);
+    key(KEY_PLAYPAUSE, 0);
+    // a key already up doesn't come up again
+    key(KEY_PLAYPAUSE, 0);
+    run_main_loop();
+    CHECK(numberofreports == 2);
+    CHECK(reported(0, KEY_PLAYPAUSE, true));
+    CHECK(reported(1, KEY_PLAYPAUSE, false));
+}
+
+static void test_batches(struct input_device * device) {
+    numberofreports = 0;
+    uint64_t events = metric_counters[M_INPUT_EVENTS];
+    // 300 events, more than one read
+    for (int i = 0; i < 100; i++) {
+        event(EV_KEY, KEY_NEXTSONG, 1);
+        event(EV_KEY, KEY_NEXTSONG, 0);
+        event(EV_SYN, SYN_REPORT, 0);
+    }
+    run_main_loop();
+    CHECK(numberofreports == 200);
+    CHECK(reported(198, KEY_NEXTSONG, true));
+    CHECK(reported(199, KEY_NEXTSONG, false));
+    CHECK(metric_counters[M_INPUT_EVENTS] - events == 300);
+}
+
+static void test_dropped(struct input_device * device) {
+    numberofreports = 0;
+    key(KEY_VOLUMEUP, 1);
+    run_main_loop();
+    CHECK(reported(0, KEY_VOLUMEUP, true));
+
+    //
+    //  The kernel lost the volume up release and a mute press:
+    //  events up to the next report are skipped, then the key state is
+    //  taken from the device
+    //
+    numberofreports = 0;
+    set_device_key(KEY_MUTE, true);
+    event(EV_SYN, SYN_DROPPED, 0);
+    event(EV_KEY, KEY_VOLUMEDOWN, 1);
+    event(EV_KEY, KEY_VOLUMEDOWN, 0);
+    event(EV_SYN, SYN_REPORT, 0);
+    run_main_loop();
+    CHECK(numberofreports == 2);
+    CHECK(reported(0, KEY_MUTE, true));
+    CHECK(reported(1, KEY_VOLUMEUP, false));
+    CHECK(!device->dropped);
+
+    // back to normal
+    numberofreports = 0;
+    set_device_key(KEY_MUTE, false);
+    key(KEY_MUTE, 0);
+    run_main_loop();
+    CHECK(numberofreports == 1);
+    CHECK(reported(0, KEY_MUTE, false));
+}
+
+static void test_reopen(struct input_device * device, const char * path) {
+    //
+    //  Writer goes away with a key down: the device is closed,
+    //  the key never comes up
+    //
+    numberofreports = 0;
+    key(KEY_STOP, 1);
+    run_main_loop();
+    CHECK(reported(0, KEY_STOP, true));
+    close(writer);
+    writer = -1;
+    run_main_loop();
+    CHECK(device->fd < 0);
+    CHECK(poll_fd < 0);
+    CHECK(numberofreports == 1);
+
+    // opened again after INPUT_RETRY_MS, not before
+    poll_input_devices();
+    CHECK(device->fd < 0);
+    now_ms += 4999;
+    poll_input_devices();
+    CHECK(device->fd < 0);
+    now_ms += 1;
+    // keys down already are taken as they are
+    set_device_key(KEY_PLAY, true);
+    poll_input_devices();
+    CHECK(device->fd >= 0);
+    CHECK(poll_fd == device->fd);
+    writer = open(path, O_WRONLY | O_CLOEXEC);
+    CHECK(writer >= 0);
+
+    key(KEY_PLAY, 1);
+    key(KEY_PLAY, 0);
+    run_main_loop();
+    CHECK(numberofreports == 2);
+    CHECK(reported(1, KEY_PLAY, false));
+    set_device_key(KEY_PLAY, false);
+}
+
+static void test_missing(const char * path) {
+    numberofreports = 0;
+    unlink(path);
+    struct input_device * device = setup_input_device(path, false, key_callback);
+    CHECK(device != NULL);
+    if (!device)
+        return;
+    CHECK(device->fd < 0);
+    CHECK(mkfifo(path, 0600) == 0);
+    now_ms += 5000;
+    poll_input_devices();
+    CHECK(device->fd >= 0);
+    writer = open(path, O_WRONLY | O_CLOEXEC);
+    key(KEY_PAUSE, 1);
+    run_main_loop();
+    CHECK(reported(0, KEY_PAUSE, true));
+    release_input_device(device);
+    CHECK(poll_fd < 0);
+    close(writer);
+    writer = -1;
+}
+
+int main() {
+    char directory[] = "/tmp/sbpd-test-XXXXXX";
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "%s/event0", directory);
+    if (mkfifo(path, 0600) != 0) {
+        perror("mkfifo");
+        return 1;
+    }
+
+    // the device opens without blocking, the writer after it
+    struct input_device * device = setup_input_device(path, true, key_callback);
+    CHECK(device && (device->fd >= 0));
+    writer = open(path, O_WRONLY | O_CLOEXEC);
+    if (!device || (device->fd < 0) || (writer < 0)) {
+        printf("FAIL could not open %s\n", path);
+        return 1;
+    }
+
+    printf("keys\n");
+    test_keys(device);
+    printf("batches\n");
+    test_batches(device);
+    printf("dropped events\n");
+    test_dropped(device);
+    printf("reopen\n");
+    test_reopen(device, path);
+    release_input_device(device);
+    if (writer >= 0)
+        close(writer);
+    printf("missing device\n");
+    test_missing(path);
+
+    unlink(path);
+    rmdir(directory);
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,347 @@
+//
+//  test_failover.c
+//  SqueezeButtonPi
+//
+//  Failover test against a pair of local stand-in servers
+//      make test_failover && ./test_failover
+//  Server 1 is 127.0.0.1, server 2 is 127.0.0.2. Each has a JSON/RPC HTTP
+//  endpoint, a UDP discovery responder and a port 3483 listener. A
+//  stand-in player process connects to server 1. Then server 1 goes away,
+//  the player reconnects to server 2 and the next command has to fail over.
+//  Prints the time of the failed over command.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "sbpd.h"
+#include "discovery.h"
+#include "servercomm.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static int failures = 0;
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define SLIMPROTO_PORT  3483
+#define PLAYER_NAME     "sbpd-player"   // process name, 15 characters at most
+#define SERVER_1        "127.0.0.1"
+#define SERVER_2        "127.0.0.2"
+
+//
+//  Daemon functions used by discovery.c and servercomm.c
+//
+int log_threshold = LOG_WARNING;
+uint64_t metric_counters[M_COUNTERS];
+struct histogram metric_rtt;
+struct trace_header * trace_map;
+uint64_t start_us;
+
+void trace_event(uint16_t event, uint16_t a, uint32_t b) {
+}
+
+int loglevel() {
+    return log_threshold;
+}
+
+void hist_record(struct histogram * hist, uint64_t value) {
+}
+
+void _mylog(const char * file, int line, int prio, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    printf("  log: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+uint64_t us_timer(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+char * trim(char * s) {
+    while (*s == ' ')
+        s++;
+    char * end = s + strlen(s);
+    while ((end > s) && ((end[-1] == '\n') || (end[-1] == ' ')))
+        *--end = 0;
+    return s;
+}
+
+struct sbpd_player * find_player(const char * name) {
+    return NULL;
+}
+
+//
+//  Main loop descriptors
+//
+#define max_fds 8
+static struct pollfd fds[max_fds];
+static poll_callback_t callbacks[max_fds];
+static void * contexts[max_fds];
+static int numberoffds = 0;
+
+int register_poll_fd(int fd, poll_callback_t callback, void * context) {
+    if (numberoffds == max_fds)
+        return -1;
+    fds[numberoffds].fd = fd;
+    fds[numberoffds].events = POLLIN;
+    callbacks[numberoffds] = callback;
+    contexts[numberoffds] = context;
+    numberoffds++;
+    return 0;
+}
+
+void unregister_poll_fd(int fd) {
+    for (int i = 0; i < numberoffds; i++) {
+        if (fds[i].fd == fd) {
+            numberoffds--;
+            fds[i] = fds[numberoffds];
+            callbacks[i] = callbacks[numberoffds];
+            contexts[i] = contexts[numberoffds];
+            return;
+        }
+    }
+}
+
+//
+//  Stand-ins
+//
+static struct sockaddr_in address_of(const char * address, uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address, &addr.sin_addr);
+    return addr;
+}
+
+static int bound_socket(int type, const char * address, uint16_t port) {
+    int fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr = address_of(address, port);
+    if ((fd < 0) || (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+        ((type == SOCK_STREAM) && (listen(fd, 4) != 0))) {
+        printf("FAIL can't bind %s:%u\n", address, port);
+        exit(1);
+    }
+    return fd;
+}
+
+//
+//  JSON/RPC endpoint: every POST gets an empty result, connections are kept
+//
+static void serve_http(int listener) {
+    while (true) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0)
+            continue;
+        char request[4096];
+        size_t length = 0;
+        ssize_t size;
+        while ((size = recv(client, request + length, sizeof(request) - 1 - length, 0)) > 0) {
+            length += size;
+            request[length] = 0;
+            char * body = strstr(request, "\r\n\r\n");
+            if (!body)
+                continue;
+            char * header = strcasestr(request, "Content-Length:");
+            size_t body_length = header ? strtoul(header + 15, NULL, 10) : 0;
+            body += 4;
+            if (request + length - body < (ssize_t)body_length)
+                continue;
+            static const char reply[] = "HTTP/1.1 200 OK\r\n"
+                                        "Content-Type: application/json\r\n"
+                                        "Content-Length: 13\r\n\r\n"
+                                        "{\"result\":{}}";
+            send(client, reply, sizeof(reply) - 1, MSG_NOSIGNAL);
+            length -= body + body_length - request;
+            memmove(request, body + body_length, length);
+        }
+        close(client);
+    }
+}
+
+static pid_t start_http(const char * address, uint16_t port) {
+    int listener = bound_socket(SOCK_STREAM, address, port);
+    pid_t pid = fork();
+    if (!pid) {
+        serve_http(listener);
+        _exit(0);
+    }
+    close(listener);
+    return pid;
+}
+
+//
+//  Player: a process holding a connection to the server's port 3483
+//
+static pid_t start_player(const char * server) {
+    pid_t pid = fork();
+    if (!pid) {
+        prctl(PR_SET_NAME, PLAYER_NAME);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = address_of(server, SLIMPROTO_PORT);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            _exit(1);
+        pause();
+        _exit(0);
+    }
+    return pid;
+}
+
+static void stop(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+//
+//  Discovery responder
+//
+static void answer_discovery(int fd, const char * port, const char * uuid) {
+    char packet[256];
+    struct sockaddr_in from;
+    socklen_t size = sizeof(from);
+    if (recvfrom(fd, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&from, &size) <= 0)
+        return;
+    int length = snprintf(packet, sizeof(packet), "ENAME%cxJSON%c%sUUID%c%s",
+                          1, (int)strlen(port), port, (int)strlen(uuid), uuid);
+    sendto(fd, packet, length, 0, (struct sockaddr *)&from, size);
+}
+
+static int discovery_1;
+static int discovery_2;
+
+//
+//  Run the main loop for a while
+//
+static void run(uint64_t duration_us) {
+    uint64_t end = us_timer() + duration_us;
+    while (us_timer() < end) {
+        poll_discovery();
+        answer_discovery(discovery_1, "9001", "11111111-1111-4111-8111-111111111111");
+        answer_discovery(discovery_2, "9002", "22222222-2222-4222-8222-222222222222");
+        if (poll(fds, numberoffds, 20) <= 0)
+            continue;
+        for (int i = 0; i < numberoffds; i++) {
+            if (fds[i].revents) {
+                callbacks[i](fds[i].fd, contexts[i]);
+                break;  // the registry may have changed
+            }
+        }
+    }
+}
+
+static bool send_pause(struct sbpd_player * player, uint64_t * time_us) {
+    char fragment[] = "[\"pause\"]";
+    uint64_t start = us_timer();
+    bool sent = send_command(player, LMS, fragment, NULL);
+    *time_us = us_timer() - start;
+    return sent;
+}
+
+int main() {
+    int slimproto_1 = bound_socket(SOCK_STREAM, SERVER_1, SLIMPROTO_PORT);
+    int slimproto_2 = bound_socket(SOCK_STREAM, SERVER_2, SLIMPROTO_PORT);
+    discovery_1 = bound_socket(SOCK_DGRAM, SERVER_1, SLIMPROTO_PORT);
+    discovery_2 = bound_socket(SOCK_DGRAM, SERVER_2, SLIMPROTO_PORT);
+    pid_t http_1 = start_http(SERVER_1, 9001);
+    pid_t http_2 = start_http(SERVER_2, 9002);
+    pid_t player_1 = start_player(SERVER_1);
+
+    static char mac[] = "aa:bb:cc:dd:ee:ff";
+    static struct sbpd_player players[1] = { { NULL, mac, PLAYER_NAME, NULL } };
+    static struct sbpd_server server;
+    start_us = us_timer();
+    init_discovery(0, &server, players, 1);
+    add_candidate_server(SERVER_2);
+    init_comm();
+
+    //
+    //  Find server 1 and the ports of both
+    //
+    run(SCD_SECOND);
+    CHECK(players[0].server && !strcmp(players[0].server->host, SERVER_1));
+    uint64_t time;
+    bool sent = send_pause(players, &time);
+    printf("server 1: %s in %llu us\n", sent ? "sent" : "failed", (unsigned long long)time);
+    CHECK(sent);
+
+    //
+    //  Server 1 goes away, the player reconnects to server 2
+    //
+    stop(http_1);
+    stop(player_1);
+    pid_t player_2 = start_player(SERVER_2);
+    usleep(50 * 1000);
+    sent = send_pause(players, &time);
+    printf("failover: %s in %llu us, %llu failovers\n", sent ? "sent" : "failed",
+           (unsigned long long)time,
+           (unsigned long long)metric_counters[M_COMMANDS_FAILOVER]);
+    CHECK(sent);
+    CHECK(metric_counters[M_COMMANDS_FAILOVER] == 1);
+    CHECK(players[0].server && !strcmp(players[0].server->host, SERVER_2));
+
+    sent = send_pause(players, &time);
+    printf("server 2: %s in %llu us\n", sent ? "sent" : "failed", (unsigned long long)time);
+    CHECK(sent);
+
+    shutdown_comm();
+    stop(player_2);
+    stop(http_2);
+    close(slimproto_1);
+    close(slimproto_2);
+    close(discovery_1);
+    close(discovery_2);
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+//
+//  tlv.c
+//  SqueezeButtonPi
+//
+//  Decoder for server discovery replies
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "tlv.h"
+
+#include <string.h>
+
+#define SBS_DEFAULT_PORT 9000
+
+//
+//  Iterate over the fields of a packet
+//  Every read is checked against the remaining size before it happens
+//
+int tlv_next(const char * packet, size_t size, size_t * pos, struct tlv_field * field) {
+    if (*pos >= size)
+        return 0;
+    if (size - *pos < TLV_HEADER_SIZE)
+        return -1;
+    const uint8_t * header = (const uint8_t *)packet + *pos;
+    size_t length = header[4];
+    if (size - *pos - TLV_HEADER_SIZE < length)
+        return -1;
+    field->tag = TLV_TAG(header[0], header[1], header[2], header[3]);
+    field->length = (uint8_t)length;
+    field->value = packet + *pos + TLV_HEADER_SIZE;
+    *pos += TLV_HEADER_SIZE + length;
+    return 1;
+}
+
+//
+//  Copy a field value into a terminated string buffer
+//
+static void copy_value(char * buffer, size_t size, const struct tlv_field * field) {
+    size_t length = (field->length < size) ? field->length : size - 1;
+    memcpy(buffer, field->value, length);
+    buffer[length] = 0;
+}
+
+//
+//  Parse the JSON port: decimal digits only, 1 - 65535
+//
+static uint16_t parse_port(const struct tlv_field * field) {
+    if (!field->length || (field->length > 5))
+        return 0;
+    uint32_t port = 0;
+    for (int i = 0; i < field->length; i++) {
+        char digit = field->value[i];
+        if ((digit < '0') || (digit > '9'))
+            return 0;
+        port = port * 10 + (uint32_t)(digit - '0');
+    }
+    return (port <= UINT16_MAX) ? (uint16_t)port : 0;
+}
+
+//
+//  Decode a discovery reply
+//
+bool parse_discovery_reply(const char * packet, size_t size, struct discovery_reply * reply) {
+    reply->name[0] = 0;
+    reply->uuid[0] = 0;
+    reply->port = SBS_DEFAULT_PORT;
+    if (!size || (packet[0] != 'E'))
+        return false;
+
+    size_t pos = 0;
+    struct tlv_field field;
+    int result;
+    while ((result = tlv_next(packet + 1, size - 1, &pos, &field)) > 0) {
+        switch (field.tag) {
+            case TLV_TAG('N', 'A', 'M', 'E'):
+                copy_value(reply->name, sizeof(reply->name), &field);
+                break;
+            case TLV_TAG('U', 'U', 'I', 'D'):
+                copy_value(reply->uuid, sizeof(reply->uuid), &field);
+                break;
+            case TLV_TAG('J', 'S', 'O', 'N'):
+                reply->port = parse_port(&field);
+                if (!reply->port)
+                    return false;
+                break;
+            default:
+                break;
+        }
+    }
+    return result == 0;
+}
@@ -0,0 +1,91 @@
+//
+//  tlv.h
+//  SqueezeButtonPi
+//
+//  Decoder for server discovery replies
+//  Replies are 'E' followed by fields of a 4 character tag, a length byte
+//  and the value. Nothing is allocated, values point into the packet.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef tlv_h
+#define tlv_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+//  Build a tag from its characters, independent of alignment and byte order
+//
+#define TLV_TAG(a, b, c, d) \
+    (((uint32_t)(uint8_t)(a) << 24) | ((uint32_t)(uint8_t)(b) << 16) | \
+     ((uint32_t)(uint8_t)(c) << 8) | (uint32_t)(uint8_t)(d))
+
+#define TLV_HEADER_SIZE 5   // tag and length byte
+
+struct tlv_field {
+    uint32_t        tag;
+    const char *    value;  // not terminated
+    uint8_t         length;
+};
+
+//
+//  Iterate over the fields of a packet
+//
+//  Parameters:
+//      packet, size: the fields, without the leading 'E'
+//      pos: iterator position, start with 0
+//      field: the next field
+//  Returns: 1 if a field was read, 0 at the end of the packet,
+//           -1 if the packet is truncated
+//
+int tlv_next(const char * packet, size_t size, size_t * pos, struct tlv_field * field);
+
+//
+//  Decoded discovery reply
+//  Strings are always terminated and truncated to the buffer sizes
+//
+struct discovery_reply {
+    char        name[65];
+    char        uuid[37];
+    uint16_t    port;       // JSON port, 9000 if not in the reply
+};
+
+//
+//  Decode a discovery reply
+//
+//  Parameters:
+//      packet, size: the complete reply
+//      reply: decoded fields
+//  Returns: false if this isn't a well formed reply with a valid port
+//
+bool parse_discovery_reply(const char * packet, size_t size, struct discovery_reply * reply);
+
+#endif /* tlv_h */
@@ -0,0 +1,98 @@
+//
+//  trace.c
+//  SqueezeButtonPi
+//
+//  Binary event trace
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "trace.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct trace_header * trace_map = NULL;
+static struct trace_record * trace_records = NULL;
+
+//
+//  Write one record
+//  Safe to call from any thread, the slot is claimed atomically
+//
+void trace_event(uint16_t event, uint16_t a, uint32_t b) {
+    uint64_t index = __atomic_fetch_add(&trace_map->written, 1, __ATOMIC_RELAXED);
+    struct trace_record * record = trace_records + (index & (TRACE_RECORDS - 1));
+    record->time_us = us_timer();
+    record->event = event;
+    record->a = a;
+    record->b = b;
+}
+
+//
+//  Start tracing to a file
+//
+int start_trace(const char * path) {
+    size_t size = sizeof(struct trace_header) + TRACE_RECORDS * sizeof(struct trace_record);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        logerr("Trace: can't open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        logerr("Trace: can't size %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    void * map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        logerr("Trace: can't map %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct trace_header * header = map;
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(struct trace_record);
+    header->capacity = TRACE_RECORDS;
+    header->written = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->start_realtime = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    header->start_monotonic = us_timer();
+    trace_records = (struct trace_record *)(header + 1);
+    __atomic_store_n(&trace_map, header, __ATOMIC_RELEASE);
+    loginfo("Tracing to %s", path);
+    return 0;
+}
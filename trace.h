@@ -0,0 +1,106 @@
+//
+//  trace.h
+//  SqueezeButtonPi
+//
+//  Binary event trace
+//  Fixed size event records are written to a memory mapped file,
+//  no formatting at runtime. Decode offline with sbpd-trace.
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#ifndef trace_h
+#define trace_h
+
+#include "sbpd.h"
+
+#define TRACE_MAGIC     "SBPDTRC1"
+#define TRACE_VERSION   1
+#define TRACE_RECORDS   65536   // power of two, 1 MiB of records
+
+//
+//  Trace events
+//  Meaning of the a and b fields per event
+//
+enum {
+    TRACE_EDGE = 1,         // a: pin, b: level
+    TRACE_PRESS,            // a: pin, b: press type
+    TRACE_STEP,             // a: encoder pin a, b: value
+    TRACE_DISPATCH,         // a: pin, b: press type or encoder delta
+    TRACE_SEND_START,       // a: command type, b: 0
+    TRACE_SEND_END,         // a: command type, b: success
+    TRACE_DISCOVERY,        // a: 0 server, 1 port, b: IPv4 address (low 32 bits for IPv6) or port
+    TRACE_KEY,              // a: input device key code, b: press type
+    TRACE_EVENTS
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t reserved;
+    uint64_t written;       // records written, the ring wraps at capacity
+    uint64_t start_realtime;// µs since epoch when tracing started
+    uint64_t start_monotonic;// us_timer() when tracing started
+};
+
+struct trace_record {
+    uint64_t time_us;       // us_timer() time base
+    uint16_t event;
+    uint16_t a;
+    uint32_t b;
+};
+
+//
+//  Mapped trace, NULL if tracing is off
+//
+extern struct trace_header * trace_map;
+
+#define trace(event, a, b) \
+    do { \
+        if (trace_map) \
+            trace_event(event, a, b); \
+    } while (0)
+
+//
+//  Write one record
+//
+void trace_event(uint16_t event, uint16_t a, uint32_t b);
+
+//
+//  Start tracing to a file
+//  Parameters:
+//      path: trace file, created or overwritten
+//  Returns: 0 on success
+//
+int start_trace(const char * path);
+
+#endif /* trace_h */
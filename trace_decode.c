@@ -0,0 +1,96 @@
+//
+//  trace_decode.c
+//  SqueezeButtonPi
+//
+//  sbpd-trace: decode a binary trace written by sbpd -t
+//
+//
+//  Copyright (c) 2017, Joerg Schwieder, PenguinLovesMusic.com
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//   * Neither the name of ickStream nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+//  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+//  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+//  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+//  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+//  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char * event_names[TRACE_EVENTS] = {
+    "?", "edge", "press", "step", "dispatch", "send-start", "send-end", "discovery",
+    "key"
+};
+
+int main(int argc, char * argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0) ||
+        (st.st_size < (off_t)sizeof(struct trace_header))) {
+        fprintf(stderr, "Can't read %s\n", argv[1]);
+        return 1;
+    }
+    void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s\n", argv[1]);
+        return 1;
+    }
+    const struct trace_header * header = map;
+    if ((memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != TRACE_VERSION) ||
+        (header->record_size != sizeof(struct trace_record)) ||
+        (header->capacity == 0) ||
+        (st.st_size < (off_t)(sizeof(*header) + (uint64_t)header->capacity * header->record_size))) {
+        fprintf(stderr, "%s is not a sbpd trace\n", argv[1]);
+        return 1;
+    }
+    const struct trace_record * records = (const struct trace_record *)(header + 1);
+    uint64_t written = header->written;
+    uint64_t first = (written > header->capacity) ? written - header->capacity : 0;
+    uint64_t last_us = 0;
+    printf("%llu records, %llu lost to wrap around\n",
+           (unsigned long long)(written - first), (unsigned long long)first);
+    for (uint64_t index = first; index < written; index++) {
+        const struct trace_record * record = records + (index % header->capacity);
+        uint64_t time_us = header->start_realtime + (record->time_us - header->start_monotonic);
+        printf("%llu.%06llu %+9lldus %-10s a=%u b=%u\n",
+               (unsigned long long)(time_us / 1000000),
+               (unsigned long long)(time_us % 1000000),
+               (long long)(last_us ? record->time_us - last_us : 0),
+               (record->event < TRACE_EVENTS) ? event_names[record->event] : "?",
+               record->a, record->b);
+        last_us = record->time_us;
+    }
+    return 0;
+}